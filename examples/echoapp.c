@@ -58,40 +58,30 @@ struct app_conn {
     TAPS_CTX            *taps;
 };
 
-struct app_msg {
-    uint8_t              buf[BUF_SIZE];
-    TAPS_CTX            *taps;
-};
-
 /* Callbacks */
+/* Receives use messages from the TAPS buffer pool, which TAPS passes as the
+   message context. Those same messages are echoed back, so the message context
+   is the TAPS message on the send side too. */
 static void
 _app_send_error(void *conn, void *msg, char *reason)
 {
-    struct app_msg *m = msg;
-
     TAPS_TRACE();
     PRINT_RESULT("Sending failed", reason);
-    tapsMessageFree(m->taps);
+    tapsMessageFree(msg);
 }
 
 static void
 _app_expired(void *conn, void *msg)
 {
-    struct app_msg *m = msg;
-
     TAPS_TRACE();
-    tapsMessageFree(m->taps);
-    free(m);
+    tapsMessageFree(msg);
 }
 
 static void
 _app_sent(void *conn, void *msg)
 {
-    struct app_msg *m = msg;
-
     TAPS_TRACE();
-    tapsMessageFree(m->taps);
-    free(m);
+    tapsMessageFree(msg);
 }
 
 void _app_received_partial(void *conn, void *msg, size_t bytes, int eom);
@@ -108,42 +98,30 @@ void
 _app_received_partial(void *conn, void *msg, size_t bytes, int eom)
 {
     struct app_conn *c = conn;
-    struct app_msg  *m = msg;
     void            *text;
     size_t           len;
 
     TAPS_TRACE();
-    text = tapsMessageGetFirstBuf(m->taps, &len);
+    text = tapsMessageGetFirstBuf(msg, &len);
     printf("Received:\n%.*s", (int)bytes, (char *)text);
-    tapsMessageTruncate(m->taps, bytes);
-    if (tapsConnectionSend(c->taps, m->taps, m, &c->l->callbacks) < 0) {
+    tapsMessageTruncate(msg, bytes);
+    if (tapsConnectionSend(c->taps, msg, msg, &c->l->callbacks) < 0) {
         printf("Send failed\n");
-        tapsMessageFree(m->taps);
-        free(m);
+        tapsMessageFree(msg);
     }
     /* Get ready for more! */
-    m = malloc(sizeof(struct app_msg));
-    if (!m) {
-        printf("malloc failed, not receiving anymore\n");
-        exit(-1);
-    }
-    m->taps = tapsMessageNew(m->buf, BUF_SIZE);
-    if (m->taps) {
-        tapsConnectionReceive(c->taps, m, m->taps, MIN_BUF, BUF_SIZE,
-                &c->l->callbacks);
-    } else {
-        printf("out of memory, not receiving anymore\n");
+    if (tapsConnectionReceive(c->taps, NULL, NULL, MIN_BUF, BUF_SIZE,
+            &c->l->callbacks) < 0) {
+        printf("not receiving anymore\n");
     }
 }
 
 static void
 _app_receive_error(void *conn, void *msg, char *reason)
 {
-    struct app_msg *m = msg;
-
     TAPS_TRACE();
     PRINT_RESULT("Receive failed", reason);
-    free(m);
+    if (msg) tapsMessageFree(msg);
 }
 
 static void
@@ -171,7 +149,6 @@ _app_connection_received(void *listener, TAPS_CTX *conn, void **cb)
 {
     struct app_listener  *l = listener;
     struct app_conn      *c = malloc(sizeof(struct app_conn));
-    struct app_msg       *m;
 
     TAPS_TRACE();
     if (!c) {
@@ -181,17 +158,9 @@ _app_connection_received(void *listener, TAPS_CTX *conn, void **cb)
     c->l = l;
     c->taps = conn;
     *cb = (void *)&l->callbacks;
-    m = malloc(sizeof(struct app_msg));
-    if (!m) {
-        printf("malloc failed, not receiving anymore\n");
-        exit(-1);
-    }
-    m->taps = tapsMessageNew(m->buf, BUF_SIZE);
-    if (m->taps) {
-        tapsConnectionReceive(c->taps, m, m->taps, MIN_BUF, BUF_SIZE,
-                &c->l->callbacks);
-    } else {
-        printf("out of memory not receiving\n");
+    if (tapsConnectionReceive(c->taps, NULL, NULL, MIN_BUF, BUF_SIZE,
+            &c->l->callbacks) < 0) {
+        printf("not receiving\n");
     }
     return c;
 }
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* proto_memory.c */
+/* Connection and receive buffer memory, the same for every module. See
+   proto_memory.h. */
+#include <stdlib.h>
+#include "../taps.h"
+#include "proto_memory.h"
+
+static ConnAllocCb   connAlloc = NULL;
+static ConnReleaseCb connRelease = NULL;
+static RecvAllocCb   recvAlloc = NULL;
+static RecvReleaseCb recvRelease = NULL;
+
+void
+SetConnectionMemory(ConnAllocCb alloc, ConnReleaseCb release)
+{
+    TAPS_TRACE();
+    connAlloc = alloc;
+    connRelease = release;
+}
+
+void
+SetReceiveBuffers(RecvAllocCb alloc, RecvReleaseCb release)
+{
+    TAPS_TRACE();
+    recvAlloc = alloc;
+    recvRelease = release;
+}
+
+void *
+protoConnAlloc(size_t size)
+{
+    return (connAlloc) ? (connAlloc)(size) : malloc(size);
+}
+
+void
+protoConnFree(void *ctx)
+{
+    if (connRelease) {
+        (connRelease)(ctx);
+    } else {
+        free(ctx);
+    }
+}
+
+struct iovec *
+protoReceiveLend(void *receive_ctx, int *iovcnt)
+{
+    return (recvAlloc) ? (recvAlloc)(receive_ctx, iovcnt) : NULL;
+}
+
+int
+protoReceiveBuffer(struct iovec **buffer, int *iovcnt, int *posted,
+        void *receive_ctx, ReceiveErrorCb receiveError)
+{
+    if (*buffer) {
+        return 0;
+    }
+    *buffer = protoReceiveLend(receive_ctx, iovcnt);
+    if (*buffer) {
+        return 1;
+    }
+    *posted = 0;
+    (receiveError)(receive_ctx, NULL, "Out of receive buffers");
+    return -1;
+}
+
+int
+protoReceiveRelease(void *receive_ctx)
+{
+    if (!recvRelease) {
+        return 0;
+    }
+    (recvRelease)(receive_ctx);
+    return 1;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+#ifndef _PROTO_MEMORY_H
+#define _PROTO_MEMORY_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "../taps_protocol.h"
+
+/* Where a module's connection contexts and receive buffers come from. This
+   file defines SetConnectionMemory() and SetReceiveBuffers() for every
+   module that links it in, and keeps what TAPS passes them. TAPS may supply
+   an allocator, so that its connection object shares the allocation, and
+   may lend receive buffers, taken only once there is data for them. */
+
+/* Hidden, so that each module binds to its own copy, as in tcp_stream.h */
+#pragma GCC visibility push(hidden)
+
+/* A connection context of size bytes, from TAPS if it gave an allocator, or
+   malloc(). NULL if there is no memory. */
+void *protoConnAlloc(size_t size);
+/* Give back a context from protoConnAlloc() */
+void protoConnFree(void *ctx);
+
+/* A buffer from TAPS for the Receive of receive_ctx, or NULL if it lends
+   none, or has none left */
+struct iovec *protoReceiveLend(void *receive_ctx, int *iovcnt);
+/* For a Receive posted without a buffer, just before there is data for it:
+   if *buffer is NULL, borrow one. Returns 1 if it was lent now, 0 if there
+   already was one, and -1 if there is none, in which case the Receive has
+   failed: *posted is cleared and receiveError called. */
+int protoReceiveBuffer(struct iovec **buffer, int *iovcnt, int *posted,
+        void *receive_ctx, ReceiveErrorCb receiveError);
+/* The read found nothing after all; give back the buffer lent for
+   receive_ctx, to be asked for again next time. Returns 0 if TAPS takes
+   none back, and the buffer stays with the Receive. */
+int protoReceiveRelease(void *receive_ctx);
+
+#pragma GCC visibility pop
+
+#endif /* _PROTO_MEMORY_H */
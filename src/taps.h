@@ -38,6 +38,7 @@
 #include <event2/event.h>
 #include <event2/util.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -73,6 +74,10 @@ typedef void (*tapsCbExpired)(void *, void *);
 /* Arg 2: the application's message context
    Arg 3: Reason string. Might be NULL */
 typedef void (*tapsCbSendError)(void *, void *, char *);
+/* Send queue flow control; see tapsConnectionSetSendBuffer(). No arguments
+   beyond the connection context. */
+typedef void (*tapsCbSendBufferHigh)(void *);
+typedef void (*tapsCbSendBufferLow)(void *);
 
 /* Receiving: Section 9.3 */
 /* Arg 2: the application's message context. This should include the TAPS
@@ -102,6 +107,8 @@ typedef struct {
     tapsCbSent               sent;
     tapsCbExpired            expired;
     tapsCbSendError          sendError;
+    tapsCbSendBufferHigh     sendBufferHigh;
+    tapsCbSendBufferLow      sendBufferLow;
     tapsCbReceived           received;
     tapsCbReceivedPartial    receivedPartial;
     tapsCbReceiveError       receiveError;
@@ -123,17 +130,21 @@ int tapsEndpointWithIPv4Address(TAPS_CTX *endp, char *ipv4);
 int tapsEndpointWithIPv6Address(TAPS_CTX *endp, char *ipv6);
 int tapsEndpointWithInterface(TAPS_CTX *endp, char *ifname);
 int tapsEndpointWithProtocol(TAPS_CTX *endp, char *protoName);
+/* A socket file, for peers on the same host. An endpoint with a path, and no
+   address other than loopback, is local; see tapsPreconnectionListen. */
+int tapsEndpointWithPath(TAPS_CTX *endp, char *path);
 /* Alias two endpoints together */
 int tapsAddAlias(TAPS_CTX *endp1, TAPS_CTX *endp2);
 /* Attach a stun server. */
 /* XXX No support for doing anything with this */
 int tapsWithStunServer(TAPS_CTX *endp, char *addr, uint16_t port,
         void *credentials, size_t credentials_len);
-/* Valid values: "ipv4", "ipv6", "hostname", "service", "protocol", "interface".
- * Returns NULL if not present, or incorrect input. *buf is where the string
- * will be copied. */
+/* Valid values: "ipv4", "ipv6", "hostname", "service", "protocol", "interface",
+ * "path". Returns NULL if not present, or incorrect input. *buf is where the
+ * string will be copied. */
 const char *tapsEndpointGetProperty(TAPS_CTX *endp, char *name, char *buf);
-/* Returns -1 on failure */
+/* Fill in an address of the family addr->sa_family: AF_INET, AF_INET6, or
+ * AF_UNIX (a struct sockaddr_un) from the path. Returns -1 on failure */
 int tapsEndpointGetAddress(TAPS_CTX *endp, struct sockaddr *addr);
 /* Clean up the instance. */
 void tapsEndpointFree(TAPS_CTX *endp);
@@ -232,6 +243,19 @@ int tapsInitiateWithSend(int preconnection, unsigned int timeoutSec,
  */
 TAPS_CTX *tapsPreconnectionListen(TAPS_CTX *preconn, void *app_ctx,
         struct event_base *base, tapsCallbacks *callbacks);
+/* Like tapsPreconnectionListen, but with one listening socket per event_base,
+ * all on the same address, and the kernel spreading new connections across
+ * them. Each connection lives on the base that accepted it, so with a thread
+ * per base, the app sees connectionReceived and connection events on several
+ * threads at once. Stopping and freeing the listener work on all of them;
+ * stopped fires once, after every base has stopped listening and has no
+ * connections left, on that base's thread. Unless all the bases run on one
+ * thread, the app must enable libevent's thread support (e.g.
+ * evthread_use_pthreads()) before creating them. Fails with EOPNOTSUPP if
+ * the protocol can't share an address this way.
+ */
+TAPS_CTX *tapsPreconnectionListenSharded(TAPS_CTX *preconn, void *app_ctx,
+        struct event_base **bases, int numBases, tapsCallbacks *callbacks);
 void tapsPreconnectionFree(TAPS_CTX *pc);
 
 /* LISTENERS */
@@ -241,6 +265,20 @@ void tapsPreconnectionFree(TAPS_CTX *pc);
  * event_base and other data structures, which should improve the scalability
  * of servers. */
 int tapsListenerStop(TAPS_CTX *listener, tapsCallbacks *callbacks);
+/* The most connections a listener takes off the accept queue each time it is
+ * woken up, if the protocol supports that; they are then set up together.
+ * Applies to listeners created afterwards. The default is 64. */
+void tapsListenerSetAcceptBudget(unsigned int budget);
+/* For connectionless protocols, the ms a peer may send nothing, and be sent
+ * nothing, before its connection closes. Applies to listeners created
+ * afterwards. 0 restores the protocol's default (two minutes for UDP). */
+void tapsListenerSetPeerIdleTimeout(unsigned int ms);
+/* For connectionless protocols, the datagrams a peer may send within about a
+ * second before it gets a socket of its own, connected to it, that shares
+ * the listener's address. Applies to listeners created afterwards. 0, the
+ * default, never does, and the address is then only shared between the
+ * shards of one listener. */
+void tapsListenerSetBusyPeerDatagrams(unsigned int datagrams);
 /* Warning: DO NOT call tapsListenerFree in the "stopped" callback function.
    The stopped callback function is likely called by the protocol
    implementation's own callback. tapsListenerFree will close the shared
@@ -285,27 +323,128 @@ void tapsGetProperty(int connection, char *propertyName, void *value);
 TAPS_CTX *tapsMessageNew(void *data, size_t len);
 void *tapsMessageGetFirstBuf(TAPS_CTX *message, size_t *len);
 struct iovec *tapsMessageGetIovec(TAPS_CTX *message, int *iovcnt);
+/* Create a message for sending len bytes of an open file, from offset. If the
+ * protocol can send straight from the file (TCP uses sendfile()), the data
+ * never passes through userspace; otherwise TAPS maps the range into memory
+ * when the message is sent, or when the app asks for its buffers. The fd
+ * stays the app's: keep it open until the message is freed. */
+TAPS_CTX *tapsMessageNewFile(int fd, off_t offset, size_t len);
+/* Message properties (Sec 9.1.3). Lower msgPrio values are sent first, ahead
+ * of queued messages with higher values on the same connection; messages of
+ * equal priority keep their order. msgLifetime is in milliseconds, and 0
+ * (the default) means forever. A message that is still queued when its
+ * lifetime is up is dropped, and the app gets the expired callback instead of
+ * sent; once it has been handed to the protocol, it will be sent. */
+#define TAPS_MSG_PRIO_DEFAULT 100
+void tapsMessageSetPriority(TAPS_CTX *message, unsigned int prio);
+unsigned int tapsMessageGetPriority(TAPS_CTX *message);
+void tapsMessageSetLifetime(TAPS_CTX *message, unsigned int lifetime);
+unsigned int tapsMessageGetLifetime(TAPS_CTX *message);
 /* Shrink the iovec to length. This DOES NOT free the buffer memory */
 void tapsMessageTruncate(TAPS_CTX *message, size_t length);
 /* If the message was sent via Send or Receive, DO NOT call Free() until
  * one of the send or receive events for that message has returned */
 void tapsMessageFree(TAPS_CTX *message);
+/* Messages that TAPS allocates for receives (see tapsConnectionReceive) come
+ * from a pool of 2MB arenas, which use transparent huge pages if available.
+ * Set this before the first receive to try explicit huge pages
+ * (MAP_HUGETLB) first; this needs pages reserved in vm.nr_hugepages. */
+void tapsMessagePoolUseHugePages(bool enable);
 
 /* CONNECTIONS */
-/* Sending (Sec 9.2) */
+/* Sending (Sec 9.2). If the protocol can send the message at once, the sent
+ * callback comes before this returns. Sends made from inside a sent callback
+ * are queued, and go out once that callback returns. Any callback, including
+ * one made inside tapsConnectionSend, may free the connection; TAPS is done
+ * with it once the callback returns, and fails whatever is still queued with
+ * sendError or receiveError. Don't use the connection after such a call. */
 int tapsConnectionSend(TAPS_CTX *connection, TAPS_CTX *msg, void *app_ctx,
         tapsCallbacks *callbacks);
-#if 0
-void tapsStartBatch(int connection);
-void tapsEndBatch(int connection);
-#endif
+/* Between tapsStartBatch and tapsEndBatch, sends are held and then handed to
+ * the protocol together, as a single vectored send of up to IOV_MAX buffers.
+ * Each message still gets its own sent, expired, or sendError callback.
+ * Messages queued while an earlier send is in progress are coalesced the same
+ * way, batch or not. Batches may nest; sending starts at the last
+ * tapsEndBatch. */
+void tapsStartBatch(TAPS_CTX *connection);
+void tapsEndBatch(TAPS_CTX *connection);
+/* Allow up to 'window' sends to be outstanding with the protocol at once,
+ * instead of one. The window is capped at what the protocol supports.
+ * Returns the window in effect, or -1 with errno set. Fails with EBUSY if any
+ * sends are in progress. */
+int tapsConnectionSetSendWindow(TAPS_CTX *connection, unsigned int window);
+/* Watermarks on messages queued for sending but not yet reported sent. When
+ * either highBytes or highMsgs is reached, TAPS calls sendBufferHigh, and the
+ * app should stop sending; when the queue falls to both lowBytes and lowMsgs,
+ * it calls sendBufferLow. A high value of 0 means no limit on that measure;
+ * by default there is none on either. Sends are not refused above the high
+ * mark. lowBytes is also passed to the protocol, so one with its own buffer
+ * (like TCP) can hold completions until it has drained that far. Returns 0,
+ * or -1 with errno set. */
+int tapsConnectionSetSendBuffer(TAPS_CTX *connection, size_t lowBytes,
+        size_t highBytes, unsigned int lowMsgs, unsigned int highMsgs);
+/* Send messages of at least 'threshold' bytes without copying them into the
+ * kernel (TCP uses MSG_ZEROCOPY); 0 turns this off. The sent callback then
+ * waits until the kernel is done with the buffers, which is after the peer
+ * has acknowledged the data, so only use it for large messages (hundreds of
+ * KB) that the app would otherwise keep anyway. Where the kernel would copy
+ * regardless, as over loopback, the protocol quietly goes back to copying.
+ * Returns 0, or -1 with errno set: EOPNOTSUPP if the protocol can't. */
+int tapsConnectionSetZeroCopy(TAPS_CTX *connection, size_t threshold);
+/* Protocol tuning. Each returns 0, or -1 with errno set: EOPNOTSUPP if the
+ * protocol doesn't have the property.
+ * keepAliveTimeout (Sec 8.1.4): send a keep-alive after the connection has
+ * been idle for this many seconds; 0 turns keep-alives off.
+ * User timeout (Sec 8.2, TCP only): drop the connection if sent data stays
+ * unacknowledged for ms; 0 restores the system default.
+ * connCapacityProfile (Sec 8.1.6): how the connection's traffic should be
+ * treated. The interactive and non-interactive low-latency profiles turn off
+ * Nagle's algorithm; TCP also marks packets with a matching DSCP and socket
+ * priority, and runs TAPS_SCAVENGER with a background congestion controller
+ * where the system allows it. */
+typedef enum { TAPS_DEFAULT, TAPS_SCAVENGER, TAPS_INTERACTIVE_CAP,
+    TAPS_NON_INTERACTIVE, TAPS_CONSTANT_RATE, TAPS_CAPACITY_SEEKING }
+    tapsCapacity;
+int tapsConnectionSetKeepAlive(TAPS_CTX *connection, unsigned int seconds);
+int tapsConnectionSetUserTimeout(TAPS_CTX *connection, unsigned int ms);
+int tapsConnectionSetCapacityProfile(TAPS_CTX *connection,
+        tapsCapacity profile);
+/* Timeouts, in milliseconds; 0 (the default) turns them off. When one fires,
+ * TAPS aborts the connection and the app gets connectionError with the reason.
+ * Both return 0, or -1 with errno set: EOPNOTSUPP if the protocol can't abort
+ * connections.
+ * Idle (connTimeout, Sec 8.1.3): nothing has been sent or received for ms.
+ * Receive: a receive has not completed ms after it started. It fails with
+ * receiveError first. This applies from the next receive. */
+int tapsConnectionSetIdleTimeout(TAPS_CTX *connection, unsigned int ms);
+int tapsConnectionSetReceiveTimeout(TAPS_CTX *connection, unsigned int ms);
+/* Send rate bounds (Sec 8.1.10), in bits per second; 0 means none. TAPS
+ * holds messages in the send queue to stay under maxSendRate, unless the
+ * protocol can pace the connection itself (TCP uses SO_MAX_PACING_RATE).
+ * minSendRate is the share the connection keeps when its rate group is over
+ * its limit. Short bursts above the rate are allowed. Returns 0, or -1 with
+ * errno set. */
+int tapsConnectionSetSendRate(TAPS_CTX *connection, uint64_t minSendRate,
+        uint64_t maxSendRate);
+/* Rate groups cap the combined send rate of the connections in them, for
+ * example one tenant's. Free the group whenever convenient; it lasts until
+ * the last of its connections leaves or is freed. A group of NULL leaves the
+ * current one. */
+TAPS_CTX *tapsRateGroupNew(uint64_t maxSendRate);
+void tapsRateGroupFree(TAPS_CTX *group);
+int tapsConnectionSetRateGroup(TAPS_CTX *connection, TAPS_CTX *group);
 /* Receiving (Sec 9.3) */
 /* Returns 0 on success, -1 on error.
  * connection: TAPS context for the connection
  * app_ctx: the context the app wants on callbacks for this receive
- * msg: a Message object where the bytes should go
+ * msg: a Message object where the bytes should go. If NULL, TAPS supplies a
+   message from its buffer pool once there is data for it, and app_ctx must
+   also be NULL: the callbacks get that message as their message context, and
+   the app must tapsMessageFree() it, which returns the buffer to the pool. A
+   receiveError before any data may have a NULL message.
  * minIncompleteLength: minimum bytes before calling back
- * maxLength: must be no larger than the data allocated in msg
+ * maxLength: must be no larger than the data allocated in msg. For pooled
+   messages, at most 64KB.
  * callbacks: must populate received, receivedPartial, and receiveError.
  */
 int tapsConnectionReceive(TAPS_CTX *connection, void *app_ctx, TAPS_CTX *msg,
@@ -319,16 +458,15 @@ void tapsAbortGroup(int connection);
 #endif
 /* We could just free the connection on the closed event, but the application
    might want to query metadata to free its state. Also, we can't call
-   dlclose() in the callback stack without segfaulting. */
+   dlclose() in the callback stack without segfaulting. It is safe to call
+   from any callback for the connection, even one made from inside a TAPS
+   call such as tapsConnectionSend. */
 void tapsConnectionFree(TAPS_CTX *connection);
 
 #if 0
 /* Extra connection property stuff we might use later */
 typedef enum { TAPS_FCFS, TAPS_RR, TAPS_RR_PKT, TAPS_PRIO, TAPS_FC, TAPS_WFQ }
     tapsScheduler;
-typedef enum { TAPS_DEFAULT, TAPS_SCAVENGER, TAPS_INTERACTIVE_CAP,
-    TAPS_NON_INTERACTIVE, TAPS_CONSTANT_RATE, TAPS_CAPACITY_SEEKING }
-    tapsCapacity;
 typedef enum { TAPS_HANDOVER, TAPS_INTERACTIVE_MP, TAPS_AGGREGATE }
     tapsMultipathPolicy;
 /* Applications should never have to use the structures below, but they are a
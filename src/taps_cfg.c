@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <string.h>
 #include <dirent.h>
+#include <limits.h>
 #include <dlfcn.h>
 #include <yaml.h> // Must install libyaml-dev
 #include "taps_internals.h" // includes taps.h
@@ -149,6 +150,13 @@ tapsParseYaml(FILE *yaml, tapsProtocol *protocol, int space)
                 field = NULL;
                 goto reset;
             }
+            /* Optional: "ip" (the default) or "path" */
+            if (strcmp(key, "addressing") == 0) {
+                proto->byPath = (strcmp(field, "path") == 0);
+                free(field);
+                field = NULL;
+                goto reset;
+            }
 reset:
             free(key);
             key = NULL;
@@ -179,44 +187,47 @@ fail:
     return 0;
 }
 
+/* Files are read in name order, so candidates come out in the same order
+   every time */
+static int
+_taps_yaml_filter(const struct dirent *entry)
+{
+    size_t len = strlen(entry->d_name);
+
+    return (len >= 6) && (strcmp(entry->d_name + len - 4, "yaml") == 0);
+}
+
 int
 tapsUpdateProtocols(tapsProtocol *list, int slotsRemaining)
 {
     FILE *fptr;
-    DIR  *directory;
-    char fullPath[255];
-    struct dirent *entry;
+    char fullPath[PATH_MAX];
+    struct dirent **entries;
+    int numEntries, i;
     int numProtos = 0;
-    tapsProtocol *proto = list;
 
     /* Parse files. */
-    directory = opendir(TAPS_CONF_PATH);
-    if (directory == NULL) {
+    numEntries = scandir(TAPS_CONF_PATH, &entries, &_taps_yaml_filter,
+            &alphasort);
+    if (numEntries < 0) {
         /* Directory is gone, there will be no other protocols */
         return -1;
     }
-    sprintf(fullPath, "%s/", TAPS_CONF_PATH);
-    for (entry = readdir(directory); entry != NULL;
-            entry = readdir(directory)) {
-        if (strlen(entry->d_name) < 6) {
-            continue;
-        }
-        if (strcmp(entry->d_name + strlen(entry->d_name) - 4, "yaml") != 0) {
+    for (i = 0; i < numEntries; i++) {
+        snprintf(fullPath, sizeof(fullPath), "%s/%s", TAPS_CONF_PATH,
+                entries[i]->d_name);
+        free(entries[i]);
+        if (numProtos == slotsRemaining) {
             continue;
         }
-        snprintf(fullPath + strlen(TAPS_CONF_PATH) + 1,
-                strlen(entry->d_name) + 1, "%s", entry->d_name);
         fptr = fopen(fullPath, "r");
         if (fptr == NULL) {
             continue;
         }
-        numProtos = tapsParseYaml(fptr, proto, slotsRemaining - numProtos);
+        numProtos += tapsParseYaml(fptr, list + numProtos,
+                slotsRemaining - numProtos);
         fclose(fptr);
-        proto = list + numProtos;
-        if (numProtos == slotsRemaining) {
-            break;
-        }
     }
-    closedir(directory);
+    free(entries);
     return numProtos;
 }
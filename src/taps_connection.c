@@ -17,11 +17,17 @@
  * Agreement available in this repository.
  */
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "taps_internals.h"
 
-#define MAX_RECVBUF_SIZE 65536
+#define MAX_RECVBUF_SIZE 65536 /* Largest receive pool class */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* Linux UIO_MAXIOV */
+#endif
 
 typedef enum { TAPS_START, TAPS_HAVEADDR, TAPS_CONNECTING, TAPS_CONNECTED }
         tapsCandidateState;
@@ -33,108 +39,295 @@ struct _send_item {
     tapsCbSent              sent;
     tapsCbExpired           expired;
     tapsCbSendError         sendError;
-    struct _send_item      *next, *prev;
+    size_t                  length;
+    unsigned int            prio;
+    uint64_t                deadline; /* ms, from tapsNow(); 0 = none */
+    /* Number of queued items covered by the protocol Send this item started */
+    int                     batchCount;
 };
 
 struct _recv_item {
     TAPS_CTX               *message;
     size_t                  minLength, maxLength, currLength;
+    /* Continuation cursor, for reads shorter than minLength. The protocol is
+       given the message iovec from entry iovIdx on, with that entry trimmed
+       in place; iovSaved has its original value. iovOffset is the number of
+       bytes in the entries before iovIdx. */
+    int                     iovIdx;
+    size_t                  iovOffset;
+    struct iovec            iovSaved;
     TAPS_CTX               *connection;
     void                   *app_ctx;
+    int                     pooled; /* message is a pool buffer, or will be */
     tapsCbReceived          received;
     tapsCbReceivedPartial   receivedPartial;
     tapsCbReceiveError      receiveError;
-    struct _recv_item      *next, *prev;
 };
 
-#define ADD_ITEM(type, tail)                                 \
-    struct type *newItem = malloc(sizeof(struct type));      \
-    if (newItem) {                                           \
-        newItem->next = NULL;                                \
-        newItem->prev = (tail);                              \
-        if (tail) {                                          \
-            (tail)->next = newItem;                          \
-        }                                                    \
-        (tail) = newItem;                                    \
-    }                                                        \
-
-#define DELETE_ITEM(item, tail)                \
-    if ((item)->prev) {                        \
-        (item)->prev->next = (item)->next;     \
-    }                                          \
-    if ((item)->next) {                        \
-        (item)->next->prev = (item)->prev;     \
-    } else {                                   \
-        (*tail) = (item)->prev;                 \
-    }                                          \
-    free(item);
+/* Items are recycled through per-connection slabs, so a connection that has
+   reached its steady-state queue depth does no allocation per message. */
+#define TAPS_ITEMS_PER_CHUNK 8
+
+/* Gathered iovec for a Send that covers more than one message. There is one
+   per slot in the send window, used in rotation. */
+struct _send_batch {
+    struct iovec           *iov;
+    int                     size;
+};
 
 typedef struct {
     void                   *proto_ctx; /* socket, openSSL ctx, etc. */
     void                   *app_ctx;
     struct proto_handles   *handles; /* Symbols for dynamic functions */
     //tapsCandidateState      state;
-    struct _send_item      *sndq; /* Pts to tail of list */
-    struct _recv_item      *rcvq; /* Pts to tail of list */
+    /* The first itemsInFlight items of sndq belong to Sends the protocol is
+       working on. The first item of rcvq is the one the protocol is working
+       on, unless receiveReady is set. */
+    tapsRing                sndq;
+    tapsRing                rcvq;
+    tapsRing                expq; /* Expired, awaiting their callbacks */
+    tapsSlab                sendItems;
+    tapsSlab                recvItems;
     tapsCbClosed            closed;
     tapsCbConnectionError   connectionError;
-    /* Only send one send or receive command to protocol at a time */
-    int                     sendReady;
+    /* Up to sendWindow Sends may be outstanding with the protocol. Only one
+       receive command is sent to the protocol at a time. */
+    uint32_t                sendWindow;
+    uint32_t                sendsInFlight;
+    uint32_t                itemsInFlight;
+    uint32_t                sendSeq; /* Picks the batch slot for a Send */
+    /* At least this many queued items have a deadline. Zero means there is
+       no need to read the clock. */
+    uint32_t                sendDeadlines;
     int                     receiveReady;
+    /* Between tapsStartBatch and tapsEndBatch, hold sends in sndq */
+    int                     batching;
+    /* _taps_send_next is running; sends made from callbacks just queue */
+    int                     sendDraining;
+    struct _send_batch     *batches; /* sendWindow entries */
+    /* Send queue watermarks. sendBytes counts every message in sndq. */
+    size_t                  sendBytes;
+    size_t                  sendLowBytes, sendHighBytes;
+    uint32_t                sendLowMsgs, sendHighMsgs;
+    int                     sendBufferFull;
+    tapsCbSendBufferHigh    sendBufferHigh;
+    tapsCbSendBufferLow     sendBufferLow;
+    /* Timers run on the listener's wheel; NULL if there is none, or once the
+       protocol connection is gone. Timeouts are in ms, 0 if unset. */
+    tapsTimerWheel         *wheel;
+    tapsTimer               idleTimer;
+    tapsTimer               recvTimer;
+    tapsTimer               sendTimer; /* Next message deadline */
+    uint64_t                sendTimerDeadline;
+    uint32_t                idleTimeout;
+    uint32_t                recvTimeout;
+    uint64_t                lastActivity;
+    /* Send rate limits. A bucket with a rate of 0 is not in use. While
+       minBucket has tokens, the others are ignored. */
+    tapsBucket              maxBucket;
+    tapsBucket              minBucket;
+    tapsBucket             *groupBucket;
+    TAPS_CTX               *rateGroup;
+    tapsTimer               paceTimer;
     //char                 *localIf;
     //struct sockaddr      *remote;
     TAPS_CTX               *listener; /* NULL for Initiated connections */
+    int                     shared; /* Lives in a _taps_conn_block */
+    /* Code that still needs c after an app callback holds it, as the app may
+       free the connection from any callback. tapsConnectionFree() then only
+       sets freed, and the last release frees it. */
+    uint32_t                holds;
+    int                     freed;
 } tapsConnection;
 
+/* A connection and its protocol context in one allocation, for protocols
+   with SetConnectionMemory. The protocol context follows the header. The
+   protocol holds the first reference and tapsConnectionNew() takes the
+   second; the block is freed when both have released it. */
+struct _taps_conn_block {
+    uint32_t                refs;
+    tapsConnection          conn;
+};
+#define TAPS_CONN_BLOCK_SIZE ((sizeof(struct _taps_conn_block) + \
+        _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+#define CONN_BLOCK(proto_ctx) \
+        ((struct _taps_conn_block *)((char *)(proto_ctx) - TAPS_CONN_BLOCK_SIZE))
+
+static void
+_taps_conn_block_put(struct _taps_conn_block *b)
+{
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(b);
+    }
+}
+
+void *
+tapsConnectionMemoryAlloc(size_t size)
+{
+    struct _taps_conn_block *b = malloc(TAPS_CONN_BLOCK_SIZE + size);
+
+    if (!b) {
+        return NULL;
+    }
+    b->refs = 1;
+    return (char *)b + TAPS_CONN_BLOCK_SIZE;
+}
+
 void
-_taps_closed(void *taps_ctx)
+tapsConnectionMemoryRelease(void *proto_ctx)
 {
-    tapsConnection *c = taps_ctx;
+    _taps_conn_block_put(CONN_BLOCK(proto_ctx));
+}
 
-    TAPS_TRACE();
-    if (c->listener) {
-        tapsListenerDeref(c->listener);
-        c->listener = NULL;
-    } else {
+static void
+_taps_hold(tapsConnection *c)
+{
+    c->holds++;
+}
+
+/* Returns FALSE if the app freed c while it was held; it is gone now. */
+static int
+_taps_release(tapsConnection *c)
+{
+    if ((--c->holds > 0) || !c->freed) {
+        return !c->freed;
+    }
+    tapsConnectionFree(c);
+    return FALSE;
+}
+
+static void
+_taps_cancel_timers(tapsConnection *c)
+{
+    tapsTimerCancel(&c->idleTimer);
+    tapsTimerCancel(&c->recvTimer);
+    tapsTimerCancel(&c->sendTimer);
+    tapsTimerCancel(&c->paceTimer);
+    c->wheel = NULL;
+    c->idleTimeout = c->recvTimeout = 0;
+}
+
+/* The protocol connection is gone. Returns the listener shard, if any, for
+   the caller to let go of once the app has been told, so that stopped can't
+   come before the last connection's callback. */
+static void *
+_taps_connection_gone(tapsConnection *c)
+{
+    void *listener = c->listener;
+
+    _taps_cancel_timers(c);
+    if (!listener) {
         free(c->handles);
     }
+    c->listener = NULL;
     c->proto_ctx = NULL;
+    return listener;
+}
+
+void
+_taps_closed(void *taps_ctx)
+{
+    tapsConnection *c = taps_ctx;
+    void           *listener;
+
+    TAPS_TRACE();
+    listener = _taps_connection_gone(c);
+    /* The app may free c here */
     if (c->closed) (c->closed)(c->app_ctx);
+    if (listener) tapsListenerDeref(listener);
 }
 
 void
-_taps_connection_error(void *taps_ctx)
+_taps_connection_error(void *taps_ctx, char *reason)
 {
     tapsConnection *c = taps_ctx;
+    void           *listener;
 
     TAPS_TRACE();
-    if (c->listener) {
-        tapsListenerDeref(c->listener);
-        c->listener = NULL;
-    } else {
-        free(c->handles);
+    listener = _taps_connection_gone(c);
+    (c->connectionError)(c->app_ctx, reason);
+    if (listener) tapsListenerDeref(listener);
+}
+
+/* Tear down the protocol connection after a timeout. The app may free the
+   connection in its callback, so this must be the last thing done with c. */
+static void
+_taps_connection_abort(tapsConnection *c, char *reason)
+{
+    (c->handles->abort)(c->proto_ctx);
+    c->proto_ctx = NULL;
+    _taps_connection_error(c, reason);
+}
+
+static void
+_taps_idle_timeout(void *arg)
+{
+    tapsConnection *c = arg;
+    uint64_t        idle = tapsTimerWheelNow(c->wheel) - c->lastActivity;
+
+    TAPS_TRACE();
+    /* Activity only updates a timestamp; catch up with it here */
+    if (idle < c->idleTimeout) {
+        tapsTimerArm(c->wheel, &c->idleTimer, c->idleTimeout - idle);
+        return;
     }
-    (c->connectionError)(c->app_ctx, NULL);
+    _taps_connection_abort(c, "Connection idle timeout");
 }
 
+/* Cheap enough for every send and receive: no clock read, no re-arming */
+#define TAPS_ACTIVITY(c) \
+    if ((c)->idleTimeout) (c)->lastActivity = tapsTimerWheelNow((c)->wheel);
+
+static void _taps_receive_timeout(void *arg);
+static void _taps_send_deadline(void *arg);
+static void _taps_send_pace(void *arg);
+
 TAPS_CTX *
 tapsConnectionNew(void *proto_ctx, struct proto_handles *handles,
         TAPS_CTX *listener)
 {
-    tapsConnection *c = malloc(sizeof(tapsConnection));
+    tapsConnection *c;
 
     TAPS_TRACE();
+    /* The protocol left room for us */
+    if (handles->setConnectionMemory) {
+        __atomic_add_fetch(&CONN_BLOCK(proto_ctx)->refs, 1, __ATOMIC_RELAXED);
+        c = &CONN_BLOCK(proto_ctx)->conn;
+    } else {
+        c = malloc(sizeof(tapsConnection));
+    }
     if (!c) return c;
     memset(c, 0, sizeof(tapsConnection));
+    c->shared = (handles->setConnectionMemory != NULL);
     c->proto_ctx = proto_ctx;
     c->handles = handles;
     //c->state = TAPS_CONNECTED;
     c->listener = listener;
-    c->sendReady = TRUE;
-    c->receiveReady = TRUE;
+    RING_INIT(&c->sndq);
+    RING_INIT(&c->rcvq);
+    RING_INIT(&c->expq);
+    tapsSlabInit(&c->sendItems, sizeof(struct _send_item),
+            TAPS_ITEMS_PER_CHUNK);
+    tapsSlabInit(&c->recvItems, sizeof(struct _recv_item),
+            TAPS_ITEMS_PER_CHUNK);
+    c->sendWindow = 1;
+    /* Hold sends and receives until tapsConnectionInitialize, as the
+       protocol may finish them on the spot, and the app's context isn't
+       known yet */
+    c->batching = 1;
+    c->receiveReady = FALSE;
+    c->wheel = (listener) ? tapsListenerTimerWheel(listener) : NULL;
+    tapsTimerInit(&c->idleTimer, &_taps_idle_timeout, c);
+    tapsTimerInit(&c->recvTimer, &_taps_receive_timeout, c);
+    tapsTimerInit(&c->sendTimer, &_taps_send_deadline, c);
+    tapsTimerInit(&c->paceTimer, &_taps_send_pace, c);
     return c;
 }
 
+/* Hand the item at the front of rcvq to the protocol. */
+static void
+_taps_receive_first(tapsConnection *c);
+
 void
 tapsConnectionInitialize(TAPS_CTX *conn, void *app_ctx, 
         tapsCallbacks *callbacks)
@@ -145,145 +338,781 @@ tapsConnectionInitialize(TAPS_CTX *conn, void *app_ctx,
     c->app_ctx = app_ctx ? app_ctx : c;
     c->closed = callbacks->closed;
     c->connectionError = callbacks->connectionError;
+    c->sendBufferHigh = callbacks->sendBufferHigh;
+    c->sendBufferLow = callbacks->sendBufferLow;
+    /* Start anything the app asked for in connectionReceived */
+    if (RING_EMPTY(&c->rcvq)) {
+        c->receiveReady = TRUE;
+    } else {
+        _taps_receive_first(c);
+    }
+    tapsEndBatch(c);
+}
+
+/* Watermark checks, after the send queue grows or shrinks. */
+static void
+_taps_send_buffer_grew(tapsConnection *c)
+{
+    if (c->sendBufferFull) {
+        return;
+    }
+    if (((c->sendHighBytes > 0) && (c->sendBytes >= c->sendHighBytes)) ||
+            ((c->sendHighMsgs > 0) &&
+            (RING_COUNT(&c->sndq) >= c->sendHighMsgs))) {
+        c->sendBufferFull = TRUE;
+        if (c->sendBufferHigh) (c->sendBufferHigh)(c->app_ctx);
+    }
+}
+
+static void
+_taps_send_buffer_shrank(tapsConnection *c)
+{
+    if (!c->sendBufferFull || c->freed || (c->sendBytes > c->sendLowBytes) ||
+            (RING_COUNT(&c->sndq) > c->sendLowMsgs)) {
+        return;
+    }
+    c->sendBufferFull = FALSE;
+    if (c->sendBufferLow) (c->sendBufferLow)(c->app_ctx);
 }
 
 void _taps_sent(void *item_ctx);
 void _taps_expired(void *item_ctx);
 void _taps_send_error(void *item_ctx, char *reason);
 
+/* Returns TRUE if the rate limits say to hold the queue for now. Sending
+   resumes from the pace timer, or failing that the next send or
+   completion. */
 static int
-_taps_send_common(tapsConnection *c, struct _send_item *item)
+_taps_send_paced(tapsConnection *c)
 {
-    struct _send_item *next = item->next;
-    struct iovec *data;
-    int           iovcnt;
+    uint64_t now, wait = 0, groupWait;
 
-    DELETE_ITEM(item, &(c->sndq));
-    if (!next) {
-        c->sendReady = TRUE;
-        return 0;
+    if (!c->maxBucket.rate && !c->groupBucket) {
+        return FALSE;
+    }
+    now = tapsNow();
+    if (c->minBucket.rate && (tapsBucketWait(&c->minBucket, now) == 0)) {
+        return FALSE;
+    }
+    if (c->maxBucket.rate) {
+        wait = tapsBucketWait(&c->maxBucket, now);
+    }
+    if (c->groupBucket) {
+        groupWait = tapsBucketWait(c->groupBucket, now);
+        wait = (groupWait > wait) ? groupWait : wait;
     }
-    data = tapsMessageGetIovec(next->message, &iovcnt);
-    return (c->handles->send)(c->proto_ctx, next, data, iovcnt, &_taps_sent,
-            &_taps_expired, &_taps_send_error);
+    if (wait == 0) {
+        return FALSE;
+    }
+    if (c->wheel && !TIMER_ARMED(&c->paceTimer)) {
+        tapsTimerArm(c->wheel, &c->paceTimer, wait);
+    }
+    return TRUE;
 }
 
-void
-_taps_sent(void *item_ctx)
+static void
+_taps_send_debit(tapsConnection *c, size_t bytes)
 {
-    struct _send_item *item = item_ctx;
-    tapsConnection    *c = item->connection;
-    tapsCbSent         cb = item->sent;
-    void              *app = item->app_ctx;
+    if (c->minBucket.rate) tapsBucketDebit(&c->minBucket, bytes);
+    if (c->maxBucket.rate) tapsBucketDebit(&c->maxBucket, bytes);
+    if (c->groupBucket) tapsBucketDebit(c->groupBucket, bytes);
+}
+
+/* Whether the protocol will send this message straight from its file */
+#define SENDS_FROM_FILE(c, msg) \
+        ((c)->handles->sendFile && (tapsMessageGetFile((msg), NULL, NULL) >= 0))
+
+/* Gather the iovecs of as many queued messages as fit in IOV_MAX, starting
+   with item, into the next batch slot. Returns the iovec to send, and sets
+   count to the number of messages it covers. Protocols that keep message
+   boundaries get one at a time. */
+static struct iovec *
+_taps_send_gather(tapsConnection *c, struct _send_item *item, int *iovcnt,
+        int *count)
+{
+    struct _send_item  *next;
+    struct _send_batch *batch;
+    struct iovec       *data, *gathered;
+    int                 nextcnt, size, i;
 
+    data = tapsMessageGetIovec(item->message, iovcnt);
+    *count = 1;
+    while (!c->handles->messageBoundaries &&
+            (c->itemsInFlight + *count < RING_COUNT(&c->sndq))) {
+        next = RING_AT(&c->sndq, c->itemsInFlight + *count);
+        if (SENDS_FROM_FILE(c, next->message)) {
+            break;
+        }
+        tapsMessageGetIovec(next->message, &nextcnt);
+        if (*iovcnt + nextcnt > IOV_MAX) {
+            break;
+        }
+        *iovcnt += nextcnt;
+        (*count)++;
+    }
+    if (*count == 1) {
+        return data;
+    }
+    if (!c->batches) {
+        c->batches = calloc(c->sendWindow, sizeof(struct _send_batch));
+    }
+    batch = (c->batches) ? &c->batches[c->sendSeq % c->sendWindow] : NULL;
+    if (batch && (*iovcnt > batch->size)) {
+        size = (batch->size) ? batch->size : 16;
+        while (size < *iovcnt) {
+            size *= 2;
+        }
+        gathered = realloc(batch->iov, sizeof(struct iovec) * size);
+        if (gathered) {
+            batch->iov = gathered;
+            batch->size = size;
+        } else {
+            batch = NULL;
+        }
+    }
+    if (!batch) {
+        /* Fall back to sending just the first message */
+        *count = 1;
+        return tapsMessageGetIovec(item->message, iovcnt);
+    }
+    gathered = batch->iov;
+    for (i = 0; i < *count; i++) {
+        next = RING_AT(&c->sndq, c->itemsInFlight + i);
+        data = tapsMessageGetIovec(next->message, &nextcnt);
+        memcpy(gathered, data, sizeof(struct iovec) * nextcnt);
+        gathered += nextcnt;
+    }
+    return batch->iov;
+}
+
+/* Hand the first queued item that is not yet in flight to the protocol. If
+   more than one message is waiting, coalesce as many as fit in IOV_MAX into a
+   single Send; a file-backed message goes alone, through SendFile, if the
+   protocol has it. Returns 1 if the protocol finished the Send on the spot,
+   in which case it won't call back and the caller must retire it. */
+static int
+_taps_send_one(tapsConnection *c)
+{
+    struct _send_item  *item = RING_AT(&c->sndq, c->itemsInFlight), *next;
+    struct iovec       *data;
+    size_t              bytes, len;
+    off_t               offset;
+    int                 iovcnt, count, done, fd, i;
+
+    if (SENDS_FROM_FILE(c, item->message)) {
+        fd = tapsMessageGetFile(item->message, &offset, &len);
+        count = 1;
+        item->batchCount = count;
+        done = (c->handles->sendFile)(c->proto_ctx, item, fd, offset, len,
+                &_taps_sent, &_taps_expired, &_taps_send_error);
+    } else {
+        data = _taps_send_gather(c, item, &iovcnt, &count);
+        item->batchCount = count;
+        done = (c->handles->send)(c->proto_ctx, item, data, iovcnt,
+                &_taps_sent, &_taps_expired, &_taps_send_error);
+    }
+    if (done < 0) {
+        return -1;
+    }
+    if (c->maxBucket.rate || c->minBucket.rate || c->groupBucket) {
+        for (i = 0, bytes = 0; i < count; i++) {
+            next = RING_AT(&c->sndq, c->itemsInFlight + i);
+            bytes += next->length;
+        }
+        _taps_send_debit(c, bytes);
+    }
+    c->sendsInFlight++;
+    c->itemsInFlight += count;
+    c->sendSeq++;
+    return (done > 0) ? 1 : 0;
+}
+
+typedef enum { TAPS_SEND_SENT, TAPS_SEND_EXPIRED, TAPS_SEND_ERROR }
+        tapsSendResult;
+
+/* Retire every message covered by the Send that item started, and report
+   each one to the app in queue order. The Send still counts against the
+   window until all of its callbacks have returned. */
+static void
+_taps_send_retire(tapsConnection *c, struct _send_item *item,
+        tapsSendResult result, char *reason)
+{
+    struct _send_item  done;
+    struct _send_item *next;
+    int                count = item->batchCount;
+
+    if (RING_FIRST(&c->sndq) != item) {
+        printf("Send completion out of order\n");
+    }
+    /* Once the app frees the connection, tapsConnectionFree() reports the
+       rest */
+    while ((count-- > 0) && !c->freed && (next = tapsRingPop(&c->sndq))) {
+        if (c->itemsInFlight > 0) {
+            c->itemsInFlight--;
+        }
+        /* The app may queue a new send from the callback, which can reuse
+           this slot */
+        done = *next;
+        tapsSlabFree(&c->sendItems, next);
+        c->sendBytes -= done.length;
+        switch (result) {
+        case TAPS_SEND_SENT:
+            (done.sent)(c->app_ctx, done.app_ctx);
+            break;
+        case TAPS_SEND_EXPIRED:
+            (done.expired)(c->app_ctx, done.app_ctx);
+            break;
+        case TAPS_SEND_ERROR:
+            (done.sendError)(c->app_ctx, done.app_ctx,
+                    (reason) ? reason : "Protocol failure");
+            break;
+        }
+    }
+    _taps_send_buffer_shrank(c);
+}
+
+/* Keep the deadline timer on the earliest deadline still queued, so stale
+   messages are dropped even while nothing is being sent. */
+static void
+_taps_send_deadline_arm(tapsConnection *c, uint64_t deadline, uint64_t now)
+{
+    if (!c->wheel || (TIMER_ARMED(&c->sendTimer) &&
+            (c->sendTimerDeadline <= deadline))) {
+        return;
+    }
+    c->sendTimerDeadline = deadline;
+    tapsTimerArm(c->wheel, &c->sendTimer, (deadline > now) ?
+            deadline - now : 0);
+}
+
+/* Drop queued messages whose msgLifetime has run out, before they go to the
+   protocol. The queue is compacted first and the callbacks made after, as
+   they may send more. */
+static void
+_taps_send_expire(tapsConnection *c)
+{
+    struct _send_item *item;
+    struct _send_item  done;
+    uint64_t           now = tapsNow(), next = 0;
+    uint32_t           i, keep = c->itemsInFlight;
+
+    c->sendDeadlines = 0;
+    for (i = c->itemsInFlight; i < RING_COUNT(&c->sndq); i++) {
+        item = RING_AT(&c->sndq, i);
+        if (item->deadline && (item->deadline <= now) &&
+                (tapsRingPush(&c->expq, item) == 0)) {
+            continue;
+        }
+        if (item->deadline) {
+            c->sendDeadlines++;
+            if (!next || (item->deadline < next)) {
+                next = item->deadline;
+            }
+        }
+        RING_AT(&c->sndq, keep++) = item;
+    }
+    c->sndq.count = keep;
+    tapsTimerCancel(&c->sendTimer);
+    if (next) {
+        _taps_send_deadline_arm(c, next, now);
+    }
+    while (!c->freed && (item = tapsRingPop(&c->expq))) {
+        done = *item;
+        tapsSlabFree(&c->sendItems, item);
+        c->sendBytes -= done.length;
+        (done.expired)(c->app_ctx, done.app_ctx);
+    }
+    _taps_send_buffer_shrank(c);
+}
+
+static void
+_taps_send_deadline(void *arg)
+{
+    tapsConnection *c = arg;
+
+    TAPS_TRACE();
+    _taps_hold(c);
+    _taps_send_expire(c);
+    _taps_release(c);
+}
+
+static void _taps_send_next(tapsConnection *c);
+
+static void
+_taps_send_pace(void *arg)
+{
     TAPS_TRACE();
-    if (_taps_send_common(c, item) < 0) {
+    _taps_send_next(arg);
+}
+
+/* The protocol finished a Send inside the call. Report it here, as it won't
+   call back. */
+static void
+_taps_send_done(tapsConnection *c, struct _send_item *item)
+{
+    TAPS_ACTIVITY(c);
+    _taps_send_retire(c, item, TAPS_SEND_SENT, NULL);
+    c->sendsInFlight--;
+}
+
+/* Fill the send window, unless the app is batching. If the protocol refuses a
+   Send, retry after the next completion; if nothing is outstanding, there
+   will be no completion, so fail the messages instead.
+
+   Sends that complete on the spot are retired in this loop, and anything the
+   app sends from those callbacks is picked up by it too, rather than
+   recursing once per message. */
+static void
+_taps_send_next(tapsConnection *c)
+{
+    struct _send_item *item;
+    int                done;
+
+    if (c->sendDraining || c->freed) {
+        return;
+    }
+    _taps_hold(c);
+    c->sendDraining = TRUE;
+    if (c->sendDeadlines && !c->batching &&
+            (c->sendsInFlight < c->sendWindow)) {
+        _taps_send_expire(c);
+    }
+    while (!c->freed && !c->batching && (c->sendsInFlight < c->sendWindow) &&
+            (c->itemsInFlight < RING_COUNT(&c->sndq)) &&
+            !_taps_send_paced(c)) {
+        item = RING_AT(&c->sndq, c->itemsInFlight);
+        done = _taps_send_one(c);
+        if (done > 0) {
+            _taps_send_done(c, item);
+        }
+        if (done >= 0) {
+            continue;
+        }
         printf("send failed\n");
+        if (c->sendsInFlight > 0) {
+            break;
+        }
+        _taps_send_retire(c, item, TAPS_SEND_ERROR, NULL);
     }
-    (cb)(c->app_ctx, app);
+    c->sendDraining = FALSE;
+    _taps_release(c);
 }
 
-void
-_taps_expired(void *item_ctx)
+/* Called by the protocol when a Send is done, one way or another. */
+static void
+_taps_send_complete(struct _send_item *item, tapsSendResult result,
+        char *reason)
 {
-    struct _send_item *item = item_ctx;
     tapsConnection    *c = item->connection;
-    tapsCbExpired      cb = item->expired;
-    void              *app = item->app_ctx;
 
+    TAPS_ACTIVITY(c);
+    _taps_hold(c);
+    _taps_send_retire(c, item, result, reason);
+    c->sendsInFlight--;
+    _taps_send_next(c);
+    _taps_release(c);
+}
+
+void
+_taps_sent(void *item_ctx)
+{
     TAPS_TRACE();
-    if (_taps_send_common(c, item) < 0) {
-        printf("send failed\n");
-    }
-    (cb)(c->app_ctx, app);
+    _taps_send_complete(item_ctx, TAPS_SEND_SENT, NULL);
 }
 
 void
-_taps_send_error(void *item_ctx, char *reason)
+_taps_expired(void *item_ctx)
 {
-    struct _send_item *item = item_ctx;
-    tapsConnection    *c = item->connection;
-    tapsCbSendError    cb = item->sendError;
-    void              *app = item->app_ctx;
+    TAPS_TRACE();
+    _taps_send_complete(item_ctx, TAPS_SEND_EXPIRED, NULL);
+}
 
+void
+_taps_send_error(void *item_ctx, char *reason)
+{
     TAPS_TRACE();
-    if (_taps_send_common(c, item) < 0) {
-        printf("send failed\n");
-    }
-    (cb)(c->app_ctx, app, (reason) ? reason : "Protocol failure");
+    _taps_send_complete(item_ctx, TAPS_SEND_ERROR, reason);
 }
 
 int
 tapsConnectionSend(TAPS_CTX *connection, TAPS_CTX *msg, void *app_ctx,
         tapsCallbacks *callbacks)
 {
-    tapsConnection *c = (tapsConnection *)connection;
-    struct iovec *data;
-    int iovlen;
+    tapsConnection    *c = (tapsConnection *)connection;
+    struct _send_item *item, *prev;
+    struct iovec      *iovec;
+    unsigned int       prio = tapsMessageGetPriority(msg);
+    uint64_t           now;
+    uint32_t           pos;
+    int                iovcnt, done, i;
 
-    ADD_ITEM(_send_item, c->sndq);
-    if (!newItem) {
+    if (!c->proto_ctx) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (tapsMessageGetLifetime(msg) && !callbacks->expired) {
+        printf("Message lifetime needs an expired callback\n");
+        errno = EINVAL;
+        return -1;
+    }
+    /* A protocol that can only send from memory gets files mapped */
+    if (!c->handles->sendFile && (tapsMessageMap(msg) < 0)) {
+        printf("Couldn't map file for sending: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Queue behind everything of the same or more urgent priority, but
+       nothing already handed to the protocol can be overtaken. Usually
+       this is the back of the queue. */
+    pos = RING_COUNT(&c->sndq);
+    while (pos > c->itemsInFlight) {
+        prev = RING_AT(&c->sndq, pos - 1);
+        if (prev->prio <= prio) {
+            break;
+        }
+        pos--;
+    }
+    item = tapsSlabAlloc(&c->sendItems);
+    if (!item || (tapsRingInsert(&c->sndq, pos, item) < 0)) {
+        if (item) tapsSlabFree(&c->sendItems, item);
         errno = ENOMEM;
         printf("Sending failed\n");
         return -1;
     }
-    newItem->message = msg;
-    newItem->connection = connection;
-    newItem->app_ctx = app_ctx;
-    newItem->sent = callbacks->sent;
-    newItem->expired = callbacks->expired;
-    newItem->sendError = callbacks->sendError;
+    item->message = msg;
+    item->connection = connection;
+    item->app_ctx = app_ctx;
+    item->sent = callbacks->sent;
+    item->expired = callbacks->expired;
+    item->sendError = callbacks->sendError;
+    item->batchCount = 1;
+    item->prio = prio;
+    item->deadline = 0;
+    if (tapsMessageGetLifetime(msg) > 0) {
+        now = tapsNow();
+        item->deadline = now + tapsMessageGetLifetime(msg);
+        c->sendDeadlines++;
+        _taps_send_deadline_arm(c, item->deadline, now);
+    }
+    item->length = 0;
+    if (tapsMessageGetFile(msg, NULL, &item->length) < 0) {
+        iovec = tapsMessageGetIovec(msg, &iovcnt);
+        for (i = 0; i < iovcnt; i++) {
+            item->length += iovec[i].iov_len;
+        }
+    }
+    c->sendBytes += item->length;
 
-    if (c->sendReady) {
-        data = tapsMessageGetIovec(msg, &iovlen);
-        return (c->handles->send)(c->proto_ctx, newItem, data, iovlen,
-                &_taps_sent, &_taps_expired, &_taps_send_error);
+    /* The sent callback may come before this returns, and free c */
+    _taps_hold(c);
+    if (!c->batching && !c->sendDraining &&
+            (c->sendsInFlight < c->sendWindow) && !_taps_send_paced(c)) {
+        if (RING_COUNT(&c->sndq) > 1) {
+            _taps_send_next(c);
+        } else if ((done = _taps_send_one(c)) < 0) {
+            /* Nothing else is queued, so back out this item */
+            tapsRingPop(&c->sndq);
+            tapsSlabFree(&c->sendItems, item);
+            c->sendBytes -= item->length;
+            _taps_release(c);
+            return -1;
+        } else if (done > 0) {
+            c->sendDraining = TRUE;
+            _taps_send_done(c, item);
+            c->sendDraining = FALSE;
+            /* Send whatever the app queued from the callback */
+            _taps_send_next(c);
+        }
+    }
+    if (_taps_release(c)) {
+        _taps_send_buffer_grew(c);
     }
     return 0;
 }
 
-/* Creates a new iovec to points to the same buffers as the original, but
-   leaving off the first len bytes. */
-static struct iovec *
-_taps_trunc_iovec(struct iovec *orig, int *iovcnt, size_t len)
+static void
+_taps_free_batches(tapsConnection *c)
 {
-    size_t        remaining = len;
-    struct iovec *ptr = orig;
-    struct iovec *newVec;
+    uint32_t i;
 
-    while ((remaining > ptr->iov_len) && (iovcnt > 0)) {
-        (*iovcnt)--;
-        remaining -= ptr->iov_len;
-        ptr++;
+    if (!c->batches) {
+        return;
     }
-    if (iovcnt == 0) {
-        printf("Iovec not big enough to truncate!\n");
-        return NULL;
+    for (i = 0; i < c->sendWindow; i++) {
+        free(c->batches[i].iov);
+    }
+    free(c->batches);
+    c->batches = NULL;
+}
+
+int
+tapsConnectionSetSendWindow(TAPS_CTX *connection, unsigned int window)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+    uint32_t        limit = c->handles->maxSendWindow;
+
+    TAPS_TRACE();
+    if (window == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (c->sendsInFlight > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (window > limit) {
+        window = (limit > 0) ? limit : 1;
+    }
+    _taps_free_batches(c);
+    c->sendWindow = window;
+    c->sendSeq = 0;
+    _taps_send_next(c);
+    return window;
+}
+
+/* Timeouts need the wheel, and a way to take the connection away from the
+   protocol when they fire. */
+static int
+_taps_timeouts_supported(tapsConnection *c)
+{
+    if (!c->wheel || !c->handles->abort) {
+        errno = EOPNOTSUPP;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int
+tapsConnectionSetIdleTimeout(TAPS_CTX *connection, unsigned int ms)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if (ms == 0) {
+        c->idleTimeout = 0;
+        tapsTimerCancel(&c->idleTimer);
+        return 0;
+    }
+    if (!_taps_timeouts_supported(c)) {
+        return -1;
+    }
+    c->idleTimeout = ms;
+    c->lastActivity = tapsTimerWheelNow(c->wheel);
+    return tapsTimerArm(c->wheel, &c->idleTimer, ms);
+}
+
+int
+tapsConnectionSetReceiveTimeout(TAPS_CTX *connection, unsigned int ms)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if ((ms > 0) && !_taps_timeouts_supported(c)) {
+        return -1;
+    }
+    /* Takes effect from the next receive */
+    c->recvTimeout = ms;
+    return 0;
+}
+
+int
+tapsConnectionSetSendRate(TAPS_CTX *connection, uint64_t minSendRate,
+        uint64_t maxSendRate)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if ((minSendRate && (minSendRate < 8)) ||
+            (maxSendRate && ((maxSendRate < 8) ||
+            (minSendRate > maxSendRate)))) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&c->minBucket, 0, sizeof(tapsBucket));
+    memset(&c->maxBucket, 0, sizeof(tapsBucket));
+    if (minSendRate) {
+        tapsBucketInit(&c->minBucket, minSendRate);
+    }
+    /* Pacing in the kernel is smoother, and costs nothing here */
+    if (c->handles->setProperty && c->proto_ctx &&
+            ((c->handles->setProperty)(c->proto_ctx, "maxSendRate",
+            &maxSendRate, sizeof(maxSendRate)) == 0)) {
+        maxSendRate = 0;
+    }
+    if (maxSendRate) {
+        tapsBucketInit(&c->maxBucket, maxSendRate);
+    }
+    _taps_send_next(c);
+    return 0;
+}
+
+int
+tapsConnectionSetRateGroup(TAPS_CTX *connection, TAPS_CTX *group)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if (c->rateGroup) {
+        tapsRateGroupLeave(c->rateGroup);
+    }
+    c->rateGroup = group;
+    c->groupBucket = (group) ? tapsRateGroupJoin(group) : NULL;
+    _taps_send_next(c);
+    return 0;
+}
+
+int
+tapsConnectionSetSendBuffer(TAPS_CTX *connection, size_t lowBytes,
+        size_t highBytes, unsigned int lowMsgs, unsigned int highMsgs)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if (((highBytes > 0) && (lowBytes >= highBytes)) ||
+            ((highMsgs > 0) && (lowMsgs >= highMsgs))) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->sendLowBytes = lowBytes;
+    c->sendHighBytes = highBytes;
+    c->sendLowMsgs = lowMsgs;
+    c->sendHighMsgs = highMsgs;
+    if ((highBytes > 0) && c->handles->setProperty &&
+            ((c->handles->setProperty)(c->proto_ctx, "sendBufferLow",
+            &lowBytes, sizeof(lowBytes)) < 0) && (errno != ENOPROTOOPT)) {
+        printf("Protocol rejected sendBufferLow: %s\n", strerror(errno));
+    }
+    /* The queue may already be past either mark */
+    _taps_send_buffer_grew(c);
+    _taps_send_buffer_shrank(c);
+    return 0;
+}
+
+/* For properties only the protocol can implement */
+static int
+_taps_set_protocol_property(tapsConnection *c, char *name, void *value,
+        size_t len)
+{
+    if (!c->proto_ctx) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (!c->handles->setProperty) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if ((c->handles->setProperty)(c->proto_ctx, name, value, len) < 0) {
+        if (errno == ENOPROTOOPT) {
+            errno = EOPNOTSUPP;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int
+tapsConnectionSetZeroCopy(TAPS_CTX *connection, size_t threshold)
+{
+    TAPS_TRACE();
+    return _taps_set_protocol_property(connection, "zeroCopyThreshold",
+            &threshold, sizeof(threshold));
+}
+
+int
+tapsConnectionSetKeepAlive(TAPS_CTX *connection, unsigned int seconds)
+{
+    TAPS_TRACE();
+    return _taps_set_protocol_property(connection, "keepAliveTimeout",
+            &seconds, sizeof(seconds));
+}
+
+int
+tapsConnectionSetUserTimeout(TAPS_CTX *connection, unsigned int ms)
+{
+    TAPS_TRACE();
+    return _taps_set_protocol_property(connection, "userTimeout", &ms,
+            sizeof(ms));
+}
+
+int
+tapsConnectionSetCapacityProfile(TAPS_CTX *connection, tapsCapacity profile)
+{
+    int value = profile;
+
+    TAPS_TRACE();
+    if ((value < TAPS_DEFAULT) || (value > TAPS_CAPACITY_SEEKING)) {
+        errno = EINVAL;
+        return -1;
     }
-    newVec = malloc(sizeof(struct iovec) * (*iovcnt));
-    if (!newVec) {
-        return newVec;
+    return _taps_set_protocol_property(connection, "capacityProfile", &value,
+            sizeof(value));
+}
+
+void
+tapsStartBatch(TAPS_CTX *connection)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    c->batching++;
+}
+
+void
+tapsEndBatch(TAPS_CTX *connection)
+{
+    tapsConnection *c = (tapsConnection *)connection;
+
+    TAPS_TRACE();
+    if (c->batching == 0) {
+        printf("tapsEndBatch without tapsStartBatch\n");
+        return;
     }
-    memcpy(newVec, ptr, sizeof(struct iovec) * (*iovcnt));
-    newVec->iov_base += remaining;
-    newVec->iov_len -= remaining;
-    return newVec;
+    c->batching--;
+    _taps_send_next(c);
+}
+
+/* Put back the message iovec entry that the cursor trimmed, if any. */
+static void
+_taps_receive_restore(struct _recv_item *item)
+{
+    struct iovec *iovec;
+
+    if ((item->iovIdx < 0) || !item->message) {
+        return;
+    }
+    iovec = tapsMessageGetIovec(item->message, NULL);
+    iovec[item->iovIdx] = item->iovSaved;
+    item->iovIdx = -1;
+}
+
+/* Retire the finished receive, and start the next queued one. */
+static void
+_taps_receive_common(tapsConnection *c, struct _recv_item *item)
+{
+    if (RING_FIRST(&c->rcvq) != item) {
+        printf("Receive completion out of order\n");
+    }
+    TAPS_ACTIVITY(c);
+    tapsTimerCancel(&c->recvTimer);
+    _taps_receive_restore(item);
+    tapsRingPop(&c->rcvq);
+    tapsSlabFree(&c->recvItems, item);
+    if (RING_EMPTY(&c->rcvq)) {
+        c->receiveReady = TRUE;
+        return;
+    }
+    _taps_receive_first(c);
 }
 
 static void
 _taps_receive_error(TAPS_CTX *item_ctx, struct iovec *data, char *reason)
 {
     struct _recv_item     *item = item_ctx;
-    struct iovec          *iovec = tapsMessageGetIovec(item->message, NULL);
     tapsCbReceiveError     fn = item->receiveError;
     tapsConnection        *c = item->connection;
     TAPS_CTX              *conn_ctx = c->app_ctx;
     TAPS_CTX              *item_app = item->app_ctx;
 
-    if (iovec != data) {
-        free(data);
-    }
-    DELETE_ITEM(item, &(c->rcvq));
+    _taps_receive_common(c, item);
     (fn)(conn_ctx, item_app, reason);
 }
 
@@ -291,107 +1120,207 @@ static void
 _taps_received(void *item_ctx, struct iovec *data, size_t data_len)
 {
     struct _recv_item     *item = item_ctx;
-    struct iovec          *iovec = tapsMessageGetIovec(item->message, NULL);
     tapsCbReceived         fn = item->received;
     tapsConnection        *c = item->connection;
     TAPS_CTX              *conn_ctx = c->app_ctx;
     TAPS_CTX              *item_app = item->app_ctx;
-    TAPS_CTX              *msg = item->message;
+    size_t                 len;
 
-    if (iovec != data) {
-        free(data);
-    }
     item->currLength += data_len;
     if (item->currLength < item->minLength) {
         /* If the message size is < minLength, it is an error */
-        _taps_receive_error(item_ctx, iovec, "Message below minLength");
+        _taps_receive_error(item_ctx, data, "Message below minLength");
         return;
     }
-    DELETE_ITEM(item, &(c->rcvq));
-    (fn)(conn_ctx, item_app, item->currLength);
+    len = item->currLength;
+    _taps_receive_common(c, item);
+    (fn)(conn_ctx, item_app, len);
 }
 
 static void
 _taps_received_partial(void *item_ctx, struct iovec *data, size_t data_len)
 {
     struct _recv_item     *item = item_ctx;
-    struct _recv_item     *next_item;
     tapsConnection        *c = item->connection;
     tapsCbReceivedPartial  rcvPart;
-    TAPS_CTX              *msg;
     void                  *app_ctx;
     size_t                 len;
-    struct iovec          *iovec, *newIovec;
-    int                    iovcnt;
+    struct iovec          *iovec;
+    int                    iovcnt, idx;
 
-    iovec = tapsMessageGetIovec(item->message, &iovcnt);
     /* Handle returns below minLength. Unfortunately, the SO_RCVLOWAT socket
        option doesn't work with select() and poll(), which in turn are wrapped
        by libevent. So we have to handle this manually.
 
-       We have to manually hack the iovec to make this work.*/
-    if (iovec != data) {
-        free(data);
-    }
+       Rather than copy the iovec, trim the first unfilled entry in place and
+       give the protocol the rest of the array. */
     item->currLength += data_len;
     if (item->currLength < item->minLength) {
-        newIovec = _taps_trunc_iovec(iovec, &iovcnt, item->currLength);
-        if (!newIovec) {
-            _taps_receive_error(item_ctx, iovec, "Internal error");
+        iovec = tapsMessageGetIovec(item->message, &iovcnt);
+        /* Resume from the entry we stopped at last time */
+        idx = (item->iovIdx < 0) ? 0 : item->iovIdx;
+        _taps_receive_restore(item);
+        while ((idx < iovcnt) &&
+                (item->currLength >= item->iovOffset + iovec[idx].iov_len)) {
+            item->iovOffset += iovec[idx].iov_len;
+            idx++;
+        }
+        if (idx == iovcnt) {
+            _taps_receive_error(item_ctx, data, "Buffer below minLength");
             return;
         }
-        (c->handles->receive)(c->proto_ctx, item, newIovec, iovcnt,
-                &_taps_received, &_taps_received_partial, &_taps_receive_error);
+        len = item->currLength - item->iovOffset;
+        item->iovIdx = idx;
+        item->iovSaved = iovec[idx];
+        iovec[idx].iov_base = (char *)iovec[idx].iov_base + len;
+        iovec[idx].iov_len -= len;
+        (c->handles->receive)(c->proto_ctx, item, &iovec[item->iovIdx],
+                iovcnt - item->iovIdx, &_taps_received,
+                &_taps_received_partial, &_taps_receive_error);
         return;
     }
-    if (item->next) {
-        /* Queue up the next receive */
-        iovec = tapsMessageGetIovec(item->next->message, &iovcnt);
-        (c->handles->receive)(c->proto_ctx, item->next, iovec, iovcnt,
-                &_taps_received, &_taps_received_partial, &_taps_receive_error);
-    } else {
-        /* Nothing else to do */
-        c->receiveReady = TRUE;
-    }
     rcvPart = item->receivedPartial;
     app_ctx = item->app_ctx;
-    msg = item->message;
-    DELETE_ITEM(item, &(c->rcvq));
-    (rcvPart)(c->app_ctx, app_ctx, item->currLength, FALSE);
+    len = item->currLength;
+    _taps_receive_common(c, item);
+    (rcvPart)(c->app_ctx, app_ctx, len, FALSE);
+}
+
+struct iovec *
+tapsReceiveBufferAlloc(void *item_ctx, int *iovcnt)
+{
+    struct _recv_item *item = item_ctx;
+
+    if (!item->message) {
+        item->message = tapsMessageNewPooled(item->maxLength);
+        if (!item->message) {
+            printf("No receive buffer\n");
+            return NULL;
+        }
+        item->app_ctx = item->message;
+    }
+    return tapsMessageGetIovec(item->message, iovcnt);
+}
+
+/* Only a buffer nothing has been read into yet goes back */
+void
+tapsReceiveBufferRelease(void *item_ctx)
+{
+    struct _recv_item *item = item_ctx;
+
+    if (!item->pooled || !item->message || (item->currLength > 0)) {
+        return;
+    }
+    tapsMessageFree(item->message);
+    item->message = NULL;
+    item->app_ctx = NULL;
+}
+
+static void
+_taps_receive_first(tapsConnection *c)
+{
+    struct _recv_item *item = RING_FIRST(&c->rcvq);
+    tapsCbReceiveError fn = item->receiveError;
+    struct iovec      *iovec = NULL;
+    int                iovcnt = 0;
+
+    c->receiveReady = FALSE;
+    /* A protocol with SetReceiveBuffers asks for the pool buffer when it has
+       data for it, so an idle connection doesn't hold one. The others get it
+       now. */
+    if (!item->message && !c->handles->setReceiveBuffers &&
+            !tapsReceiveBufferAlloc(item, &iovcnt)) {
+        _taps_receive_common(c, item);
+        (fn)(c->app_ctx, NULL, "Out of receive buffers");
+        return;
+    }
+    if (item->message) {
+        iovec = tapsMessageGetIovec(item->message, &iovcnt);
+    }
+    if (c->recvTimeout && c->wheel) {
+        tapsTimerArm(c->wheel, &c->recvTimer, c->recvTimeout);
+    }
+    (c->handles->receive)(c->proto_ctx, item, iovec, iovcnt,
+            &_taps_received, &_taps_received_partial, &_taps_receive_error);
+}
+
+/* The receive the protocol is working on has taken too long. The protocol
+   still owns its buffer, so the connection has to go as well, and so do the
+   receives queued behind it. The connection error comes last, if the app
+   hasn't freed the connection from one of the receive errors. */
+static void
+_taps_receive_timeout(void *arg)
+{
+    tapsConnection    *c = arg;
+    struct _recv_item *item;
+    tapsCbReceiveError fn;
+    void              *item_app, *listener;
+
+    TAPS_TRACE();
+    (c->handles->abort)(c->proto_ctx);
+    c->proto_ctx = NULL;
+    listener = _taps_connection_gone(c);
+    c->receiveReady = TRUE;
+    _taps_hold(c);
+    while (!c->freed && (item = tapsRingPop(&c->rcvq))) {
+        fn = item->receiveError;
+        item_app = item->app_ctx;
+        _taps_receive_restore(item);
+        tapsSlabFree(&c->recvItems, item);
+        (fn)(c->app_ctx, item_app, "Receive timed out");
+    }
+    if (_taps_release(c)) {
+        (c->connectionError)(c->app_ctx, "Receive timed out");
+    }
+    if (listener) tapsListenerDeref(listener);
 }
 
 int
 tapsConnectionReceive(TAPS_CTX *connection, void *app_ctx, TAPS_CTX *msg,
     size_t minIncompleteLength, size_t maxLength, tapsCallbacks *callbacks)
 {
-    tapsConnection *c = (tapsConnection *)connection;
-    struct iovec   *iovec;
-    int             iovcnt;
+    tapsConnection    *c = (tapsConnection *)connection;
+    struct _recv_item *item;
 
     TAPS_TRACE();
+    if (!c->proto_ctx) {
+        errno = ENOTCONN;
+        return -1;
+    }
     if (!callbacks || !callbacks->received || !callbacks->receivedPartial ||
             !callbacks->receiveError) {
         printf("Not enough callbacks");
         errno = EINVAL;
         return -1;
     }
-    ADD_ITEM(_recv_item, c->rcvq);
-    newItem->received = callbacks->received;
-    newItem->receivedPartial = callbacks->receivedPartial;
-    newItem->receiveError = callbacks->receiveError;
-    newItem->message = msg;
-    newItem->minLength = minIncompleteLength;
-    newItem->maxLength = maxLength;
-    newItem->currLength = 0;
-    newItem->connection = c;
-    newItem->app_ctx = app_ctx;
+    if (!msg && (app_ctx || (maxLength == 0) ||
+            (maxLength > MAX_RECVBUF_SIZE))) {
+        printf("Bad arguments for a pooled receive\n");
+        errno = EINVAL;
+        return -1;
+    }
+    item = tapsSlabAlloc(&c->recvItems);
+    if (!item || (tapsRingPush(&c->rcvq, item) < 0)) {
+        if (item) tapsSlabFree(&c->recvItems, item);
+        errno = ENOMEM;
+        printf("Receiving failed\n");
+        return -1;
+    }
+    item->received = callbacks->received;
+    item->receivedPartial = callbacks->receivedPartial;
+    item->receiveError = callbacks->receiveError;
+    item->message = msg;
+    item->minLength = minIncompleteLength;
+    item->maxLength = maxLength;
+    item->currLength = 0;
+    item->iovIdx = -1;
+    item->iovOffset = 0;
+    item->connection = c;
+    item->app_ctx = app_ctx;
+    item->pooled = (msg == NULL);
 
     if (c->receiveReady) {
-        c->receiveReady = FALSE;
-        iovec = tapsMessageGetIovec(msg, &iovcnt);
-        (c->handles->receive)(c->proto_ctx, newItem, iovec, iovcnt,
-        &_taps_received, &_taps_received_partial,
-               &_taps_receive_error);
+        _taps_receive_first(c);
     }
     return 0;
 }
@@ -399,19 +1328,41 @@ tapsConnectionReceive(TAPS_CTX *connection, void *app_ctx, TAPS_CTX *msg,
 void
 tapsConnectionFree(TAPS_CTX *connection)
 {
-    tapsConnection *c = connection;
+    tapsConnection    *c = connection;
+    struct _send_item *sitem;
+    struct _recv_item *ritem;
 
     TAPS_TRACE();
-    while (c->sndq) {
-        (c->sndq->sendError)(c->app_ctx, c->sndq->app_ctx, "Connection died");
-        DELETE_ITEM(c->sndq, &(c->sndq));
+    if (c->holds > 0) {
+        /* Called back from inside TAPS; finish when that returns */
+        c->freed = TRUE;
+        return;
+    }
+    _taps_cancel_timers(c);
+    if (c->rateGroup) {
+        tapsRateGroupLeave(c->rateGroup);
+    }
+    while ((sitem = tapsRingPop(&c->sndq))) {
+        (sitem->sendError)(c->app_ctx, sitem->app_ctx, "Connection died");
     }
-    while (c->rcvq) {
-        (c->rcvq->receiveError)(c->app_ctx, c->rcvq->app_ctx,
-                "Connection died");
-        DELETE_ITEM(c->rcvq, &(c->rcvq));
+    while ((sitem = tapsRingPop(&c->expq))) {
+        (sitem->expired)(c->app_ctx, sitem->app_ctx);
     }
+    while ((ritem = tapsRingPop(&c->rcvq))) {
+        (ritem->receiveError)(c->app_ctx, ritem->app_ctx, "Connection died");
+    }
+    tapsRingFree(&c->sndq);
+    tapsRingFree(&c->rcvq);
+    tapsRingFree(&c->expq);
+    _taps_free_batches(c);
+    tapsSlabDestroy(&c->sendItems);
+    tapsSlabDestroy(&c->recvItems);
 
     /* If no listener, we should free the protocol handle */
-    free(connection);
+    if (c->shared) {
+        _taps_conn_block_put((struct _taps_conn_block *)((char *)c -
+                offsetof(struct _taps_conn_block, conn)));
+    } else {
+        free(connection);
+    }
 }
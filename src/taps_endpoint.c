@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <stdlib.h>
 #include <string.h>
 #include "taps_internals.h"
@@ -37,6 +38,7 @@ typedef struct _taps_endpoint {
     unsigned char           has_protocol : 1;
     unsigned char           has_interface : 1;
     unsigned char           has_stun : 1;
+    unsigned char           has_path : 1;
     struct in_addr          ipv4;
     struct in6_addr         ipv6;
     uint16_t                port;
@@ -46,6 +48,7 @@ typedef struct _taps_endpoint {
     char                   *service;
     char                   *protocol;
     char                   *interface;
+    char                   *path;
     struct _taps_endpoint  *prevAlias;
     struct _taps_endpoint  *nextAlias;
 } tapsEndpoint;
@@ -168,6 +171,28 @@ tapsEndpointWithProtocol(TAPS_CTX *endp, char *protoName)
     return 1;
 }
 
+int
+tapsEndpointWithPath(TAPS_CTX *endp, char *path)
+{
+    tapsEndpoint *ep = endp;
+    if (ep->has_path) {
+        errno = EBUSY;
+        return 0;
+    }
+    if ((path[0] == '\0') ||
+            (strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path))) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    ep->path = strdup(path);
+    if (!ep->path) {
+        errno = ENOMEM;
+        return 0;
+    }
+    ep->has_path = true;
+    return 1;
+}
+
 int
 tapsAddAlias(TAPS_CTX *endp1, TAPS_CTX *endp2)
 {
@@ -251,6 +276,11 @@ tapsEndpointGetProperty(TAPS_CTX *endp, char *name, char *buf)
         memcpy(buf, ep->interface, strlen(ep->interface) + 1);
         return buf;
     }
+    if (strcmp(name, "path") == 0) {
+        if (!ep->has_path) return NULL;
+        memcpy(buf, ep->path, strlen(ep->path) + 1);
+        return buf;
+    }
     printf("Property not supported\n");
     return NULL;
 }
@@ -261,7 +291,16 @@ tapsEndpointGetAddress(TAPS_CTX *endp, struct sockaddr *saddr)
     tapsEndpoint        *ep = endp;
     struct sockaddr_in  *sin = (struct sockaddr_in *)saddr;
     struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)saddr;
+    struct sockaddr_un  *sun = (struct sockaddr_un *)saddr;
 
+    if (saddr->sa_family == AF_UNIX) {
+        if (!ep->has_path) {
+            return -1;
+        }
+        memset(sun->sun_path, 0, sizeof(sun->sun_path));
+        memcpy(sun->sun_path, ep->path, strlen(ep->path));
+        return 0;
+    }
     sin->sin_port = (ep->has_port ? ep->port : 0);
     switch(sin->sin_family) {
     case AF_INET:
@@ -293,6 +332,7 @@ tapsEndpointFree(TAPS_CTX *endp)
     if (ep->has_service) free(ep->service);
     if (ep->has_protocol) free(ep->protocol);
     if (ep->has_interface) free(ep->interface);
+    if (ep->has_path) free(ep->path);
     if (ep->stun_credentials) free(ep->stun_credentials);
     free(ep);
 }
@@ -100,6 +100,126 @@ struct name {                       \
 
 /* End of LIST macros */
 
+/* Ring queue of pointers. The capacity is always a power of two, so indexing
+   is a mask instead of a divide. Storage is allocated on the first push and
+   only grows; see taps_queue.c. */
+typedef struct {
+    void                **slot;
+    uint32_t              first;
+    uint32_t              count;
+    uint32_t              mask; /* capacity - 1 */
+} tapsRing;
+
+#define RING_INIT(ring)             \
+    (ring)->slot = NULL;            \
+    (ring)->first = 0;              \
+    (ring)->count = 0;              \
+    (ring)->mask = 0;
+
+#define RING_EMPTY(ring) ((ring)->count == 0)
+
+#define RING_COUNT(ring) ((ring)->count)
+
+/* i-th element from the front. Does not check bounds */
+#define RING_AT(ring, i) ((ring)->slot[((ring)->first + (i)) & (ring)->mask])
+
+#define RING_FIRST(ring) RING_AT(ring, 0)
+
+#define RING_LAST(ring)  RING_AT(ring, (ring)->count - 1)
+
+/* Returns 0 on success, -1 with errno set if the ring could not grow */
+int tapsRingPush(tapsRing *ring, void *elem);
+/* Insert elem so that it is the i-th from the front, moving the elements
+   behind it back. i must be no more than the count. Same return as Push. */
+int tapsRingInsert(tapsRing *ring, uint32_t i, void *elem);
+/* Returns NULL if the ring is empty */
+void *tapsRingPop(tapsRing *ring);
+void tapsRingFree(tapsRing *ring);
+
+/* Slab allocator for fixed-size items. Items are carved out of chunks of
+   one item, then two, doubling up to perChunk items, so that a slab that
+   only ever holds one item stays small. Freed items are recycled without
+   returning to the heap. All memory is released in tapsSlabDestroy(). */
+typedef struct {
+    void                 *freeList;
+    void                 *chunks;
+    size_t                itemSize;
+    uint32_t              perChunk;
+    uint32_t              nextChunk; /* Items in the next chunk */
+} tapsSlab;
+
+void tapsSlabInit(tapsSlab *slab, size_t itemSize, uint32_t perChunk);
+void *tapsSlabAlloc(tapsSlab *slab);
+void tapsSlabFree(tapsSlab *slab, void *item);
+void tapsSlabDestroy(tapsSlab *slab);
+
+/* Receive buffer pool, in taps_pool.c. Buffers are allocated by size class;
+   tapsPoolClass() returns -1 if len is larger than the largest class. */
+#define TAPS_POOL_NUM_CLASSES 5
+int tapsPoolClass(size_t len);
+void *tapsPoolAlloc(int poolClass);
+void tapsPoolFree(void *buf, int poolClass);
+/* Buffers taken from this thread's pool and not yet given back */
+size_t tapsPoolInUse(void);
+
+/* A message whose buffer comes from the pool, and goes back to it in
+   tapsMessageFree(). The buffer holds at least len bytes. */
+TAPS_CTX *tapsMessageNewPooled(size_t len);
+
+/* For a message made by tapsMessageNewFile(), return its fd and fill in the
+   range; -1 for a message in memory. tapsMessageMap() maps the range, if it
+   is not already, so the iovec functions see the data. It returns 0, or -1
+   with errno set. It does nothing to messages in memory. */
+int tapsMessageGetFile(TAPS_CTX *message, off_t *offset, size_t *len);
+int tapsMessageMap(TAPS_CTX *message);
+
+/* Timer wheel, in taps_timer.c. There is one per event_base: the first
+   tapsTimerWheelGet() for a base creates it, and it is freed at the last
+   tapsTimerWheelPut(). Both may be called from any thread. Timers are
+   embedded in the objects that own them, and must be cancelled before those
+   are freed. Resolution is one tick. */
+#define TAPS_TIMER_TICK_MS 4
+typedef struct _taps_timer_wheel tapsTimerWheel;
+typedef void (*tapsTimerCb)(void *arg);
+typedef struct _taps_timer {
+    struct _taps_timer   *next, *prev;
+    uint64_t              expires; /* In ticks */
+    tapsTimerCb           cb;
+    void                 *arg;
+    tapsTimerWheel       *wheel; /* NULL unless armed */
+} tapsTimer;
+
+#define TIMER_ARMED(timer) ((timer)->wheel != NULL)
+
+/* Coarse monotonic clock, in ms */
+uint64_t tapsNow(void);
+tapsTimerWheel *tapsTimerWheelGet(struct event_base *base);
+void tapsTimerWheelPut(tapsTimerWheel *wheel);
+/* The time of the last tick, in tapsNow() terms. Free to call. */
+uint64_t tapsTimerWheelNow(tapsTimerWheel *wheel);
+void tapsTimerInit(tapsTimer *timer, tapsTimerCb cb, void *arg);
+/* Re-arms the timer if it is already armed. Returns 0, or -1 with errno. */
+int tapsTimerArm(tapsTimerWheel *wheel, tapsTimer *timer, uint64_t ms);
+void tapsTimerCancel(tapsTimer *timer);
+
+/* Token bucket, in taps_rate.c. Rates are in bytes per second and must be
+   non-zero. */
+typedef struct {
+    uint64_t              rate;
+    uint64_t              burst;
+    int64_t               tokens; /* Negative when in debt */
+    uint64_t              last;   /* tapsNow() of the last refill */
+} tapsBucket;
+
+void tapsBucketInit(tapsBucket *bucket, uint64_t bitsPerSec);
+/* Refills to now. Returns 0 if a send may go now, or else the ms until it
+   may. */
+uint64_t tapsBucketWait(tapsBucket *bucket, uint64_t now);
+void tapsBucketDebit(tapsBucket *bucket, size_t bytes);
+/* Connections take a reference on their rate group */
+tapsBucket *tapsRateGroupJoin(TAPS_CTX *group);
+void tapsRateGroupLeave(TAPS_CTX *group);
+
 typedef struct _if_list {
     struct ifaddrs ifa;;
     LIST_ENTRY(struct _if_list);
@@ -159,6 +279,7 @@ typedef struct {
     char                *protocol;
     char                *libpath;
     transportAbilities   properties;
+    bool                 byPath; /* Endpoints are socket paths (AF_UNIX) */
 } tapsProtocol;
 
 #if 0
@@ -213,17 +334,39 @@ struct proto_handles {
     stopHandle        stop;
     sendHandle        send;
     receiveHandle     receive;
+    /* Optional capabilities; see taps_protocol.h */
+    uint32_t          maxSendWindow;
+    int               messageBoundaries; /* One message per Send */
+    setPropertyHandle setProperty; /* NULL if absent */
+    abortHandle       abort; /* NULL if absent */
+    listenBatchHandle listenBatch; /* NULL if absent */
+    listenBatchHandle listenShard; /* NULL if absent */
+    sendFileHandle    sendFile; /* NULL if absent */
+    setConnectionMemoryHandle setConnectionMemory; /* NULL if absent */
+    setReceiveBuffersHandle setReceiveBuffers; /* NULL if absent */
+    setPeerIdleTimeoutHandle setPeerIdleTimeout; /* NULL if absent */
+    setBusyPeerDatagramsHandle setBusyPeerDatagrams; /* NULL if absent */
 };
 
 /* Called from the preconnection */
 TAPS_CTX *tapsListenerNew(void *app_ctx, char *libpath, struct sockaddr *addr,
-        struct event_base *base, tapsCallbacks *callbacks);
-/* Connections call this; we can't send the Stopped event until all connections
-   are dead. */
+        struct event_base **bases, int numBases, tapsCallbacks *callbacks);
+/* Connections call these with the listener shard that accepted them; we can't
+   send the Stopped event until all connections are dead. */
 void tapsListenerDeref(TAPS_CTX *listener);
+tapsTimerWheel *tapsListenerTimerWheel(TAPS_CTX *listener);
 
 void _taps_closed(void *taps_ctx);
-void _taps_connection_error(void *taps_ctx);
+void _taps_connection_error(void *taps_ctx, char *reason);
+/* The allocator passed to SetConnectionMemory: proto_ctx memory with room
+   for the TAPS connection object in front. tapsConnectionNew() uses that room
+   for protocols that have the handle. */
+void *tapsConnectionMemoryAlloc(size_t size);
+void tapsConnectionMemoryRelease(void *proto_ctx);
+/* The buffer functions passed to SetReceiveBuffers, for Receives that TAPS
+   fills from its pool. */
+struct iovec *tapsReceiveBufferAlloc(void *item_ctx, int *iovcnt);
+void tapsReceiveBufferRelease(void *item_ctx);
 TAPS_CTX *tapsConnectionNew(void *proto_ctx, struct proto_handles *handles,
         TAPS_CTX *listener);
 void tapsConnectionInitialize(TAPS_CTX *ctx, void *app_ctx,
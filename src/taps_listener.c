@@ -24,38 +24,77 @@
 #include <string.h>
 #include "taps_internals.h"
 
+struct _taps_listener;
+
+/* One protocol listener on one event_base. Sharded listeners have several,
+   each accepting on its own base (and, normally, its own thread), so
+   everything here is only touched from that base's loop. */
 typedef struct {
+    struct _taps_listener   *l;
     void                    *proto_ctx; /* Opaque blob used by the protocol */
+    struct event_base       *base;
+    tapsTimerWheel          *wheel;
+    uint32_t                 ref_count; /* Live connections, plus batches */
+    int                      readyToStop;
+} tapsListenerShard;
+
+typedef struct _taps_listener {
     void                    *app_ctx; /* Opaque blob used by the app */
     struct proto_handles     handles; /* Location of protocol functions */
     tapsCbConnectionReceived connectionReceived;
     tapsCbEstablishmentError establishmentError;
     tapsCbStopped            stopped;
-    uint32_t                 ref_count;
     uint32_t                 conn_limit;
-    struct event_base       *base;
+    int                      numShards;
+    uint32_t                 shardsRunning; /* Atomic; shards not yet done */
+    int                      stopping;
     int                      readyToStop;
-    int                      baseCreatedHere; /* Did TAPS init the event_base?*/
+    tapsListenerShard       *shards;
 } tapsListener;
+#define TAPS_DEFAULT_ACCEPT_BUDGET 64
+
+static unsigned int tapsAcceptBudget = TAPS_DEFAULT_ACCEPT_BUDGET;
+static unsigned int tapsPeerIdleTimeout = 0; /* The protocol's default */
+static unsigned int tapsBusyPeerDatagrams = 0; /* Never */
+
+void
+tapsListenerSetAcceptBudget(unsigned int budget)
+{
+    tapsAcceptBudget = (budget > 0) ? budget : 1;
+}
 
+void
+tapsListenerSetPeerIdleTimeout(unsigned int ms)
+{
+    tapsPeerIdleTimeout = ms;
+}
+
+void
+tapsListenerSetBusyPeerDatagrams(unsigned int datagrams)
+{
+    tapsBusyPeerDatagrams = datagrams;
+}
+
+/* Set up a connection and offer it to the app. The caller has already taken
+   the shard reference for it. */
 static void *
-_taps_connection_received(void *taps_ctx, void *proto_ctx)
+_taps_connection_setup(tapsListenerShard *shard, void *proto_ctx)
 {
-    tapsListener   *l = taps_ctx;
+    tapsListener   *l = shard->l;
     tapsCallbacks  *callbacks;
     TAPS_CTX       *c;
     void           *app_ctx;
 
-    TAPS_TRACE();
-    c = tapsConnectionNew(proto_ctx, &l->handles, l);
+    c = tapsConnectionNew(proto_ctx, &l->handles, shard);
     if (!c) {
         printf("tapsConnectionNew failed\n");
+        tapsListenerDeref(shard);
         return NULL;
     }
-    l->ref_count++;
     app_ctx = (*(l->connectionReceived))(l->app_ctx, c, (void **)&callbacks);
     if (!callbacks || !callbacks->closed || !callbacks->connectionError) {
         _taps_closed(c);
+        tapsConnectionFree(c);
         printf("connectionReceived callback did not return callbacks\n");
         return NULL;
     }
@@ -63,33 +102,132 @@ _taps_connection_received(void *taps_ctx, void *proto_ctx)
     return c;
 }
 
+static void *
+_taps_connection_received(void *taps_ctx, void *proto_ctx)
+{
+    tapsListenerShard *shard = taps_ctx;
+
+    TAPS_TRACE();
+    shard->ref_count++;
+    return _taps_connection_setup(shard, proto_ctx);
+}
+
 static void
-_taps_stopped(void *taps_ctx)
+_taps_connections_received(void *taps_ctx, void **proto_ctxs,
+        void **taps_ctxs, int count)
 {
-    tapsListener *l = taps_ctx;
-    tapsCbStopped stopped = l->stopped;
+    tapsListenerShard *shard = taps_ctx;
+    int                i;
 
     TAPS_TRACE();
+    /* Hold the shard for the whole batch, so that a connection refused
+       early can't let it stop under the rest */
+    shard->ref_count += count + 1;
+    for (i = 0; i < count; i++) {
+        taps_ctxs[i] = _taps_connection_setup(shard, proto_ctxs[i]);
+    }
+    tapsListenerDeref(shard);
+}
+
+/* The shard has stopped listening and has no connections left. The last one
+   to get here tells the app, on whichever thread that happens to be. */
+static void
+_taps_shard_done(tapsListenerShard *shard)
+{
+    tapsListener *l = shard->l;
+    tapsCbStopped stopped;
+
+    if (__atomic_sub_fetch(&l->shardsRunning, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    stopped = l->stopped;
+    l->stopped = NULL; /* Mark this as dead */
     l->readyToStop = TRUE;
-    if (l->ref_count == 0) {
-        l->stopped = NULL; /* Mark this as dead */
+    if (stopped) {
         (*stopped)(l->app_ctx);
     }
 }
 
+static void
+_taps_stopped(void *taps_ctx)
+{
+    tapsListenerShard *shard = taps_ctx;
+
+    TAPS_TRACE();
+    shard->readyToStop = TRUE;
+    if (shard->ref_count == 0) {
+        _taps_shard_done(shard);
+    }
+}
+
+static void
+_taps_shard_stop(evutil_socket_t fd, short event, void *arg)
+{
+    tapsListenerShard *shard = arg;
+
+    TAPS_TRACE();
+    (shard->l->handles.stop)(shard->proto_ctx, &_taps_stopped);
+}
+
+/* Stop every shard. Other shards' loops may be running on other threads, so
+   each is stopped from its own loop. */
+static void
+_taps_listener_stop(tapsListener *l)
+{
+    int i;
+
+    l->stopping = TRUE;
+    if (l->numShards == 1) {
+        _taps_shard_stop(-1, 0, &l->shards[0]);
+        return;
+    }
+    for (i = 0; i < l->numShards; i++) {
+        if (event_base_once(l->shards[i].base, -1, EV_TIMEOUT,
+                &_taps_shard_stop, &l->shards[i], NULL) < 0) {
+            printf("Couldn't schedule listener stop\n");
+        }
+    }
+}
+
+static void
+_taps_listener_free(tapsListener *l)
+{
+    int i;
+
+    for (i = 0; i < l->numShards; i++) {
+        if (l->shards[i].wheel) tapsTimerWheelPut(l->shards[i].wheel);
+    }
+    if (l->handles.proto) dlclose(l->handles.proto); /* XXX check for errors */
+    free(l->shards);
+    free(l);
+}
+
 TAPS_CTX *
 tapsListenerNew(void *app_ctx, char *libpath, struct sockaddr *addr,
-        struct event_base *base, tapsCallbacks *callbacks)
+        struct event_base **bases, int numBases, tapsCallbacks *callbacks)
 {
-    tapsListener      *l;
+    tapsListener           *l;
+    tapsListenerShard      *shard;
+    maxSendWindowHandle     maxSendWindow;
+    messageBoundariesHandle messageBoundaries;
+    int                     i, err;
 
     TAPS_TRACE();
+    if (numBases < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
     l = malloc(sizeof(tapsListener));
     if (!l) {
         errno = ENOMEM;
         return l;
     }
     memset(l, 0, sizeof(tapsListener));
+    l->shards = calloc(numBases, sizeof(tapsListenerShard));
+    if (!l->shards) {
+        errno = ENOMEM;
+        goto fail;
+    }
     l->handles.proto = dlopen(libpath, RTLD_LAZY);
     if (!l->handles.proto) {
         printf("Couldn't get protocol handle: %s\n", dlerror());
@@ -117,41 +255,112 @@ tapsListenerNew(void *app_ctx, char *libpath, struct sockaddr *addr,
         printf("Couldn't get Receive handle: %s\n", dlerror());
         goto fail;
     }
-    l->baseCreatedHere = (base == NULL);
-    l->base = l->baseCreatedHere ? event_base_new() : base;
-    if (!l->base) {
-       printf("base failed\n");
-       goto fail;
+    /* Optional capabilities */
+    maxSendWindow = dlsym(l->handles.proto, "MaxSendWindow");
+    l->handles.maxSendWindow = (maxSendWindow) ? (*maxSendWindow)() : 1;
+    messageBoundaries = dlsym(l->handles.proto, "MessageBoundaries");
+    l->handles.messageBoundaries = (messageBoundaries) ?
+            (*messageBoundaries)() : 0;
+    l->handles.setProperty = dlsym(l->handles.proto, "SetProperty");
+    l->handles.abort = dlsym(l->handles.proto, "Abort");
+    l->handles.listenBatch = dlsym(l->handles.proto, "ListenBatch");
+    l->handles.listenShard = dlsym(l->handles.proto, "ListenShard");
+    l->handles.sendFile = dlsym(l->handles.proto, "SendFile");
+    l->handles.setConnectionMemory = dlsym(l->handles.proto,
+            "SetConnectionMemory");
+    if (l->handles.setConnectionMemory) {
+        (l->handles.setConnectionMemory)(&tapsConnectionMemoryAlloc,
+                &tapsConnectionMemoryRelease);
     }
-    /* XXX fix this */
-    if (l->baseCreatedHere) {
-        printf("Error: TAPS currently requires the application to provide an "
-                "event_base\n");
-        goto fail;
+    l->handles.setReceiveBuffers = dlsym(l->handles.proto,
+            "SetReceiveBuffers");
+    if (l->handles.setReceiveBuffers) {
+        (l->handles.setReceiveBuffers)(&tapsReceiveBufferAlloc,
+                &tapsReceiveBufferRelease);
+    }
+    l->handles.setPeerIdleTimeout = dlsym(l->handles.proto,
+            "SetPeerIdleTimeout");
+    if (l->handles.setPeerIdleTimeout) {
+        (l->handles.setPeerIdleTimeout)(tapsPeerIdleTimeout);
+    }
+    l->handles.setBusyPeerDatagrams = dlsym(l->handles.proto,
+            "SetBusyPeerDatagrams");
+    if (l->handles.setBusyPeerDatagrams) {
+        (l->handles.setBusyPeerDatagrams)(tapsBusyPeerDatagrams);
     }
-    /* It would be good to get rid of doing the callbacks here */
-    l->proto_ctx = (l->handles.listen)(l, l->base, addr,
-            &_taps_connection_received, NULL,
-            &_taps_closed, &_taps_connection_error);
-    if (!l->proto_ctx) {
-        printf("Protocol Listen failed\n");
+    if ((numBases > 1) && !l->handles.listenShard) {
+        printf("Protocol can't shard listeners\n");
+        errno = EOPNOTSUPP;
         goto fail;
-        /* XXX early failure */
     }
     l->conn_limit = UINT32_MAX;
     l->connectionReceived = callbacks->connectionReceived;
     l->establishmentError = callbacks->establishmentError;
     l->app_ctx = app_ctx ? app_ctx : l;
+    l->shardsRunning = numBases;
+    for (i = 0; i < numBases; i++) {
+        shard = &l->shards[i];
+        shard->l = l;
+        shard->base = bases[i];
+        /* XXX fix this */
+        if (!shard->base) {
+            printf("Error: TAPS currently requires the application to "
+                    "provide an event_base\n");
+            goto fail;
+        }
+        shard->wheel = tapsTimerWheelGet(shard->base);
+        if (!shard->wheel) {
+            printf("No timer wheel\n");
+            goto fail;
+        }
+        /* It would be good to get rid of doing the callbacks here */
+        if (numBases > 1) {
+            shard->proto_ctx = (l->handles.listenShard)(shard, shard->base,
+                    addr, tapsAcceptBudget, &_taps_connections_received, NULL,
+                    &_taps_closed, &_taps_connection_error);
+        } else if (l->handles.listenBatch) {
+            shard->proto_ctx = (l->handles.listenBatch)(shard, shard->base,
+                    addr, tapsAcceptBudget, &_taps_connections_received, NULL,
+                    &_taps_closed, &_taps_connection_error);
+        } else {
+            shard->proto_ctx = (l->handles.listen)(shard, shard->base, addr,
+                    &_taps_connection_received, NULL,
+                    &_taps_closed, &_taps_connection_error);
+        }
+        if (!shard->proto_ctx) {
+            printf("Protocol Listen failed\n");
+            goto fail;
+            /* XXX early failure */
+        }
+        l->numShards++;
+    }
     return l;
 fail:
+    /* Keep the reason, such as EADDRINUSE from the protocol's bind(), for
+       the caller */
+    err = errno;
     if (l) {
-        if (l->handles.proto) dlclose(l->handles.proto);
-        if (l->base && l->baseCreatedHere) event_base_free(l->base);
-        free(l);
+        /* None of these loops have run yet, so it's safe to stop them all
+           from here; with no app callback, nothing is reported */
+        for (i = 0; i < l->numShards; i++) {
+            (l->handles.stop)(l->shards[i].proto_ctx, &_taps_stopped);
+        }
+        if (l->shards) {
+            /* Shards that failed may still hold a wheel */
+            l->numShards = numBases;
+        }
+        _taps_listener_free(l);
     }
+    errno = err;
     return NULL;
 }
 
+tapsTimerWheel *
+tapsListenerTimerWheel(TAPS_CTX *shard)
+{
+    return ((tapsListenerShard *)shard)->wheel;
+}
+
 int
 tapsListenerStop(TAPS_CTX *listener, tapsCallbacks *callbacks)
 {
@@ -163,20 +372,18 @@ tapsListenerStop(TAPS_CTX *listener, tapsCallbacks *callbacks)
         return -1;
     }
     l->stopped = callbacks->stopped;
-    (l->handles.stop)(l->proto_ctx, &_taps_stopped);
+    _taps_listener_stop(l);
     return 0;
 }
 
 void
 tapsListenerDeref(TAPS_CTX *listener)
 {
-    tapsListener *l = (tapsListener *)listener;
-    tapsCbStopped stopped = l->stopped;
+    tapsListenerShard *shard = listener;
 
-    l->ref_count--;
-    if (l->readyToStop && (l->ref_count == 0)) {
-        l->stopped = NULL;
-        (*stopped)(l->app_ctx);
+    shard->ref_count--;
+    if (shard->readyToStop && (shard->ref_count == 0)) {
+        _taps_shard_done(shard);
     }
 }
 
@@ -186,17 +393,15 @@ tapsListenerFree(TAPS_CTX *listener)
     tapsListener     *l = (tapsListener *)listener;
 
     TAPS_TRACE();
-    if (!l->readyToStop && !l->stopped) {
+    if (!l->stopping) {
         /* Early Free */
-        (l->handles.stop)(l->proto_ctx, &_taps_stopped);
-        l->readyToStop = TRUE;
+        _taps_listener_stop(l);
         return 0;
     }
-    if (l->stopped) {
+    if (!l->readyToStop) {
         printf("Trying to free before stopping\n");
         return -1;
     }
-    dlclose(l->handles.proto); /* XXX check for errors */
-    free(l);
+    _taps_listener_free(l);
     return 0;
 }
@@ -20,7 +20,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
+#include <unistd.h>
 #include "taps_internals.h"
 
 #if 0
@@ -53,7 +55,10 @@ static const tapsMessageContext tapsMessageDefault = {
 };
 #endif
 
+/* The subset of the message context above that is implemented */
 typedef struct {
+    unsigned int          msgLifetime; /* 0 = infinite */
+    unsigned int          msgPrio;
 } tapsMessageProperties;
 
 typedef struct {
@@ -61,6 +66,18 @@ typedef struct {
     struct iovec         *list; /* NULL unless iovcnt > 1 */
     int                   iovcnt; /* If iovcnt = 1, it's just a buffer */
     tapsMessageProperties props;
+    /* If the buffer came from the receive pool, where to return it. buf may
+       have been truncated, so keep the original pointer. */
+    void                 *poolBuf;
+    int                   poolClass;
+    /* File-backed messages send fileLen bytes of fd from offset. buf is
+       empty until the range is mapped, which only happens if something
+       needs the bytes in memory. */
+    int                   fd;   /* -1 for memory buffers */
+    off_t                 offset;
+    size_t                fileLen;
+    void                 *map;
+    size_t                mapLen;
 } tapsMessage;
 
 TAPS_CTX *
@@ -78,9 +95,129 @@ tapsMessageNew(void *data, size_t len)
     m->list = NULL;
     m->iovcnt = 1;
     memset(&m->props, 0, sizeof(tapsMessageProperties));
+    m->props.msgPrio = TAPS_MSG_PRIO_DEFAULT;
+    m->poolBuf = NULL;
+    m->poolClass = -1;
+    m->fd = -1;
+    m->map = NULL;
     return m;
 }
 
+TAPS_CTX *
+tapsMessageNewFile(int fd, off_t offset, size_t len)
+{
+    tapsMessage *m;
+
+    TAPS_TRACE();
+    if ((fd < 0) || (offset < 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    m = tapsMessageNew(NULL, 0);
+    if (!m) {
+        return NULL;
+    }
+    m->fd = fd;
+    m->offset = offset;
+    m->fileLen = len;
+    return m;
+}
+
+int
+tapsMessageGetFile(TAPS_CTX *message, off_t *offset, size_t *len)
+{
+    tapsMessage *m = (tapsMessage *)message;
+
+    if (m->fd < 0) {
+        return -1;
+    }
+    if (offset) *offset = m->offset;
+    if (len) *len = m->fileLen;
+    return m->fd;
+}
+
+int
+tapsMessageMap(TAPS_CTX *message)
+{
+    tapsMessage *m = (tapsMessage *)message;
+    long         page = sysconf(_SC_PAGESIZE);
+    off_t        start;
+
+    if ((m->fd < 0) || m->map || (m->fileLen == 0)) {
+        return 0;
+    }
+    /* mmap wants a page-aligned offset */
+    start = m->offset - (m->offset % page);
+    m->mapLen = m->fileLen + (m->offset - start);
+    m->map = mmap(NULL, m->mapLen, PROT_READ, MAP_SHARED, m->fd, start);
+    if (m->map == MAP_FAILED) {
+        m->map = NULL;
+        return -1;
+    }
+    m->buf.iov_base = (char *)m->map + (m->offset - start);
+    m->buf.iov_len = m->fileLen;
+    return 0;
+}
+
+TAPS_CTX *
+tapsMessageNewPooled(size_t len)
+{
+    int          poolClass = tapsPoolClass(len);
+    void        *buf;
+    tapsMessage *m;
+
+    TAPS_TRACE();
+    if (poolClass < 0) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    buf = tapsPoolAlloc(poolClass);
+    if (!buf) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    m = tapsMessageNew(buf, len);
+    if (!m) {
+        tapsPoolFree(buf, poolClass);
+        return NULL;
+    }
+    m->poolBuf = buf;
+    m->poolClass = poolClass;
+    return m;
+}
+
+void
+tapsMessageSetPriority(TAPS_CTX *message, unsigned int prio)
+{
+    tapsMessage *m = (tapsMessage *)message;
+
+    m->props.msgPrio = prio;
+}
+
+unsigned int
+tapsMessageGetPriority(TAPS_CTX *message)
+{
+    tapsMessage *m = (tapsMessage *)message;
+
+    return m->props.msgPrio;
+}
+
+void
+tapsMessageSetLifetime(TAPS_CTX *message, unsigned int lifetime)
+{
+    tapsMessage *m = (tapsMessage *)message;
+
+    m->props.msgLifetime = lifetime;
+}
+
+unsigned int
+tapsMessageGetLifetime(TAPS_CTX *message)
+{
+    tapsMessage *m = (tapsMessage *)message;
+
+    return m->props.msgLifetime;
+}
+
 void *
 tapsMessageGetFirstBuf(TAPS_CTX *message, size_t *len)
 {
@@ -88,6 +225,7 @@ tapsMessageGetFirstBuf(TAPS_CTX *message, size_t *len)
     struct iovec *buf = (m->list) ? m->list : &(m->buf);
 
     TAPS_TRACE();
+    tapsMessageMap(m);
     *len = buf->iov_len;
     return buf->iov_base;
 }
@@ -97,6 +235,7 @@ tapsMessageGetIovec(TAPS_CTX *message, int *iovcnt)
 {
     tapsMessage *m = (tapsMessage *)message;
 
+    tapsMessageMap(m);
     if (iovcnt) *iovcnt = m->iovcnt;
     return (m->list ? m->list : &(m->buf));
 }
@@ -109,6 +248,14 @@ tapsMessageTruncate(TAPS_CTX *message, size_t length)
     size_t        remaining = length;
     int           row = 0;
 
+    if (m->fd >= 0) {
+        if (length < m->fileLen) {
+            m->fileLen = length;
+        }
+        if (!m->map) {
+            return;
+        }
+    }
     while ((remaining > buf->iov_len) && (row < m->iovcnt)) {
         remaining -= buf->iov_len;
         buf++;
@@ -136,6 +283,8 @@ tapsMessageFree(TAPS_CTX *message)
         m->iovcnt--;
     }
 #endif
+    if (m->poolBuf) tapsPoolFree(m->poolBuf, m->poolClass);
+    if (m->map) munmap(m->map, m->mapLen);
     if (m->list) free(m->list);
     free(m);
 }
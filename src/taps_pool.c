@@ -0,0 +1,207 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/*
+ * Receive buffer pool. Buffers come in a few size classes and are carved out
+ * of large mmap()ed arenas, which are backed by huge pages where the system
+ * allows it. Freed buffers go back on a per-class free list; arenas are never
+ * returned to the system.
+ *
+ * The pool is per thread, like the event_base that drives it. Each arena
+ * starts with a header naming the pool it belongs to, and arenas are aligned
+ * to their size, so a buffer finds its owner from its address. A buffer freed
+ * on another thread goes on the owner's remote list, without a lock, and the
+ * owner takes the whole list back when its own free list runs dry.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "taps_internals.h"
+
+#define TAPS_POOL_ARENA_SIZE (2 * 1024 * 1024) /* One x86 huge page */
+/* The arena header takes the first buffer's worth, to keep the alignment */
+#define TAPS_POOL_HEADER_SIZE 512
+
+static const size_t tapsPoolClassSize[TAPS_POOL_NUM_CLASSES] = {
+    512, 2048, 8192, 32768, 65536,
+};
+
+struct _pool {
+    void   *freeList[TAPS_POOL_NUM_CLASSES];
+    /* Freed by other threads; pushed atomically, taken all at once */
+    void   *remoteList[TAPS_POOL_NUM_CLASSES];
+    char   *arena;    /* Unused part of the current arena */
+    size_t  arenaLeft;
+    size_t  inUse;    /* Atomic, as other threads give buffers back */
+};
+
+struct _arena_header {
+    struct _pool *owner;
+};
+
+/* Allocated on first use, and never freed, as its arenas may still have
+   buffers out when the thread exits */
+static __thread struct _pool *pool;
+static bool tapsPoolHugePages = false;
+
+void
+tapsMessagePoolUseHugePages(bool enable)
+{
+    tapsPoolHugePages = enable;
+}
+
+/* Map an arena aligned to its size: map twice as much, and trim both ends */
+static void *
+_taps_pool_map_aligned(void)
+{
+    char      *map;
+    uintptr_t  start;
+    size_t     head;
+
+    map = mmap(NULL, 2 * TAPS_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    start = ((uintptr_t)map + TAPS_POOL_ARENA_SIZE - 1) &
+            ~(uintptr_t)(TAPS_POOL_ARENA_SIZE - 1);
+    head = start - (uintptr_t)map;
+    if (head > 0) {
+        munmap(map, head);
+    }
+    munmap((char *)start + TAPS_POOL_ARENA_SIZE, TAPS_POOL_ARENA_SIZE - head);
+    return (void *)start;
+}
+
+static int
+_taps_pool_new_arena(void)
+{
+    void *arena = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (tapsPoolHugePages) {
+        /* Only works if the admin has reserved huge pages, which are
+           aligned to their size */
+        arena = mmap(NULL, TAPS_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if ((arena != MAP_FAILED) &&
+                ((uintptr_t)arena & (TAPS_POOL_ARENA_SIZE - 1))) {
+            munmap(arena, TAPS_POOL_ARENA_SIZE);
+            arena = MAP_FAILED;
+        }
+    }
+#endif
+    if (arena == MAP_FAILED) {
+        arena = _taps_pool_map_aligned();
+        if (arena == MAP_FAILED) {
+            errno = ENOMEM;
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        /* Ask for transparent huge pages; harmless if they're disabled */
+        madvise(arena, TAPS_POOL_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+    ((struct _arena_header *)arena)->owner = pool;
+    /* Whatever is left of the old arena, which is less than the largest
+       class, is abandoned */
+    pool->arena = (char *)arena + TAPS_POOL_HEADER_SIZE;
+    pool->arenaLeft = TAPS_POOL_ARENA_SIZE - TAPS_POOL_HEADER_SIZE;
+    return 0;
+}
+
+/* Returns the smallest class that holds len, or -1 if it is too big. */
+int
+tapsPoolClass(size_t len)
+{
+    int i;
+
+    for (i = 0; i < TAPS_POOL_NUM_CLASSES; i++) {
+        if (len <= tapsPoolClassSize[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void *
+tapsPoolAlloc(int poolClass)
+{
+    void   *buf;
+    size_t  size = tapsPoolClassSize[poolClass];
+
+    if (!pool) {
+        pool = calloc(1, sizeof(struct _pool));
+        if (!pool) {
+            return NULL;
+        }
+    }
+    buf = pool->freeList[poolClass];
+    if (!buf) {
+        buf = __atomic_exchange_n(&pool->remoteList[poolClass], NULL,
+                __ATOMIC_ACQUIRE);
+    }
+    if (buf) {
+        pool->freeList[poolClass] = *(void **)buf;
+        __atomic_add_fetch(&pool->inUse, 1, __ATOMIC_RELAXED);
+        return buf;
+    }
+    if ((pool->arenaLeft < size) && (_taps_pool_new_arena() < 0)) {
+        return NULL;
+    }
+    /* Class sizes are multiples of 512, so every buffer is 512-aligned */
+    buf = pool->arena;
+    pool->arena += size;
+    pool->arenaLeft -= size;
+    __atomic_add_fetch(&pool->inUse, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void
+tapsPoolFree(void *buf, int poolClass)
+{
+    struct _arena_header *arena = (struct _arena_header *)((uintptr_t)buf &
+            ~(uintptr_t)(TAPS_POOL_ARENA_SIZE - 1));
+    struct _pool         *owner = arena->owner;
+    void                 *head;
+
+    if (owner == pool) {
+        *(void **)buf = pool->freeList[poolClass];
+        pool->freeList[poolClass] = buf;
+    } else {
+        /* The owner only ever takes the whole list, so there is no ABA */
+        head = __atomic_load_n(&owner->remoteList[poolClass],
+                __ATOMIC_RELAXED);
+        do {
+            *(void **)buf = head;
+        } while (!__atomic_compare_exchange_n(&owner->remoteList[poolClass],
+                &head, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    __atomic_sub_fetch(&owner->inUse, 1, __ATOMIC_RELAXED);
+}
+
+/* Counts buffers from this thread's pool, whichever thread frees them */
+size_t
+tapsPoolInUse(void)
+{
+    return pool ? __atomic_load_n(&pool->inUse, __ATOMIC_RELAXED) : 0;
+}
@@ -24,6 +24,7 @@
 #include <stddef.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <string.h>
 #include <errno.h>
 #include "taps_internals.h"
@@ -154,7 +155,7 @@ tapsPreconnectionNew(TAPS_CTX **localEndpoint, int numLocal,
         errno = ENOMEM;
         return NULL;
     }
-    memset(pc, 0, sizeof(pc));
+    memset(pc, 0, sizeof(tapsPreconnection));
     memcpy(pc->local, localEndpoint, sizeof(TAPS_CTX *) * numLocal);
     memcpy(pc->remote, remoteEndpoint, sizeof(TAPS_CTX *) * numRemote);
     pc->numLocal = numLocal;
@@ -297,15 +298,65 @@ fail:
 }
 #endif
 
+/* The first candidate that does, or doesn't, take socket paths; or -1 */
+static int
+_taps_candidate(tapsPreconnection *pc, bool byPath)
+{
+    int i;
+
+    for (i = 0; i < pc->numProtocols; i++) {
+        if (pc->protocol[i].byPath == byPath) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* An endpoint with a socket path, and no address but loopback, is on this
+   host, and is better served without the TCP/IP stack */
+static bool
+_taps_endpoint_is_local(TAPS_CTX *ep)
+{
+    struct sockaddr_un  sun;
+    struct sockaddr_in  sin;
+    struct sockaddr_in6 sin6;
+
+    sun.sun_family = AF_UNIX;
+    if (tapsEndpointGetAddress(ep, (struct sockaddr *)&sun) < 0) {
+        return false;
+    }
+    sin.sin_family = AF_INET;
+    if ((tapsEndpointGetAddress(ep, (struct sockaddr *)&sin) == 0) &&
+            ((ntohl(sin.sin_addr.s_addr) >> IN_CLASSA_NSHIFT) !=
+            IN_LOOPBACKNET)) {
+        return false;
+    }
+    sin6.sin6_family = AF_INET6;
+    if ((tapsEndpointGetAddress(ep, (struct sockaddr *)&sin6) == 0) &&
+            !IN6_IS_ADDR_LOOPBACK(&sin6.sin6_addr)) {
+        return false;
+    }
+    return true;
+}
+
 TAPS_CTX *
 tapsPreconnectionListen(TAPS_CTX *preconn, void *app_ctx,
         struct event_base *base, tapsCallbacks *callbacks)
 {
-    int                 i;
+    return tapsPreconnectionListenSharded(preconn, app_ctx, &base, 1,
+            callbacks);
+}
+
+TAPS_CTX *
+tapsPreconnectionListenSharded(TAPS_CTX *preconn, void *app_ctx,
+        struct event_base **bases, int numBases, tapsCallbacks *callbacks)
+{
+    int                 i, proto = -1;
     tapsPreconnection  *pc = (tapsPreconnection *)preconn;
     TAPS_CTX           *l = NULL;
     struct sockaddr_in  sin;
     struct sockaddr_in6 sin6;
+    struct sockaddr_un  sun;
     struct sockaddr    *addr;
 
     TAPS_TRACE();
@@ -315,13 +366,34 @@ tapsPreconnectionListen(TAPS_CTX *preconn, void *app_ctx,
         printf("Missing preconnection arguments\n");
         return NULL;
     }
-    if (!base) {
+    if (!bases || (numBases < 1)) {
         errno = EINVAL;
-        printf("Base = NULL not yet supported\n"); /* XXX */
         return NULL;
     }
+    for (i = 0; i < numBases; i++) {
+        if (!bases[i]) {
+            errno = EINVAL;
+            printf("Base = NULL not yet supported\n"); /* XXX */
+            return NULL;
+        }
+    }
     /* XXX Pick the best protocol, not just the first */
     /* XXX Check all the local endpoints */
+    if (_taps_endpoint_is_local(pc->local[0])) {
+        proto = _taps_candidate(pc, true);
+    }
+    if (proto >= 0) {
+        sun.sun_family = AF_UNIX;
+        addr = (struct sockaddr *)&sun;
+        tapsEndpointGetAddress(pc->local[0], addr);
+        return tapsListenerNew(app_ctx, pc->protocol[proto].libpath, addr,
+                bases, numBases, callbacks);
+    }
+    proto = _taps_candidate(pc, false);
+    if (proto < 0) {
+        errno = ENOPROTOOPT;
+        return NULL;
+    }
     sin6.sin6_family = AF_INET6;
     /* Just do ipv6 if present, else ipv4, for now */
     addr = (struct sockaddr *)&sin6;
@@ -345,8 +417,8 @@ tapsPreconnectionListen(TAPS_CTX *preconn, void *app_ctx,
             return NULL;
         }
     }
-    l = tapsListenerNew(app_ctx, pc->protocol[0].libpath, addr, base,
-            callbacks);
+    l = tapsListenerNew(app_ctx, pc->protocol[proto].libpath, addr, bases,
+            numBases, callbacks);
     return l;
 }
 
@@ -23,6 +23,7 @@
 
 #include <event2/event.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 #include <sys/uio.h>
 #include "taps_debug.h"
 
@@ -32,6 +33,11 @@
 /* The second void * is the new, opaque protocol connection context for the
    protocol. It returns the taps context */
 typedef void *(*ConnectionReceivedCb)(void *, void *);
+/* A batch of new connections: the listener's TAPS context, the new protocol
+   contexts, an array TAPS fills in with their TAPS contexts, and the count.
+   A NULL TAPS context means the connection was refused, and the protocol
+   should close it. */
+typedef void (*ConnectionsReceivedCb)(void *, void **, void **, int);
 typedef void (*EstablishmentErrorCb)(void *, char *);
 typedef void (*StoppedCb)(void *);
 /* Connection Context */
@@ -67,10 +73,104 @@ typedef void *(*listenHandle)(void *, struct event_base *, struct sockaddr *,
 /* Must be a function "Stop" */
 typedef void (*stopHandle)(void *, StoppedCb);
 /* Must be named "Send" */
-/* args: proto context, taps context, data, iovcnt; then callbacks */
+/* args: proto context, taps context, data, iovcnt; then callbacks.
+   Returns -1 if the Send was refused, 0 if the protocol will call back when
+   it is done, or 1 if it is already done: the whole message was handed to
+   the network, and no callback will follow. */
 typedef int (*sendHandle)(void *, void *, struct iovec *, int, SentCb,
         ExpiredCb, SendErrorCb);
 /* Must be named "Receive" */;
 /* args: proto context, callbacks */
 typedef void (*receiveHandle)(void *, void *, struct iovec *, int,
         ReceivedCb, ReceivedPartialCb, ReceiveErrorCb);
+
+/* The functions below are optional. TAPS looks them up when it loads the
+   library, and falls back to a conservative default if they are missing. */
+
+/* "MaxSendWindow": the number of Sends the protocol will accept on one
+   connection before the first of them completes. Completions must be reported
+   in the order the Sends were made. If absent, TAPS makes one Send at a
+   time. */
+typedef unsigned int (*maxSendWindowHandle)(void);
+
+/* "MessageBoundaries": nonzero if each Send is a message of its own on the
+   wire, as for a datagram protocol. TAPS then gives the protocol one message
+   per Send, and never coalesces several into one iovec. */
+typedef int (*messageBoundariesHandle)(void);
+
+/* "SetProperty": apply a connection property to a protocol connection
+   context. value points to len bytes of the type given below. Returns 0 on
+   success, or -1 with errno set (ENOPROTOOPT if the property is unsupported,
+   which TAPS ignores). Properties:
+   * "sendBufferLow" (size_t): TAPS considers the send queue drained at this
+     many bytes. A protocol that buffers sent data should hold Sent callbacks
+     until no more than about this much is left unsent.
+   * "maxSendRate" (uint64_t): pace the connection to this many bits per
+     second; 0 removes the limit. If this fails, TAPS paces the connection
+     itself.
+   * "zeroCopyThreshold" (size_t): send without copying when a Send is at
+     least this many bytes; 0 turns it off. Sent for those may be reported
+     only once the protocol no longer needs the buffers.
+   * "keepAliveTimeout" (unsigned int): seconds of idleness before a
+     keep-alive; 0 turns them off.
+   * "userTimeout" (unsigned int): ms sent data may go unacknowledged before
+     the connection fails; 0 for the default.
+   * "capacityProfile" (int): a tapsCapacity value from taps.h. */
+typedef int (*setPropertyHandle)(void *, char *, void *, size_t);
+
+/* "ListenBatch": like Listen, but new connections are reported in batches,
+   of at most 'budget' per wakeup of the listening socket. The extra argument
+   is the budget, before the callbacks. If present, TAPS uses this instead of
+   Listen. */
+typedef void *(*listenBatchHandle)(void *, struct event_base *,
+        struct sockaddr *, unsigned int, ConnectionsReceivedCb,
+        EstablishmentErrorCb, ClosedCb, ConnectionErrorCb);
+
+/* "ListenShard": exactly like ListenBatch, except that several listeners may
+   share the address, with the kernel spreading new connections across them
+   (SO_REUSEPORT). TAPS calls it once per event_base of a sharded listener,
+   and needs it to shard at all. */
+
+/* "Abort": tear down a connection at once, discarding anything unsent, and
+   free the protocol connection context. No callbacks are made for it; TAPS
+   reports the error itself. Used for timeouts. */
+typedef void (*abortHandle)(void *);
+
+/* "SendFile": like Send, but the data is len bytes of the file fd from
+   offset, instead of an iovec: proto context, taps context, fd, offset, len,
+   then callbacks. The return value is the same as for Send. The fd belongs
+   to the application; the protocol must not close it. If absent, TAPS maps
+   file-backed messages into memory and uses Send. */
+typedef int (*sendFileHandle)(void *, void *, int, off_t, size_t, SentCb,
+        ExpiredCb, SendErrorCb);
+
+/* "SetConnectionMemory": allocate protocol connection contexts with
+   alloc(size), instead of malloc(), and give them back with release(ptr)
+   instead of free(). TAPS puts its own connection object in the same block.
+   It calls this once, before the first Listen. */
+typedef void *(*ConnAllocCb)(size_t);
+typedef void (*ConnReleaseCb)(void *);
+typedef void (*setConnectionMemoryHandle)(ConnAllocCb, ConnReleaseCb);
+
+/* "SetReceiveBuffers": TAPS may then pass Receive a NULL iovec, when the
+   buffer is its own, and only takes one once the protocol has data for it.
+   The protocol calls alloc(taps context, &iovcnt) when it is about to read,
+   and reads into the iovec that returns; if that is NULL, it fails the
+   Receive with ReceiveErrorCb. If the read finds nothing after all, it gives
+   the buffer back with release(taps context), and asks again next time. TAPS
+   calls it once, before the first Listen. */
+typedef struct iovec *(*RecvAllocCb)(void *, int *);
+typedef void (*RecvReleaseCb)(void *);
+typedef void (*setReceiveBuffersHandle)(RecvAllocCb, RecvReleaseCb);
+
+/* "SetPeerIdleTimeout": for a connectionless protocol, the ms a peer may be
+   quiet before its connection closes, for listeners created afterwards; 0
+   means the protocol's default. TAPS calls it before each Listen. */
+typedef void (*setPeerIdleTimeoutHandle)(unsigned int);
+
+/* "SetBusyPeerDatagrams": for a connectionless protocol, the datagrams a peer
+   may send within about a second before it is given a socket of its own,
+   for listeners created afterwards; 0 never does, and the listener's
+   address is not shared but for ListenShard. TAPS calls it before each
+   Listen. */
+typedef void (*setBusyPeerDatagramsHandle)(unsigned int);
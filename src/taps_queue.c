@@ -0,0 +1,176 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/*
+ * Containers for the per-message hot path: a growable ring of pointers used as
+ * a queue, and a slab allocator for fixed-size items. Neither touches the heap
+ * once it has grown to the connection's working set.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "taps_internals.h"
+
+#define TAPS_RING_INITIAL_SIZE 8
+
+static int
+_taps_ring_grow(tapsRing *r)
+{
+    uint32_t   size = (r->slot) ? (r->mask + 1) * 2 : TAPS_RING_INITIAL_SIZE;
+    void     **slot;
+    uint32_t   i;
+
+    slot = malloc(sizeof(void *) * size);
+    if (!slot) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* Unwrap the old contents so that they start at slot 0 */
+    for (i = 0; i < r->count; i++) {
+        slot[i] = RING_AT(r, i);
+    }
+    free(r->slot);
+    r->slot = slot;
+    r->first = 0;
+    r->mask = size - 1;
+    return 0;
+}
+
+int
+tapsRingPush(tapsRing *r, void *elem)
+{
+    if (!r->slot || (r->count > r->mask)) {
+        if (_taps_ring_grow(r) < 0) {
+            return -1;
+        }
+    }
+    r->count++;
+    RING_LAST(r) = elem;
+    return 0;
+}
+
+int
+tapsRingInsert(tapsRing *r, uint32_t i, void *elem)
+{
+    uint32_t j;
+
+    if (tapsRingPush(r, elem) < 0) {
+        return -1;
+    }
+    for (j = r->count - 1; j > i; j--) {
+        RING_AT(r, j) = RING_AT(r, j - 1);
+    }
+    RING_AT(r, i) = elem;
+    return 0;
+}
+
+void *
+tapsRingPop(tapsRing *r)
+{
+    void *elem;
+
+    if (RING_EMPTY(r)) {
+        return NULL;
+    }
+    elem = RING_FIRST(r);
+    r->first = (r->first + 1) & r->mask;
+    r->count--;
+    return elem;
+}
+
+void
+tapsRingFree(tapsRing *r)
+{
+    free(r->slot);
+    RING_INIT(r);
+}
+
+/* Each chunk starts with a pointer to the next chunk, followed by the items.
+   Free items hold a pointer to the next free item in their first word. */
+void
+tapsSlabInit(tapsSlab *s, size_t itemSize, uint32_t perChunk)
+{
+    s->freeList = NULL;
+    s->chunks = NULL;
+    s->itemSize = (itemSize < sizeof(void *)) ? sizeof(void *) : itemSize;
+    /* Keep every item pointer-aligned */
+    s->itemSize = (s->itemSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    s->perChunk = (perChunk > 0) ? perChunk : 1;
+    s->nextChunk = 1;
+}
+
+static int
+_taps_slab_grow(tapsSlab *s)
+{
+    char     *chunk, *item;
+    uint32_t  i;
+
+    chunk = malloc(sizeof(void *) + s->itemSize * s->nextChunk);
+    if (!chunk) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *(void **)chunk = s->chunks;
+    s->chunks = chunk;
+    item = chunk + sizeof(void *);
+    for (i = 0; i < s->nextChunk; i++, item += s->itemSize) {
+        *(void **)item = s->freeList;
+        s->freeList = item;
+    }
+    if (s->nextChunk < s->perChunk) {
+        s->nextChunk = (s->nextChunk * 2 < s->perChunk) ?
+                s->nextChunk * 2 : s->perChunk;
+    }
+    return 0;
+}
+
+void *
+tapsSlabAlloc(tapsSlab *s)
+{
+    void *item;
+
+    if (!s->freeList && (_taps_slab_grow(s) < 0)) {
+        return NULL;
+    }
+    item = s->freeList;
+    s->freeList = *(void **)item;
+    return item;
+}
+
+void
+tapsSlabFree(tapsSlab *s, void *item)
+{
+    *(void **)item = s->freeList;
+    s->freeList = item;
+}
+
+void
+tapsSlabDestroy(tapsSlab *s)
+{
+    void *chunk;
+
+    while (s->chunks) {
+        chunk = s->chunks;
+        s->chunks = *(void **)chunk;
+        free(chunk);
+    }
+    s->freeList = NULL;
+    s->nextChunk = 1;
+}
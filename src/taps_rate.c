@@ -0,0 +1,127 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/*
+ * Token buckets for send rate limits, and rate groups, which share one
+ * bucket among several connections. A bucket may go into debt: a send is
+ * allowed whenever the balance is not negative, and the whole send is then
+ * charged. That way the send path never has to split a message to fit.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "taps_internals.h"
+
+/* Burst allowance, as time at the full rate */
+#define TAPS_BUCKET_BURST_MS 20
+
+typedef struct {
+    tapsBucket  bucket;
+    uint32_t    refs;  /* Connections in the group */
+    int         freed; /* The app is done with it */
+} tapsRateGroup;
+
+void
+tapsBucketInit(tapsBucket *b, uint64_t bitsPerSec)
+{
+    b->rate = bitsPerSec / 8;
+    b->burst = b->rate * TAPS_BUCKET_BURST_MS / 1000;
+    if (b->burst == 0) {
+        b->burst = 1;
+    }
+    b->tokens = b->burst;
+    b->last = tapsNow();
+}
+
+uint64_t
+tapsBucketWait(tapsBucket *b, uint64_t now)
+{
+    uint64_t ms;
+
+    if (now > b->last) {
+        b->tokens += (now - b->last) * b->rate / 1000;
+        if (b->tokens > (int64_t)b->burst) {
+            b->tokens = b->burst;
+        }
+        b->last = now;
+    }
+    if (b->tokens >= 0) {
+        return 0;
+    }
+    ms = ((uint64_t)-b->tokens * 1000 + b->rate - 1) / b->rate;
+    return (ms > 0) ? ms : 1;
+}
+
+void
+tapsBucketDebit(tapsBucket *b, size_t bytes)
+{
+    b->tokens -= bytes;
+}
+
+TAPS_CTX *
+tapsRateGroupNew(uint64_t maxSendRate)
+{
+    tapsRateGroup *g;
+
+    TAPS_TRACE();
+    if (maxSendRate < 8) {
+        errno = EINVAL;
+        return NULL;
+    }
+    g = malloc(sizeof(tapsRateGroup));
+    if (!g) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(g, 0, sizeof(tapsRateGroup));
+    tapsBucketInit(&g->bucket, maxSendRate);
+    return g;
+}
+
+void
+tapsRateGroupFree(TAPS_CTX *group)
+{
+    tapsRateGroup *g = group;
+
+    TAPS_TRACE();
+    g->freed = TRUE;
+    if (g->refs == 0) {
+        free(g);
+    }
+}
+
+tapsBucket *
+tapsRateGroupJoin(TAPS_CTX *group)
+{
+    tapsRateGroup *g = group;
+
+    g->refs++;
+    return &g->bucket;
+}
+
+void
+tapsRateGroupLeave(TAPS_CTX *group)
+{
+    tapsRateGroup *g = group;
+
+    if ((--g->refs == 0) && g->freed) {
+        free(g);
+    }
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/*
+ * Hierarchical timer wheel. There is one per event_base, shared by every
+ * listener and connection on it, and it is driven by a single libevent timer
+ * that ticks only while some TAPS timer is armed. Arming and cancelling are
+ * O(1) list operations, so connections can re-arm timeouts on every
+ * operation without touching libevent's heap.
+ *
+ * Each level has TAPS_WHEEL_SLOTS slots; a slot on level n covers
+ * TAPS_WHEEL_SLOTS^n ticks. Timers are filed by absolute expiry tick, and
+ * move down a level each time the level below wraps around.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+#include "taps_internals.h"
+
+#define TAPS_WHEEL_BITS   6
+#define TAPS_WHEEL_SLOTS  (1 << TAPS_WHEEL_BITS)
+#define TAPS_WHEEL_MASK   (TAPS_WHEEL_SLOTS - 1)
+#define TAPS_WHEEL_LEVELS 4
+/* Longest delay the wheel can represent; later timers are refiled when they
+   come down to the bottom level. About 18 hours with 4ms ticks. */
+#define TAPS_WHEEL_SPAN   \
+        ((uint64_t)1 << (TAPS_WHEEL_BITS * TAPS_WHEEL_LEVELS))
+
+struct _taps_timer_wheel {
+    struct event_base        *base;
+    struct event             *tick;
+    uint64_t                  origin; /* ms; tick 0 */
+    uint64_t                  now;    /* Last tick processed */
+    uint32_t                  armed;
+    uint32_t                  refs;
+    /* Each slot is the sentinel of a circular list */
+    tapsTimer                 slot[TAPS_WHEEL_LEVELS][TAPS_WHEEL_SLOTS];
+    struct _taps_timer_wheel *next;
+};
+
+/* Wheels in use, one per event_base. A sharded listener gets wheels for all
+   its bases from one thread, and they may be put from others, so the list and
+   the refcounts are shared by all threads. */
+static pthread_mutex_t  wheelsLock = PTHREAD_MUTEX_INITIALIZER;
+static tapsTimerWheel  *wheels = NULL;
+
+uint64_t
+tapsNow(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+_taps_timer_link(tapsTimer *head, tapsTimer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void
+_taps_timer_unlink(tapsTimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+static void
+_taps_timer_file(tapsTimerWheel *w, tapsTimer *t)
+{
+    uint64_t delta = t->expires - w->now;
+    uint64_t when = t->expires;
+    int      level = 0;
+
+    if (delta >= TAPS_WHEEL_SPAN) {
+        when = w->now + TAPS_WHEEL_SPAN - 1;
+        delta = TAPS_WHEEL_SPAN - 1;
+    }
+    while (delta >= ((uint64_t)1 << (TAPS_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    _taps_timer_link(&w->slot[level]
+            [(when >> (TAPS_WHEEL_BITS * level)) & TAPS_WHEEL_MASK], t);
+}
+
+/* Advance one tick: refile timers from any level that the one below has
+   wrapped into, then fire everything in the current bottom slot. */
+static void
+_taps_wheel_advance(tapsTimerWheel *w)
+{
+    tapsTimer  due, *head, *t;
+    int        level;
+    uint64_t   idx, below;
+
+    w->now++;
+    for (level = 1; level < TAPS_WHEEL_LEVELS; level++) {
+        below = ((uint64_t)1 << (TAPS_WHEEL_BITS * level)) - 1;
+        if ((w->now & below) != 0) {
+            break;
+        }
+        idx = (w->now >> (TAPS_WHEEL_BITS * level)) & TAPS_WHEEL_MASK;
+        head = &w->slot[level][idx];
+        while (head->next != head) {
+            t = head->next;
+            _taps_timer_unlink(t);
+            _taps_timer_file(w, t);
+        }
+    }
+    /* Move the due timers to a local list, so callbacks can arm and cancel
+       freely while we work through it */
+    head = &w->slot[0][w->now & TAPS_WHEEL_MASK];
+    if (head->next == head) {
+        return;
+    }
+    due.next = head->next;
+    due.prev = head->prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head->next = head->prev = head;
+    while (due.next != &due) {
+        t = due.next;
+        _taps_timer_unlink(t);
+        if (t->expires > w->now) {
+            /* Refiled from the top level before it was really due */
+            _taps_timer_file(w, t);
+            continue;
+        }
+        t->wheel = NULL;
+        w->armed--;
+        (t->cb)(t->arg);
+    }
+}
+
+static void
+_taps_wheel_tick(evutil_socket_t fd, short event, void *arg)
+{
+    tapsTimerWheel *w = arg;
+    uint64_t        target = (tapsNow() - w->origin) / TAPS_TIMER_TICK_MS;
+
+    while ((w->now < target) && (w->armed > 0)) {
+        _taps_wheel_advance(w);
+    }
+    if (w->armed == 0) {
+        event_del(w->tick);
+    }
+}
+
+tapsTimerWheel *
+tapsTimerWheelGet(struct event_base *base)
+{
+    tapsTimerWheel *w;
+    int             i, j;
+
+    TAPS_TRACE();
+    pthread_mutex_lock(&wheelsLock);
+    for (w = wheels; w; w = w->next) {
+        if (w->base == base) {
+            w->refs++;
+            pthread_mutex_unlock(&wheelsLock);
+            return w;
+        }
+    }
+    w = malloc(sizeof(tapsTimerWheel));
+    if (!w) {
+        pthread_mutex_unlock(&wheelsLock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(w, 0, sizeof(tapsTimerWheel));
+    w->tick = event_new(base, -1, EV_PERSIST, _taps_wheel_tick, w);
+    if (!w->tick) {
+        pthread_mutex_unlock(&wheelsLock);
+        free(w);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < TAPS_WHEEL_LEVELS; i++) {
+        for (j = 0; j < TAPS_WHEEL_SLOTS; j++) {
+            w->slot[i][j].next = w->slot[i][j].prev = &w->slot[i][j];
+        }
+    }
+    w->base = base;
+    w->origin = tapsNow();
+    w->refs = 1;
+    w->next = wheels;
+    wheels = w;
+    pthread_mutex_unlock(&wheelsLock);
+    return w;
+}
+
+void
+tapsTimerWheelPut(tapsTimerWheel *w)
+{
+    tapsTimerWheel **prev;
+
+    TAPS_TRACE();
+    pthread_mutex_lock(&wheelsLock);
+    if (--w->refs > 0) {
+        pthread_mutex_unlock(&wheelsLock);
+        return;
+    }
+    for (prev = &wheels; *prev != w; prev = &(*prev)->next);
+    *prev = w->next;
+    pthread_mutex_unlock(&wheelsLock);
+    if (w->armed > 0) {
+        printf("Timer wheel freed with %u timers armed\n", w->armed);
+    }
+    event_free(w->tick);
+    free(w);
+}
+
+uint64_t
+tapsTimerWheelNow(tapsTimerWheel *w)
+{
+    return w->origin + w->now * TAPS_TIMER_TICK_MS;
+}
+
+void
+tapsTimerInit(tapsTimer *t, tapsTimerCb cb, void *arg)
+{
+    memset(t, 0, sizeof(tapsTimer));
+    t->cb = cb;
+    t->arg = arg;
+}
+
+int
+tapsTimerArm(tapsTimerWheel *w, tapsTimer *t, uint64_t ms)
+{
+    struct timeval interval = { 0, TAPS_TIMER_TICK_MS * 1000 };
+    uint64_t       ticks = (ms + TAPS_TIMER_TICK_MS - 1) / TAPS_TIMER_TICK_MS;
+
+    tapsTimerCancel(t);
+    if (w->armed == 0) {
+        /* The wheel may have been idle for a while; catch up first */
+        w->now = (tapsNow() - w->origin) / TAPS_TIMER_TICK_MS;
+        /* A common timeout keeps the tick out of libevent's heap */
+        if (event_add(w->tick, event_base_init_common_timeout(w->base,
+                &interval)) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    t->expires = w->now + ((ticks > 0) ? ticks : 1);
+    t->wheel = w;
+    _taps_timer_file(w, t);
+    w->armed++;
+    return 0;
+}
+
+void
+tapsTimerCancel(tapsTimer *t)
+{
+    if (!t->wheel) {
+        return;
+    }
+    _taps_timer_unlink(t);
+    t->wheel->armed--;
+    t->wheel = NULL;
+}
@@ -26,9 +26,25 @@
 int Listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
         ConnectionReceivedCb newConnCb, EstablishmentErrorCb establishmentError,
         ClosedCb closed, ConnectionErrorCb connectionError);
+void *ListenBatch(void *taps_ctx, struct event_base *base,
+        struct sockaddr *local, unsigned int budget,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError, ClosedCb closed,
+        ConnectionErrorCb connectionError);
+void *ListenShard(void *taps_ctx, struct event_base *base,
+        struct sockaddr *local, unsigned int budget,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError, ClosedCb closed,
+        ConnectionErrorCb connectionError);
 void Stop(void *proto_ctx, StoppedCb cb);
+unsigned int MaxSendWindow(void);
+void SetConnectionMemory(ConnAllocCb alloc, ConnReleaseCb release);
+void Abort(void *proto_ctx);
+int SetProperty(void *proto_ctx, char *name, void *value, size_t len);
 int Send(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
         SentCb sent, ExpiredCb expired, SendErrorCb sendError);
+int SendFile(void *proto_ctx, void *taps_ctx, int fd, off_t offset,
+        size_t len, SentCb sent, ExpiredCb expired, SendErrorCb sendError);
 void Receive(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
         ReceivedCb received, ReceivedPartialCb receivedPartial,
        	ReceiveErrorCb receiveError);
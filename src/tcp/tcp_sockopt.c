@@ -0,0 +1,189 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* tcp_sockopt.c */
+/* Connection properties that map onto TCP socket options. Linked into each
+   TCP module, whatever it uses for I/O. */
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "../taps.h"
+#include "tcp_sockopt.h"
+
+/* How each capacity profile maps onto the socket. DSCPs are the RFC 4594
+   classes for the matching service, and LE (RFC 8622) for scavengers;
+   priorities are the TC_PRIO_ values the kernel would give those TOS bits.
+   A scavenger also gets TCP-LP, if it is allowed (see
+   net.ipv4.tcp_allowed_congestion_control). */
+static const struct tcp_profile {
+    int         nodelay;
+    int         dscp;
+    int         priority;
+    const char *congestion; /* NULL for the system default */
+} tcpProfiles[] = {
+    [TAPS_DEFAULT]          = { 0, 0,    0, NULL },
+    [TAPS_SCAVENGER]        = { 0, 0x01, 1, "lp" },   /* LE */
+    [TAPS_INTERACTIVE_CAP]  = { 1, 0x20, 6, NULL },   /* CS4 */
+    [TAPS_NON_INTERACTIVE]  = { 1, 0x12, 4, NULL },   /* AF21 */
+    [TAPS_CONSTANT_RATE]    = { 0, 0x1a, 0, NULL },   /* AF31 */
+    [TAPS_CAPACITY_SEEKING] = { 0, 0x0a, 2, NULL },   /* AF11 */
+};
+
+/* Keep-alives every 'seconds' of silence, both before the first probe and
+   between probes; 0 turns them off. */
+static int
+_tcp_set_keepalive(int fd, unsigned int seconds)
+{
+    int on = (seconds > 0), probes = TAPS_TCP_KEEPALIVE_PROBES;
+    int interval = (seconds > 32767) ? 32767 : seconds; /* MAX_TCP_KEEPIDLE */
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0) {
+        return -1;
+    }
+    if (!on) {
+        return 0;
+    }
+    if ((setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &interval,
+            sizeof(interval)) < 0) ||
+            (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+            sizeof(interval)) < 0) ||
+            (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes,
+            sizeof(probes)) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+_tcp_set_profile(int fd, char *congestion, int profile)
+{
+    const struct tcp_profile *p;
+    struct sockaddr_storage   ss;
+    socklen_t                 sslen = sizeof(ss);
+    const char               *cc;
+    int                       tos;
+
+    if ((profile < 0) || ((size_t)profile >=
+            sizeof(tcpProfiles) / sizeof(tcpProfiles[0]))) {
+        errno = EINVAL;
+        return -1;
+    }
+    p = &tcpProfiles[profile];
+    tos = p->dscp << 2;
+    if (getsockname(fd, (struct sockaddr *)&ss, &sslen) < 0) {
+        return -1;
+    }
+    if ((setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &p->nodelay,
+            sizeof(p->nodelay)) < 0) ||
+            ((ss.ss_family == AF_INET6) ?
+            setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) :
+            setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos))) < 0) {
+        return -1;
+    }
+    /* After the TOS, which sets a priority of its own */
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &p->priority,
+            sizeof(p->priority)) < 0) {
+        return -1;
+    }
+    /* The congestion controller is only a preference: the module may not be
+       there, or unprivileged sockets may not be allowed it */
+    sslen = TAPS_TCP_CA_NAME_MAX;
+    if (p->congestion && (congestion[0] == '\0') &&
+            (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion,
+            &sslen) < 0)) {
+        congestion[0] = '\0';
+    }
+    cc = (p->congestion) ? p->congestion : congestion;
+    if ((cc[0] != '\0') && (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+            cc, strlen(cc)) < 0)) {
+        printf("TCP congestion control %s unavailable: %s\n", cc,
+                strerror(errno));
+    }
+    return 0;
+}
+
+int
+tcpSetSocketProperty(int fd, char *congestion, char *name, void *value,
+        size_t len)
+{
+    size_t              bytes;
+    uint64_t            bits;
+    unsigned int        pacing;
+    int                 lowat;
+
+    if (strcmp(name, "sendBufferLow") == 0) {
+#ifdef TCP_NOTSENT_LOWAT
+        /* A Send that doesn't fit in the socket finishes when the socket is
+           writable again. With TCP_NOTSENT_LOWAT, that waits until the
+           unsent data in the kernel is below the app's low watermark, so the
+           app refills just in time instead of piling data up in the socket
+           buffer. */
+        if (len != sizeof(size_t)) {
+            errno = EINVAL;
+            return -1;
+        }
+        bytes = *(size_t *)value;
+        /* The socket is writable below lowat, so 0 would never be */
+        lowat = (bytes == 0) ? 1 : (bytes > INT_MAX) ? INT_MAX : bytes;
+        return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                sizeof(lowat));
+#endif
+    } else if (strcmp(name, "maxSendRate") == 0) {
+#ifdef SO_MAX_PACING_RATE
+        if (len != sizeof(uint64_t)) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* The kernel takes bytes per second, and ~0 for no limit. It paces
+           by itself, or through the fq qdisc if that is installed. */
+        bits = *(uint64_t *)value;
+        pacing = (bits == 0) ? ~0U : (bits / 8 >= ~0U) ? ~0U - 1 : bits / 8;
+        return setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing,
+                sizeof(pacing));
+#endif
+    } else if (strcmp(name, "keepAliveTimeout") == 0) {
+        if (len != sizeof(unsigned int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return _tcp_set_keepalive(fd, *(unsigned int *)value);
+    } else if (strcmp(name, "userTimeout") == 0) {
+#ifdef TCP_USER_TIMEOUT
+        if (len != sizeof(unsigned int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, value,
+                sizeof(unsigned int));
+#endif
+    } else if (strcmp(name, "capacityProfile") == 0) {
+        if (len != sizeof(int)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return _tcp_set_profile(fd, congestion, *(int *)value);
+    }
+    errno = ENOPROTOOPT;
+    return -1;
+}
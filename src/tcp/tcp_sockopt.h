@@ -0,0 +1,40 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+#ifndef _TCP_SOCKOPT_H
+#define _TCP_SOCKOPT_H
+
+#include <stddef.h>
+
+/* Connection properties that are only socket options, shared by the TCP
+   modules */
+
+/* Unanswered keep-alives before the connection is dropped */
+#define TAPS_TCP_KEEPALIVE_PROBES 3
+/* Longest congestion control name, as TCP_CA_NAME_MAX in the kernel */
+#define TAPS_TCP_CA_NAME_MAX 16
+
+/* Apply the SetProperty name/value to a connected TCP socket. congestion is
+   TAPS_TCP_CA_NAME_MAX bytes the connection keeps, zeroed to start with, to
+   remember the congestion controller to go back to after a scavenger
+   profile. Returns as SetProperty does. */
+int tcpSetSocketProperty(int fd, char *congestion, char *name, void *value,
+        size_t len);
+
+#endif /* _TCP_SOCKOPT_H */
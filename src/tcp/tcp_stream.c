@@ -0,0 +1,848 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* tcp_stream.c */
+/* What every module with connected, event-driven sockets does the same way:
+   accepting, the send ring, zero-copy notifications, writing and reading.
+   The TCP and UNIX modules link it in, and say what differs through
+   tcpStreamModule. */
+#define _GNU_SOURCE /* accept4() */
+#include <errno.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../taps.h"
+#include "../proto/proto_memory.h"
+#include "tcp_stream.h"
+
+#define TAPS_TCP_DEFAULT_MAX_LISTEN 100
+/* Connections accepted per wakeup, if TAPS doesn't say */
+#define TAPS_TCP_DEFAULT_ACCEPT_BUDGET 64
+/* Reads in a row before giving other connections a turn */
+#define TAPS_TCP_RECEIVE_BUDGET 16
+/* Send ring entries to start with; TAPS uses one Send at a time unless the
+   app opens the window */
+#define TAPS_TCP_INITIAL_SENDS 1
+
+/* Take the events out of the loop, close the socket and give back the
+   memory */
+static void
+_tcp_conn_free(struct conn_ctx *cctx)
+{
+    event_del(cctx->closeEvent);
+    event_del(cctx->sendEvent);
+    event_del(cctx->receiveEvent);
+    close(cctx->fd);
+    free(cctx->send);
+    free(cctx->rest);
+    protoConnFree(cctx);
+}
+
+static void
+_tcp_closed(evutil_socket_t sock, short event, void *arg)
+{
+    struct conn_ctx   *cctx = arg;
+    ClosedCb           closed = cctx->closed;
+    ConnectionErrorCb  connectionError = cctx->connectionError;
+    void              *taps_ctx = cctx->taps_ctx;
+    int                error = cctx->error;
+
+    TAPS_TRACE();
+    _tcp_conn_free(cctx);
+    if (error) {
+        (connectionError)(taps_ctx, strerror(error));
+    } else {
+        (closed)(taps_ctx);
+    }
+}
+
+/* Reset the connection, rather than close it gracefully */
+void
+Abort(void *proto_ctx)
+{
+    struct conn_ctx *cctx = proto_ctx;
+    struct linger    linger = { 1, 0 };
+
+    TAPS_TRACE();
+    setsockopt(cctx->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    _tcp_conn_free(cctx);
+}
+
+#define SEND_AT(c, i) (&(c)->send[((c)->sendFirst + (i)) % (c)->sendSize])
+
+/* Double the send ring, up to TAPS_TCP_MAX_SEND_WINDOW */
+static int
+_tcp_send_grow(struct conn_ctx *c)
+{
+    struct tcp_send *send;
+    int              size, i;
+
+    size = (c->sendSize) ? c->sendSize * 2 : TAPS_TCP_INITIAL_SENDS;
+    if (size > TAPS_TCP_MAX_SEND_WINDOW) {
+        return -1;
+    }
+    send = malloc(sizeof(struct tcp_send) * size);
+    if (!send) {
+        return -1;
+    }
+    for (i = 0; i < c->sendCount; i++) {
+        send[i] = *SEND_AT(c, i);
+    }
+    free(c->send);
+    c->send = send;
+    c->sendSize = size;
+    c->sendFirst = 0;
+    return 0;
+}
+
+/* Wait for the socket to become readable or writable. Edge-triggered events
+   are always registered, so that costs nothing. */
+static int
+_tcp_wait(struct conn_ctx *c, struct event *ev)
+{
+    if (c->edge || event_pending(ev, EV_READ | EV_WRITE, NULL)) {
+        return 0;
+    }
+    return event_add(ev, NULL); /* TAPS does timeouts */
+}
+
+/* Write the rest of s, without copying it into the socket buffer if it is
+   big enough and the connection has asked for that. A peer that has gone
+   away is an error to report, not a SIGPIPE. */
+static ssize_t
+_tcp_writev(struct conn_ctx *c, struct tcp_send *s)
+{
+    struct msghdr msg;
+#ifdef MSG_ZEROCOPY
+    ssize_t       bytes;
+#endif
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &s->iov[c->sendIdx];
+    msg.msg_iovlen = s->iovcnt - c->sendIdx;
+#ifdef MSG_ZEROCOPY
+    if (c->zcThreshold && (s->len >= c->zcThreshold)) {
+        bytes = sendmsg(c->fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (bytes >= 0) {
+            s->zc = 1;
+            s->zcLast = c->zcNext++;
+            return bytes;
+        }
+        /* ENOBUFS means we are over optmem with pinned pages; copy this
+           one instead */
+        if (errno != ENOBUFS) {
+            return -1;
+        }
+    }
+#endif
+    return sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+}
+
+/* Collect zero-copy notifications from the error queue. TCP releases pages
+   in sequence order, so each range carries on from the last. */
+static void
+_tcp_zerocopy_reap(struct conn_ctx *c)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    struct sock_extended_err *serr;
+    struct msghdr             msg;
+    struct cmsghdr           *cm;
+    struct pollfd             pfd;
+    char                      control[128];
+
+    while (c->zcDone != c->zcNext) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(((cm->cmsg_level == SOL_IP) &&
+                    (cm->cmsg_type == IP_RECVERR)) ||
+                    ((cm->cmsg_level == SOL_IPV6) &&
+                    (cm->cmsg_type == IPV6_RECVERR)))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if ((serr->ee_errno != 0) ||
+                    (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+                continue;
+            }
+            /* IDs are 32 bits and wrap */
+            if ((int32_t)(serr->ee_data + 1 - c->zcDone) > 0) {
+                c->zcDone = serr->ee_data + 1;
+            }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* The kernel copied after all (over loopback, say), so
+                   pinning pages only costs us. Stop asking. */
+                c->zcThreshold = 0;
+            }
+        }
+    }
+    /* libevent reports EPOLLERR as EV_READ|EV_WRITE and drops EV_CLOSED, so
+       if the peer shut down while notifications were queued, that edge is
+       gone. Look for ourselves. */
+    pfd.fd = c->fd;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    if ((poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLRDHUP | POLLHUP))) {
+        event_active(c->closeEvent, EV_CLOSED, 0);
+    }
+#endif
+}
+
+/* How many Sends at the front are written, and released by the kernel if
+   they went out zero-copy; these can be reported. */
+static int
+_tcp_reportable(struct conn_ctx *c)
+{
+    struct tcp_send *s;
+    int              i;
+
+    for (i = 0; i < c->sendWritten; i++) {
+        s = SEND_AT(c, i);
+        if (s->zc && ((int32_t)(s->zcLast - c->zcDone) >= 0)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Write the rest of a Send from a file; sendOffset counts bytes from its
+   offset. Clears writable once the socket is full. */
+static int
+_tcp_sendfile(struct conn_ctx *c, struct tcp_send *s)
+{
+    off_t   offset = s->offset + c->sendOffset;
+    ssize_t bytes;
+
+    if (c->sendOffset == s->len) {
+        c->sendWritten++;
+        c->sendOffset = 0;
+        return 0;
+    }
+    bytes = sendfile(c->fd, s->fd, &offset, s->len - c->sendOffset);
+    if (bytes < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return -1;
+        }
+        c->writable = 0;
+        return 0;
+    }
+    if (bytes == 0) {
+        /* The file is shorter than the message */
+        errno = EIO;
+        return -1;
+    }
+    c->sendOffset += bytes;
+    if (c->sendOffset < s->len) {
+        /* Short write: the socket buffer is full */
+        c->writable = 0;
+    }
+    return 0;
+}
+
+/* Write as much of the unwritten Sends as the socket will take, in order.
+   Returns -1 on a socket error; a full socket buffer is not an error. */
+static int
+_tcp_write(struct conn_ctx *c)
+{
+    struct tcp_send *s;
+    struct iovec     saved;
+    ssize_t          bytes;
+    size_t           left;
+
+    while ((c->sendWritten < c->sendCount) && c->writable) {
+        s = SEND_AT(c, c->sendWritten);
+        if (s->fd >= 0) {
+            if (_tcp_sendfile(c, s) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        while ((c->sendIdx < s->iovcnt) &&
+                (s->iov[c->sendIdx].iov_len == c->sendOffset)) {
+            c->sendIdx++;
+            c->sendOffset = 0;
+        }
+        if (c->sendIdx == s->iovcnt) {
+            c->sendWritten++;
+            c->sendIdx = 0;
+            continue;
+        }
+        /* Trim the iovec we stopped in, just for this call, rather than
+           copy the rest of the array */
+        saved = s->iov[c->sendIdx];
+        s->iov[c->sendIdx].iov_base = (char *)saved.iov_base + c->sendOffset;
+        s->iov[c->sendIdx].iov_len = saved.iov_len - c->sendOffset;
+        bytes = _tcp_writev(c, s);
+        s->iov[c->sendIdx] = saved;
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                return -1;
+            }
+            c->writable = 0;
+            break;
+        }
+        while ((bytes > 0) && (c->sendIdx < s->iovcnt)) {
+            left = s->iov[c->sendIdx].iov_len - c->sendOffset;
+            if ((size_t)bytes < left) {
+                c->sendOffset += bytes;
+                break;
+            }
+            bytes -= left;
+            c->sendIdx++;
+            c->sendOffset = 0;
+        }
+        if (c->sendIdx < s->iovcnt) {
+            /* Short write: the socket buffer is full */
+            c->writable = 0;
+            break;
+        }
+    }
+    if ((c->sendWritten < c->sendCount) && (_tcp_wait(c, c->sendEvent) < 0)) {
+        printf("TCP could not add send event\n");
+    }
+    return 0;
+}
+
+/* The socket is writable: carry on with any partly written Send, then report
+   the ones that are all out. */
+static void
+_tcp_sent(evutil_socket_t sock, short event, void *arg)
+{
+    struct conn_ctx *c = arg;
+    struct tcp_send *s;
+    int              count, failed = 0;
+    char            *reason = NULL;
+
+    TAPS_TRACE();
+    c->writable = 1;
+    /* Notifications raise EPOLLERR, which libevent reports as writable */
+    if (c->zcDone != c->zcNext) {
+        _tcp_zerocopy_reap(c);
+    }
+    if (_tcp_write(c) < 0) {
+        reason = strerror(errno);
+        printf("TCP writev failed: %s\n", reason);
+    }
+    /* Completions may call Send again; only report the ones we have now */
+    count = _tcp_reportable(c);
+    if (reason) {
+        /* Nothing more will be written. Fail everything after what can be
+           reported, in order: that includes zero-copy Sends still waiting
+           for their notifications, which would otherwise be stuck at the
+           front of the ring. */
+        failed = c->sendCount - count;
+        c->sendWritten = count;
+        c->sendIdx = 0;
+        c->sendOffset = 0;
+        c->zcDone = c->zcNext;
+    }
+    while (count-- > 0) {
+        s = SEND_AT(c, 0);
+        c->sendFirst = (c->sendFirst + 1) % c->sendSize;
+        c->sendCount--;
+        c->sendWritten--;
+        (c->sent)(s->taps_ctx);
+    }
+    while (failed-- > 0) {
+        s = SEND_AT(c, 0);
+        c->sendFirst = (c->sendFirst + 1) % c->sendSize;
+        c->sendCount--;
+        (c->sendError)(s->taps_ctx, reason);
+    }
+    /* Sends made from the callbacks may be written and waiting to be
+       reported, or queued behind the ones that failed; there won't be
+       another edge for those */
+    if ((_tcp_reportable(c) > 0) || (reason && (c->sendCount > 0))) {
+        event_active(c->sendEvent, EV_WRITE, 0);
+    }
+}
+
+size_t
+tcpStreamRestCopy(struct conn_ctx *c)
+{
+    size_t copied = 0, n;
+    int    i;
+
+    for (i = 0; (i < c->iovcnt) && (c->restOffset < c->restLen); i++) {
+        n = c->receive_buffer[i].iov_len;
+        if (n > c->restLen - c->restOffset) {
+            n = c->restLen - c->restOffset;
+        }
+        memcpy(c->receive_buffer[i].iov_base, c->rest + c->restOffset, n);
+        c->restOffset += n;
+        copied += n;
+    }
+    if (c->restOffset == c->restLen) {
+        free(c->rest);
+        c->rest = NULL;
+    }
+    return copied;
+}
+
+/* A Receive posted without a buffer gets one from TAPS just before the
+   read; see protoReceiveBuffer() */
+static int
+_tcp_receive_buffer(struct conn_ctx *c)
+{
+    return protoReceiveBuffer(&c->receive_buffer, &c->iovcnt,
+            &c->receivePosted, c->receive_ctx, c->receiveError);
+}
+
+/* Read for the posted Receive, and keep going while the callback posts
+   another and there is data for it. Receives posted from the callback only
+   mark themselves, so this loops rather than recursing. */
+static void
+_tcp_receive(struct conn_ctx *c)
+{
+    ssize_t bytes;
+    int     budget = TAPS_TCP_RECEIVE_BUDGET, end, lent;
+
+    c->receiveLoop = 1;
+    while (c->receivePosted) {
+        if (budget-- == 0) {
+            /* Come back on the next loop iteration; with edge triggering,
+               the data already here won't signal again */
+            event_active(c->receiveEvent, EV_READ, 0);
+            break;
+        }
+        if (c->rest) {
+            if (_tcp_receive_buffer(c) < 0) {
+                continue;
+            }
+            bytes = tcpStreamRestCopy(c);
+            c->receivePosted = 0;
+            if (c->rest) {
+                (c->receivedPartial)(c->receive_ctx, c->receive_buffer,
+                        bytes);
+            } else {
+                (c->received)(c->receive_ctx, c->receive_buffer, bytes);
+            }
+            continue;
+        }
+        if (!c->readable) {
+            if (_tcp_wait(c, c->receiveEvent) < 0) {
+                printf("TCP could not add receive event\n");
+            }
+            break;
+        }
+        lent = _tcp_receive_buffer(c);
+        if (lent < 0) {
+            continue;
+        }
+        if (tcpStreamModule.read) {
+            bytes = (tcpStreamModule.read)(c, &end);
+        } else {
+            /* A stream has no ends of messages; TAPS finds them */
+            bytes = readv(c->fd, c->receive_buffer, c->iovcnt);
+            end = 0;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                /* Nothing yet; now it's worth waiting for, without holding
+                   on to a buffer */
+                if (lent && protoReceiveRelease(c->receive_ctx)) {
+                    c->receive_buffer = NULL;
+                }
+                c->readable = 0;
+                continue;
+            }
+            printf("readv failed, %s\n", strerror(errno));
+            /* A reset raises EPOLLERR, which libevent reports without
+               EV_CLOSED; end the connection from the loop ourselves */
+            c->error = errno;
+            c->receivePosted = 0;
+            event_active(c->closeEvent, EV_CLOSED, 0);
+            break;
+        }
+        if ((bytes == 0) && !end) {
+            /* The closed event takes it from here. With records, an empty
+               one ends a message, and is received. */
+            break;
+        }
+        c->receivePosted = 0;
+        if (end) {
+            (c->received)(c->receive_ctx, c->receive_buffer, bytes);
+        } else {
+            (c->receivedPartial)(c->receive_ctx, c->receive_buffer, bytes);
+        }
+    }
+    c->receiveLoop = 0;
+}
+
+static void
+_tcp_received(evutil_socket_t sock, short event, void *arg)
+{
+    struct conn_ctx *c = arg;
+
+    TAPS_TRACE();
+    c->readable = 1;
+    /* With edge triggering, data can arrive before anyone asks for it; it
+       waits in the socket buffer */
+    if (c->receivePosted && !c->receiveLoop) {
+        _tcp_receive(c);
+    }
+}
+
+static struct conn_ctx *
+_tcp_conn_new(struct listener_ctx *lctx, int fd)
+{
+    /* Rounded up, so each event in eventSpace is aligned */
+    size_t           evSize = (event_get_struct_event_size() +
+            _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    size_t           size = sizeof(struct conn_ctx) + 3 * evSize;
+    struct conn_ctx *cctx = protoConnAlloc(size);
+    short            flags;
+
+    if (!cctx) {
+        close(fd);
+        return NULL;
+    }
+    memset(cctx, 0, size);
+    cctx->closeEvent = (struct event *)cctx->eventSpace;
+    cctx->sendEvent = (struct event *)((char *)cctx->eventSpace + evSize);
+    cctx->receiveEvent = (struct event *)((char *)cctx->eventSpace +
+            2 * evSize);
+    cctx->fd = fd;
+    cctx->base = lctx->base;
+    /* Register once, edge-triggered, where the backend can (epoll), and save
+       an epoll_ctl per Send and Receive. libevent won't mix edge and level
+       triggering on one fd, so the closed event follows suit. */
+    cctx->edge = (event_base_get_features(cctx->base) & EV_FEATURE_ET) != 0;
+    flags = (cctx->edge) ? EV_ET : 0;
+    cctx->readable = cctx->writable = 1;
+    if ((event_assign(cctx->closeEvent, cctx->base, cctx->fd,
+            EV_CLOSED | flags, &_tcp_closed, cctx) < 0) ||
+            (event_assign(cctx->sendEvent, cctx->base, cctx->fd,
+            EV_WRITE | flags | ((cctx->edge) ? EV_PERSIST : 0), &_tcp_sent,
+            cctx) < 0) ||
+            (event_assign(cctx->receiveEvent, cctx->base, cctx->fd,
+            EV_READ | flags | ((cctx->edge) ? EV_PERSIST : 0), &_tcp_received,
+            cctx) < 0)) {
+        printf("TCP could not set up events\n");
+        close(fd);
+        protoConnFree(cctx);
+        return NULL;
+    }
+    if (cctx->edge && ((event_add(cctx->sendEvent, NULL) < 0) ||
+            (event_add(cctx->receiveEvent, NULL) < 0))) {
+        printf("TCP could not add events\n");
+        _tcp_conn_free(cctx);
+        return NULL;
+    }
+    if (event_add(cctx->closeEvent, NULL) < 0) {
+        printf("TCP could not add closed event\n");
+    }
+    cctx->closed = lctx->closed;
+    cctx->connectionError = lctx->connectionError;
+    return cctx;
+}
+
+/* Drain the accept queue, up to the budget, so a storm of connections
+   doesn't take one loop iteration each. accept4() makes the socket
+   non-blocking without another syscall. */
+static void
+_tcp_connection_received(evutil_socket_t listener, short event, void *arg)
+{
+    struct listener_ctx     *lctx = arg;
+    struct sockaddr_storage  ss;
+    socklen_t                slen;
+    struct conn_ctx         *cctx;
+    int                      fd, count = 0, i;
+
+    TAPS_TRACE();
+    while (count < lctx->budget) {
+        slen = sizeof(ss);
+        fd = accept4(listener, (struct sockaddr *)&ss, &slen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                /* EMFILE and the like; try again on the next wakeup */
+                printf("TCP accept failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        cctx = _tcp_conn_new(lctx, fd);
+        if (!cctx) {
+            continue;
+        }
+        if (!lctx->connectionsReceived) {
+            cctx->taps_ctx = (lctx->connectionReceived)(lctx->taps_ctx,
+                    cctx);
+            if (!cctx->taps_ctx) {
+                _tcp_conn_free(cctx);
+            }
+            continue;
+        }
+        lctx->pending[count++] = cctx;
+    }
+    if (count == 0) {
+        return;
+    }
+    (lctx->connectionsReceived)(lctx->taps_ctx, lctx->pending,
+            lctx->pendingTaps, count);
+    for (i = 0; i < count; i++) {
+        cctx = lctx->pending[i];
+        cctx->taps_ctx = lctx->pendingTaps[i];
+        if (!cctx->taps_ctx) {
+            _tcp_conn_free(cctx);
+        }
+    }
+}
+
+void *
+tcpStreamListen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, int reusePort,
+        ConnectionReceivedCb connectionReceived,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    struct listener_ctx *listener;
+    size_t               addr_size = (local->sa_family == AF_INET) ?
+            sizeof(struct sockaddr_in) : (local->sa_family == AF_INET6) ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_un);
+
+    TAPS_TRACE();
+    if (addr_size > sizeof(listener->local)) {
+        return NULL;
+    }
+    listener = malloc(sizeof(struct listener_ctx));
+    if (!listener) return NULL;
+    memset(listener, 0, sizeof(struct listener_ctx));
+    listener->base = base;
+    listener->event = NULL;
+    listener->budget = (budget > 0) ? budget : 1;
+    if (connectionsReceived) {
+        listener->pending = calloc(listener->budget, sizeof(void *));
+        listener->pendingTaps = calloc(listener->budget, sizeof(void *));
+        if (!listener->pending || !listener->pendingTaps) {
+            listener->fd = -1;
+            goto fail;
+        }
+    }
+    listener->fd = socket(local->sa_family, tcpStreamModule.sockType, 0);
+    if (listener->fd < 0) goto fail;
+    listener->connectionReceived = connectionReceived;
+    listener->connectionsReceived = connectionsReceived;
+    listener->establishmentError = establishmentError;
+    listener->closed = closed;
+    listener->connectionError = connectionError;
+    listener->taps_ctx = taps_ctx;
+    evutil_make_socket_nonblocking(listener->fd);
+
+    listener->reusePort = reusePort;
+    listener->localLen = addr_size;
+    memcpy(&listener->local, local, addr_size);
+    if ((tcpStreamModule.listen)(listener) < 0) {
+        goto fail;
+    }
+
+    if (bind(listener->fd, local, addr_size) < 0) {
+        printf("TCP bind failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (listen(listener->fd, TAPS_TCP_DEFAULT_MAX_LISTEN) < 0) {
+        printf("TCP listen failed\n");
+        goto fail;
+    }
+    listener->event = event_new(listener->base, listener->fd,
+            EV_READ | EV_PERSIST, _tcp_connection_received, (void *)listener);
+    event_add(listener->event, NULL);
+
+    return listener;
+fail:
+    /* listener must exist to get here */
+    if (listener->fd > -1) {
+        close(listener->fd);
+    }
+    if (listener->event) {
+        event_free(listener->event);
+    }
+    free(listener->pending);
+    free(listener->pendingTaps);
+    free(listener);
+    return NULL;
+}
+
+void *
+Listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        ConnectionReceivedCb connectionReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return tcpStreamListen(taps_ctx, base, local,
+            TAPS_TCP_DEFAULT_ACCEPT_BUDGET,
+            0, connectionReceived, NULL, establishmentError, closed,
+            connectionError);
+}
+
+void *
+ListenBatch(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return tcpStreamListen(taps_ctx, base, local, budget, 0, NULL,
+            connectionsReceived, establishmentError, closed, connectionError);
+}
+
+int
+Stop(void *proto_ctx, StoppedCb cb)
+{
+    struct listener_ctx *ctx = proto_ctx;
+    void  *taps_ctx = ctx->taps_ctx;
+
+    TAPS_TRACE();
+    event_del(ctx->event);
+    event_free(ctx->event);
+    close(ctx->fd);
+    if (tcpStreamModule.stop) {
+        (tcpStreamModule.stop)(ctx);
+    }
+    free(ctx->pending);
+    free(ctx->pendingTaps);
+    free(proto_ctx);
+    /* Thread should be dead */
+    (*cb)(taps_ctx);
+}
+
+unsigned int
+MaxSendWindow(void)
+{
+    return TAPS_TCP_MAX_SEND_WINDOW;
+}
+
+int
+tcpStreamSend(struct conn_ctx *c, void *taps_ctx, struct iovec *message,
+        int iovcnt, int fd, off_t offset, size_t len, SentCb sent,
+        ExpiredCb expired, SendErrorCb sendError)
+{
+    struct tcp_send    *s;
+
+    if (!c->sent) {
+        c->sent = sent;
+        c->expired = expired;
+        c->sendError = sendError;
+    }
+    if ((c->sendCount == c->sendSize) && (_tcp_send_grow(c) < 0)) {
+        printf("TCP send window full\n");
+        return -1;
+    }
+    s = SEND_AT(c, c->sendCount);
+    s->taps_ctx = taps_ctx;
+    s->iov = message;
+    s->iovcnt = iovcnt;
+    s->fd = fd;
+    s->offset = offset;
+    s->len = len;
+    s->zc = 0;
+    c->sendCount++;
+    /* Behind a short write, this just waits its turn */
+    if ((c->sendCount - c->sendWritten == 1) && (_tcp_write(c) < 0)) {
+        c->sendCount--;
+        c->sendIdx = 0;
+        c->sendOffset = 0;
+        return -1;
+    }
+    /* All written, with nothing ahead of it to report first: done, without
+       waking up for EV_WRITE. Not if the kernel still has its pages. */
+    if ((c->sendCount == 1) && (_tcp_reportable(c) == 1)) {
+        c->sendFirst = (c->sendFirst + 1) % c->sendSize;
+        c->sendCount = c->sendWritten = 0;
+        return 1;
+    }
+    /* Written, but behind others still to be reported. Otherwise
+       _tcp_write is already waiting for the socket, or this is waiting for
+       a zero-copy notification, which comes as EPOLLERR. */
+    if ((c->sendWritten == c->sendCount) && (_tcp_reportable(c) > 0)) {
+        event_active(c->sendEvent, EV_WRITE, 0);
+    }
+    return 0;
+}
+
+int
+Send(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError)
+{
+    size_t len = 0;
+    int    i;
+
+    TAPS_TRACE();
+    for (i = 0; i < iovcnt; i++) {
+        len += message[i].iov_len;
+    }
+    return tcpStreamSend(proto_ctx, taps_ctx, message, iovcnt, -1, 0, len,
+            sent, expired, sendError);
+}
+
+int
+Receive(void *proto_ctx, void *taps_ctx, struct iovec *iovec, int iovcnt,
+        ReceivedCb received, ReceivedPartialCb receivedPartial,
+        ReceiveErrorCb receiveError)
+{
+    struct conn_ctx    *c = proto_ctx;
+
+    TAPS_TRACE();
+    if (!c->received) {
+        c->received = received;
+        c->receivedPartial = receivedPartial;
+        c->receiveError = receiveError;
+    }
+    if (c->receivePosted) {
+        printf("Two TCP recv at once\n");
+        return -1;
+    }
+    c->receive_ctx = taps_ctx;
+    c->receive_buffer = iovec;
+    c->iovcnt = iovcnt;
+    c->receivePosted = 1;
+    /* Pipelined data is often already here, so try before arming EV_READ.
+       TAPS does timeouts. */
+    if (!c->receiveLoop) {
+        _tcp_receive(c);
+    }
+    return 0;
+}
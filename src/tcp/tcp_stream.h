@@ -0,0 +1,170 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+#ifndef _TCP_STREAM_H
+#define _TCP_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../taps_protocol.h"
+#include "tcp_sockopt.h"
+
+/* The plumbing of a module with connected, event-driven sockets: accepting,
+   the send ring, writing and reading. Linked into the TCP module and the
+   UNIX ones, which export the entry points it doesn't (see
+   tcp_stream_module). It exports Listen, ListenBatch, Stop, Abort, Send,
+   Receive and MaxSendWindow; proto/proto_memory.c, linked in with it,
+   exports SetConnectionMemory and SetReceiveBuffers. */
+
+/* Sends accepted per connection before the first one completes */
+#define TAPS_TCP_MAX_SEND_WINDOW 64
+
+/* A Send, and how much of it is in the socket */
+struct tcp_send {
+    void               *taps_ctx;
+    struct iovec       *iov;    /* TAPS owns this until the Send completes */
+    int                 iovcnt;
+    int                 fd;     /* Or, from a file, if not -1 */
+    off_t               offset;
+    size_t              len;
+    int                 zc;     /* Some of it went out with MSG_ZEROCOPY */
+    uint32_t            zcLast; /* ...and this was the last notification ID */
+};
+
+/* Connection context. The fields the data path touches come first; the
+   events live at the end, in the same allocation. */
+struct conn_ctx {
+    int                 fd;
+    /* With edge-triggered events, they stay registered for the life of the
+       connection, and these track what the last edge told us. Otherwise the
+       events are one-shot, added when there is something to wait for. */
+    int                 edge;
+    int                 readable, writable;
+    /* Sends not yet reported, oldest first, in a ring of sendSize that is
+       allocated on the first Send and grows with the window. The first
+       sendWritten are all in the socket; the next is written up to
+       sendIdx/sendOffset. */
+    struct tcp_send    *send;
+    int                 sendSize;
+    int                 sendFirst, sendCount, sendWritten;
+    int                 sendIdx;
+    size_t              sendOffset;
+    int                 receivePosted; /* receive_ctx is waiting for data */
+    int                 receiveLoop;   /* _tcp_receive is on the stack */
+    void               *receive_ctx;
+    struct iovec       *receive_buffer;
+    int                 iovcnt;
+    /* Opaque pointers for TAPS */
+    void               *taps_ctx;
+    SentCb              sent;
+    ExpiredCb           expired;
+    SendErrorCb         sendError;
+    ReceivedCb          received;
+    ReceivedPartialCb   receivedPartial;
+    ReceiveErrorCb      receiveError;
+    /* Data read past the end of the Receive, from restOffset on, which the
+       next Receives take before reading again; see tcpStreamRestCopy() */
+    char               *rest;
+    size_t              restLen, restOffset;
+    struct event       *closeEvent;
+    struct event       *sendEvent;
+    struct event       *receiveEvent;
+    /* Rarely used from here on */
+    struct event_base  *base;
+    ClosedCb            closed;
+    ConnectionErrorCb   connectionError;
+    int                 error; /* A read failed; reported by _tcp_closed */
+    /* MSG_ZEROCOPY for Sends of at least zcThreshold bytes, if not 0. Each
+       zero-copy call gets the next notification ID, from zcNext; the kernel
+       has released the pages for every ID below zcDone. */
+    size_t              zcThreshold;
+    uint32_t            zcNext, zcDone;
+    int                 zcEnabled;  /* SO_ZEROCOPY is set */
+    /* The congestion controller to go back to after TAPS_SCAVENGER, or ""
+       if it hasn't been changed */
+    char                congestion[TAPS_TCP_CA_NAME_MAX];
+    /* Storage for the three events. Their size depends on the libevent
+       build, so it is only known at run time. */
+    max_align_t         eventSpace[];
+};
+
+struct listener_ctx {
+    struct event_base    *base;
+    struct event         *event;
+    int                   fd;
+    ConnectionReceivedCb  connectionReceived;
+    ConnectionsReceivedCb connectionsReceived; /* NULL unless ListenBatch */
+    EstablishmentErrorCb  establishmentError;
+    ClosedCb              closed;
+    ConnectionErrorCb     connectionError;
+    void                 *taps_ctx;
+    int                   budget;
+    /* For ListenBatch, the batch being built: budget entries each */
+    void                **pending;
+    void                **pendingTaps;
+    int                   reusePort; /* For ListenShard */
+    socklen_t             localLen;
+    struct sockaddr_storage local;
+};
+
+/* What a module does differently, which it defines as tcpStreamModule */
+struct tcp_stream_module {
+    int      sockType; /* SOCK_STREAM or SOCK_SEQPACKET */
+    /* Read for the posted Receive, into c->receive_buffer, and set *end if
+       that ends a message; returns as readv() does. NULL for a stream,
+       which is just readv(). */
+    ssize_t (*read)(struct conn_ctx *c, int *end);
+    /* Set up the listening socket, between socket() and bind(). Returns 0,
+       or -1 to fail the Listen. */
+    int     (*listen)(struct listener_ctx *l);
+    /* Clean up after the listening socket is closed, or NULL */
+    void    (*stop)(struct listener_ctx *l);
+};
+
+/* Hidden, so that each module binds to its own copies: TAPS loads several
+   modules into one process, and one linked into the program, as the tests
+   link libtaps_tcp.so, would otherwise stand in for the others' */
+#pragma GCC visibility push(hidden)
+
+extern const struct tcp_stream_module tcpStreamModule;
+
+/* Listen, with reusePort for ListenShard */
+void *tcpStreamListen(void *taps_ctx, struct event_base *base,
+        struct sockaddr *local, unsigned int budget, int reusePort,
+        ConnectionReceivedCb connectionReceived,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError);
+
+/* Queue a Send, from memory or, if fd is not -1, len bytes of a file from
+   offset, and write it if nothing is ahead of it. Returns as Send does. */
+int tcpStreamSend(struct conn_ctx *c, void *taps_ctx, struct iovec *message,
+        int iovcnt, int fd, off_t offset, size_t len, SentCb sent,
+        ExpiredCb expired, SendErrorCb sendError);
+
+/* Copy what is left of c->rest into the posted Receive, and free it once it
+   is all taken. Returns the bytes copied. */
+size_t tcpStreamRestCopy(struct conn_ctx *c);
+
+#pragma GCC visibility pop
+
+#endif /* _TCP_STREAM_H */
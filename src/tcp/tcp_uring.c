@@ -0,0 +1,1253 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* tcp_uring.c */
+/* TCP sockets in the standardized taps interface, doing their I/O through
+   io_uring rather than readiness events. Each listener has a ring, which all
+   of its connections share:
+   * one multishot accept takes every new connection;
+   * each connection has one multishot recv, into buffers from a ring the
+     listener provides, so data is read before TAPS asks for it and Receive
+     only copies it out;
+   * requests made during a loop iteration go to the kernel in one
+     io_uring_enter(), at the end of the iteration;
+   * completions wake the event_base through an eventfd.
+   Needs Linux 6.1 (multishot recv, zero-copy sendmsg). */
+#include <errno.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "../taps.h"
+#include "../taps_protocol.h"
+#include "../proto/proto_memory.h"
+#include "tcp_sockopt.h"
+
+#define TAPS_URING_DEFAULT_MAX_LISTEN 100
+/* Connections reported per batch, if TAPS doesn't say */
+#define TAPS_URING_DEFAULT_ACCEPT_BUDGET 64
+/* Submission queue entries per listener; the completion queue is bigger,
+   since multishot requests complete many times */
+#define TAPS_URING_ENTRIES 256
+#define TAPS_URING_CQ_ENTRIES (4 * TAPS_URING_ENTRIES)
+/* Receive buffers each listener provides, a power of 2, and their size */
+#define TAPS_URING_BUFS 256
+#define TAPS_URING_BUF_SIZE (16 * 1024)
+#define TAPS_URING_BGID 0
+/* Buffers one connection may fill before its recv is paused, so an app that
+   doesn't Receive can't starve the others */
+#define TAPS_URING_CONN_BUFS 16
+/* Sends accepted per connection before the first one completes */
+#define TAPS_URING_MAX_SEND_WINDOW 64
+#define TAPS_URING_INITIAL_SENDS 1
+/* Rounds of completions in one wakeup before giving libevent a turn */
+#define TAPS_URING_RUN_BUDGET 8
+
+/* What a completion is for, in the low bits of its user_data; the rest is
+   the listener or connection. Cancels have user_data 0 and are ignored. */
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV   2
+#define URING_OP_SEND   3
+#define URING_OP_MASK   7
+#define URING_DATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+
+/* A Send, which TAPS owns until it completes */
+struct uring_send {
+    void               *taps_ctx;
+    struct iovec       *iov;
+    int                 iovcnt;
+    size_t              len;
+    int                 notifs; /* Zero-copy requests holding its pages */
+};
+
+struct listener_ctx;
+
+/* Connection context. The data path fields come first. */
+struct uring_conn {
+    int                  fd;
+    struct listener_ctx *l;
+    /* TAPS is done with it, and it only waits for the kernel to give back
+       its requests; refs counts those, and callbacks on the stack */
+    int                  closing;
+    int                  refs;
+    int                  recvArmed;  /* The multishot recv is in the kernel */
+    int                  recvPaused; /* ...and was cancelled, for holding
+                                        too many buffers */
+    int                  starved;    /* Waiting for buffers to come back */
+    /* Filled buffers not yet received, oldest first, linked through the
+       listener's bufNext; the first is used up to heldOffset */
+    int                  held, heldFirst, heldLast;
+    size_t               heldOffset;
+    int                  receivePosted;
+    int                  receiveLoop;
+    void                *receive_ctx;
+    struct iovec        *receive_buffer;
+    int                  iovcnt;
+    /* Sends not yet reported, oldest first, in a ring of sendSize that grows
+       with the window. The first sendWritten are written, and wait for the
+       kernel to let go of their pages; only the next is in the kernel at a
+       time, from sendIdx/sendOffset, so they go out in order. */
+    struct uring_send   *send;
+    int                  sendSize, sendFirst, sendCount;
+    int                  sendWritten;
+    int                  sendBusy;
+    int                  sendIdx;
+    size_t               sendOffset;
+    struct iovec         sendSaved; /* iov[sendIdx] before it was trimmed */
+    int                  zcStale;   /* Notifications owed to failed Sends */
+    struct msghdr        msg;
+    size_t               zcThreshold;
+    /* Opaque pointers for TAPS */
+    void                *taps_ctx;
+    SentCb               sent;
+    ExpiredCb            expired;
+    SendErrorCb          sendError;
+    ReceivedCb           received;
+    ReceivedPartialCb    receivedPartial;
+    ReceiveErrorCb       receiveError;
+    /* Rarely used from here on */
+    ClosedCb             closed;
+    ConnectionErrorCb    connectionError;
+    struct uring_conn   *prev, *next;   /* All of the listener's */
+    struct uring_conn   *starvedNext;
+    char                 congestion[TAPS_TCP_CA_NAME_MAX];
+};
+
+struct listener_ctx {
+    int                   ringFd;
+    /* Submission queue; entries up to sqTail are filled, and the kernel has
+       been told about those up to sqSubmitted */
+    unsigned int         *sqHead, *sqKernelTail, *sqFlags;
+    unsigned int          sqMask, sqEntries;
+    unsigned int          sqTail, sqSubmitted;
+    struct io_uring_sqe  *sqes;
+    /* Completion queue */
+    unsigned int         *cqHead, *cqTail;
+    unsigned int          cqMask;
+    struct io_uring_cqe  *cqes;
+    /* Completions taken off the queue to make room, when the kernel would
+       not take more requests; older than any still in the queue. Entries
+       stashFirst up to stashCount are yet to be handled. */
+    struct io_uring_cqe  *stash;
+    unsigned int          stashFirst, stashCount, stashSize;
+    void                 *ringMem;
+    size_t                ringSize, sqesSize;
+    /* Provided receive buffers */
+    struct io_uring_buf_ring *bufRing;
+    char                 *bufs;
+    uint16_t              bufTail;
+    int                   bufNext[TAPS_URING_BUFS];
+    uint32_t              bufLen[TAPS_URING_BUFS];
+    /* Completions come through eventFd; submitEvent flushes requests at the
+       end of a loop iteration */
+    struct event_base    *base;
+    int                   eventFd;
+    int                   edge;
+    struct event         *cqEvent;
+    struct event         *submitEvent;
+    int                   submitQueued;
+    int                   running; /* _uring_run is on the stack */
+    evutil_socket_t       fd;
+    int                   accepting;
+    int                   stopped;
+    int                   live; /* Connections TAPS still has */
+    struct uring_conn    *conns;
+    struct uring_conn    *starved;
+    ConnectionReceivedCb  connectionReceived;
+    ConnectionsReceivedCb connectionsReceived; /* NULL unless ListenBatch */
+    EstablishmentErrorCb  establishmentError;
+    ClosedCb              closed;
+    ConnectionErrorCb     connectionError;
+    void                 *taps_ctx;
+    int                   budget;
+    /* New connections waiting to be reported, budget entries each */
+    void                **pending;
+    void                **pendingTaps;
+    int                   numPending;
+};
+
+/* There is no liburing here; these are the raw system calls */
+static int
+_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete,
+        unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+            NULL, 0);
+}
+
+static int
+_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nrArgs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/* Hand everything queued to the kernel */
+static void
+_uring_submit(struct listener_ctx *l, unsigned int flags)
+{
+    int ret;
+
+    __atomic_store_n(l->sqKernelTail, l->sqTail, __ATOMIC_RELEASE);
+    ret = _uring_enter(l->ringFd, l->sqTail - l->sqSubmitted, 0, flags);
+    if (ret < 0) {
+        /* EAGAIN and EBUSY clear up as completions are reaped */
+        if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+            printf("io_uring_enter failed: %s\n", strerror(errno));
+        }
+        return;
+    }
+    l->sqSubmitted += ret;
+}
+
+/* Submit at the end of this loop iteration, with whatever else comes up */
+static void
+_uring_kick(struct listener_ctx *l)
+{
+    if (l->running || l->submitQueued) {
+        return;
+    }
+    l->submitQueued = 1;
+    event_active(l->submitEvent, EV_TIMEOUT, 0);
+}
+
+/* Move every completion in the queue to the stash, for _uring_run to
+   handle in order. Returns how many were moved, or -1 if the stash could
+   not grow. */
+static int
+_uring_stash(struct listener_ctx *l)
+{
+    struct io_uring_cqe *stash;
+    unsigned int         head = *l->cqHead, size;
+    unsigned int         tail = __atomic_load_n(l->cqTail, __ATOMIC_ACQUIRE);
+
+    if (l->stashCount + (tail - head) > l->stashSize) {
+        size = (l->stashSize) ? l->stashSize : TAPS_URING_CQ_ENTRIES;
+        while (size < l->stashCount + (tail - head)) {
+            size *= 2;
+        }
+        stash = realloc(l->stash, size * sizeof(struct io_uring_cqe));
+        if (!stash) {
+            return -1;
+        }
+        l->stash = stash;
+        l->stashSize = size;
+    }
+    while (head != tail) {
+        l->stash[l->stashCount++] = l->cqes[head & l->cqMask];
+        head++;
+    }
+    __atomic_store_n(l->cqHead, head, __ATOMIC_RELEASE);
+    return l->stashCount - l->stashFirst;
+}
+
+/* The next free submission entry, cleared. A full queue is submitted first.
+   If the kernel won't take it, with EBUSY while it has completions and no
+   room to post them, or EAGAIN, this makes room in the completion queue
+   and waits; a slot is never reused before the kernel has consumed it. */
+static struct io_uring_sqe *
+_uring_sqe(struct listener_ctx *l)
+{
+    struct io_uring_sqe *sqe;
+
+    while (l->sqTail - __atomic_load_n(l->sqHead, __ATOMIC_ACQUIRE) ==
+            l->sqEntries) {
+        _uring_submit(l, IORING_ENTER_GETEVENTS);
+        if (l->sqTail - __atomic_load_n(l->sqHead, __ATOMIC_ACQUIRE) <
+                l->sqEntries) {
+            break;
+        }
+        if (_uring_stash(l) <= 0) {
+            /* Nothing to move out of the way; wait for a completion */
+            _uring_enter(l->ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+        }
+    }
+    sqe = &l->sqes[l->sqTail & l->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    l->sqTail++;
+    _uring_kick(l);
+    return sqe;
+}
+
+static void
+_uring_cancel(struct listener_ctx *l, uint64_t data)
+{
+    struct io_uring_sqe *sqe = _uring_sqe(l);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+static void
+_uring_accept_arm(struct listener_ctx *l)
+{
+    struct io_uring_sqe *sqe = _uring_sqe(l);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(l, URING_OP_ACCEPT);
+    l->accepting = 1;
+}
+
+static void
+_uring_recv_arm(struct uring_conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->recvArmed || c->closing) {
+        return;
+    }
+    sqe = _uring_sqe(c->l);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TAPS_URING_BGID;
+    sqe->user_data = URING_DATA(c, URING_OP_RECV);
+    c->recvArmed = 1;
+    c->recvPaused = 0;
+    c->refs++;
+}
+
+/* Give a buffer back to the kernel, and restart the recvs that ran out */
+static void
+_uring_buf_put(struct listener_ctx *l, int bid)
+{
+    struct io_uring_buf *buf;
+    struct uring_conn   *c;
+
+    buf = &l->bufRing->bufs[l->bufTail & (TAPS_URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(l->bufs +
+            (size_t)bid * TAPS_URING_BUF_SIZE);
+    buf->len = TAPS_URING_BUF_SIZE;
+    buf->bid = bid;
+    l->bufTail++;
+    __atomic_store_n(&l->bufRing->tail, l->bufTail, __ATOMIC_RELEASE);
+    while (l->starved) {
+        c = l->starved;
+        l->starved = c->starvedNext;
+        c->starved = 0;
+        _uring_recv_arm(c);
+    }
+}
+
+static void
+_uring_teardown(struct listener_ctx *l)
+{
+    struct uring_conn *c;
+
+    if (l->cqEvent) {
+        event_del(l->cqEvent);
+        event_free(l->cqEvent);
+    }
+    if (l->submitEvent) {
+        event_del(l->submitEvent);
+        event_free(l->submitEvent);
+    }
+    /* The kernel cancels whatever is left when the ring goes */
+    if (l->ringFd >= 0) close(l->ringFd);
+    if (l->eventFd >= 0) close(l->eventFd);
+    if (l->fd >= 0) close(l->fd);
+    if (l->ringMem && (l->ringMem != MAP_FAILED)) {
+        munmap(l->ringMem, l->ringSize);
+    }
+    if (l->sqes && (l->sqes != MAP_FAILED)) munmap(l->sqes, l->sqesSize);
+    if (l->bufRing && (l->bufRing != MAP_FAILED)) {
+        munmap(l->bufRing, TAPS_URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    if (l->bufs && (l->bufs != MAP_FAILED)) {
+        munmap(l->bufs, (size_t)TAPS_URING_BUFS * TAPS_URING_BUF_SIZE);
+    }
+    /* Only connections TAPS has finished with are left */
+    while (l->conns) {
+        c = l->conns;
+        l->conns = c->next;
+        free(c->send);
+        protoConnFree(c);
+    }
+    free(l->pending);
+    free(l->pendingTaps);
+    free(l->stash);
+    free(l);
+}
+
+/* Once stopped, the ring goes with the last connection */
+static void
+_uring_maybe_teardown(struct listener_ctx *l)
+{
+    if (l->stopped && (l->live == 0) && !l->running) {
+        _uring_teardown(l);
+    }
+}
+
+/* Drop a reference; the last one, once TAPS is done, frees the connection */
+static void
+_uring_conn_put(struct uring_conn *c)
+{
+    struct listener_ctx *l = c->l;
+
+    if ((--c->refs > 0) || !c->closing) {
+        return;
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->conns = c->next;
+    }
+    if (c->next) c->next->prev = c->prev;
+    free(c->send);
+    protoConnFree(c);
+}
+
+/* TAPS is done with the connection: close the socket, and free the context
+   once the kernel has given back its requests. No callbacks follow. */
+static void
+_uring_conn_close(struct uring_conn *c)
+{
+    struct listener_ctx *l = c->l;
+    int                  bid;
+
+    c->closing = 1;
+    l->live--;
+    if (c->recvArmed) _uring_cancel(l, URING_DATA(c, URING_OP_RECV));
+    if (c->sendBusy) _uring_cancel(l, URING_DATA(c, URING_OP_SEND));
+    while (c->held > 0) {
+        bid = c->heldFirst;
+        c->heldFirst = l->bufNext[bid];
+        c->held--;
+        _uring_buf_put(l, bid);
+    }
+    /* The socket lives on until the cancelled requests let go of it */
+    close(c->fd);
+    c->refs++;
+    _uring_conn_put(c);
+}
+
+static struct uring_conn *
+_uring_conn_new(struct listener_ctx *l, int fd)
+{
+    struct uring_conn *c = protoConnAlloc(sizeof(*c));
+
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->l = l;
+    c->closed = l->closed;
+    c->connectionError = l->connectionError;
+    c->next = l->conns;
+    if (c->next) c->next->prev = c;
+    l->conns = c;
+    /* Counted as live until TAPS refuses it */
+    l->live++;
+    return c;
+}
+
+/* Report the connections accepted so far. TAPS sees each one before its
+   recv starts. */
+static void
+_uring_accepted(struct listener_ctx *l)
+{
+    struct uring_conn *c;
+    int                i, count = l->numPending;
+
+    if (count == 0) {
+        return;
+    }
+    l->numPending = 0;
+    if (l->stopped) {
+        /* Too late for TAPS */
+        for (i = 0; i < count; i++) {
+            _uring_conn_close(l->pending[i]);
+        }
+        return;
+    }
+    if (l->connectionsReceived) {
+        (l->connectionsReceived)(l->taps_ctx, l->pending, l->pendingTaps,
+                count);
+    } else {
+        for (i = 0; i < count; i++) {
+            l->pendingTaps[i] = (l->connectionReceived)(l->taps_ctx,
+                    l->pending[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        c = l->pending[i];
+        c->taps_ctx = l->pendingTaps[i];
+        if (!c->taps_ctx) {
+            _uring_conn_close(c);
+        } else {
+            _uring_recv_arm(c);
+        }
+    }
+}
+
+/* A Receive posted without a buffer gets one from TAPS now; see
+   protoReceiveBuffer(). The data is always here before it is copied out, so
+   nothing goes back. */
+static int
+_uring_receive_buffer(struct uring_conn *c)
+{
+    return protoReceiveBuffer(&c->receive_buffer, &c->iovcnt,
+            &c->receivePosted, c->receive_ctx, c->receiveError);
+}
+
+/* Copy buffered data into the posted Receive, and keep going while the
+   callback posts another. Receives posted from the callback only mark
+   themselves, so this loops rather than recursing. */
+static void
+_uring_deliver(struct uring_conn *c)
+{
+    struct listener_ctx *l = c->l;
+    size_t               bytes, n, left;
+    char                *data;
+    int                  i, bid;
+
+    c->refs++;
+    c->receiveLoop = 1;
+    while (c->receivePosted && (c->held > 0) && !c->closing) {
+        if (_uring_receive_buffer(c) < 0) {
+            continue;
+        }
+        bytes = 0;
+        for (i = 0; (i < c->iovcnt) && (c->held > 0); i++) {
+            n = 0;
+            while ((n < c->receive_buffer[i].iov_len) && (c->held > 0)) {
+                bid = c->heldFirst;
+                data = l->bufs + (size_t)bid * TAPS_URING_BUF_SIZE +
+                        c->heldOffset;
+                left = l->bufLen[bid] - c->heldOffset;
+                if (left > c->receive_buffer[i].iov_len - n) {
+                    left = c->receive_buffer[i].iov_len - n;
+                }
+                memcpy((char *)c->receive_buffer[i].iov_base + n, data, left);
+                n += left;
+                c->heldOffset += left;
+                if (c->heldOffset == l->bufLen[bid]) {
+                    c->heldFirst = l->bufNext[bid];
+                    c->heldOffset = 0;
+                    c->held--;
+                    _uring_buf_put(l, bid);
+                }
+            }
+            bytes += n;
+        }
+        c->receivePosted = 0;
+        (c->receivedPartial)(c->receive_ctx, c->receive_buffer, bytes);
+    }
+    c->receiveLoop = 0;
+    if (c->recvPaused && !c->recvArmed &&
+            (c->held <= TAPS_URING_CONN_BUFS / 2)) {
+        _uring_recv_arm(c);
+    }
+    _uring_conn_put(c);
+}
+
+/* The peer closed, or the socket failed */
+static void
+_uring_conn_ended(struct uring_conn *c, int error)
+{
+    ClosedCb           closed = c->closed;
+    ConnectionErrorCb  connectionError = c->connectionError;
+    void              *taps_ctx = c->taps_ctx;
+
+    _uring_conn_close(c);
+    if (error) {
+        (connectionError)(taps_ctx, strerror(error));
+    } else {
+        (closed)(taps_ctx);
+    }
+}
+
+static void
+_uring_recv_done(struct uring_conn *c, struct io_uring_cqe *cqe)
+{
+    struct listener_ctx *l = c->l;
+    int                  bid;
+
+    if (cqe->res > 0) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (c->closing) {
+            _uring_buf_put(l, bid);
+        } else {
+            l->bufLen[bid] = cqe->res;
+            l->bufNext[bid] = -1;
+            if (c->held++ == 0) {
+                c->heldFirst = bid;
+                c->heldOffset = 0;
+            } else {
+                l->bufNext[c->heldLast] = bid;
+            }
+            c->heldLast = bid;
+            if ((c->held >= TAPS_URING_CONN_BUFS) && !c->recvPaused &&
+                    (cqe->flags & IORING_CQE_F_MORE)) {
+                c->recvPaused = 1;
+                _uring_cancel(l, URING_DATA(c, URING_OP_RECV));
+            }
+        }
+    } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+        _uring_buf_put(l, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recvArmed = 0;
+        if (c->closing) {
+            _uring_conn_put(c);
+            return;
+        }
+        if (cqe->res == 0) {
+            /* End of stream. Like the readiness-based module, this closes
+               at once, with anything unreceived. */
+            _uring_conn_put(c);
+            _uring_conn_ended(c, 0);
+            return;
+        }
+        if (cqe->res == -ENOBUFS) {
+            if (!c->starved) {
+                c->starved = 1;
+                c->starvedNext = l->starved;
+                l->starved = c;
+            }
+        } else if ((cqe->res < 0) && (cqe->res != -ECANCELED)) {
+            printf("TCP recv failed: %s\n", strerror(-cqe->res));
+            _uring_conn_put(c);
+            _uring_conn_ended(c, -cqe->res);
+            return;
+        } else if (!c->recvPaused) {
+            /* The kernel can end a multishot request for its own reasons */
+            _uring_recv_arm(c);
+        }
+        _uring_conn_put(c);
+    }
+    if (c->receivePosted && !c->receiveLoop && (c->held > 0)) {
+        _uring_deliver(c);
+    }
+}
+
+#define SEND_AT(c, i) (&(c)->send[((c)->sendFirst + (i)) % (c)->sendSize])
+
+/* Double the send ring, up to TAPS_URING_MAX_SEND_WINDOW */
+static int
+_uring_send_grow(struct uring_conn *c)
+{
+    struct uring_send *send;
+    int                size, i;
+
+    size = (c->sendSize) ? c->sendSize * 2 : TAPS_URING_INITIAL_SENDS;
+    if (size > TAPS_URING_MAX_SEND_WINDOW) {
+        return -1;
+    }
+    send = malloc(sizeof(struct uring_send) * size);
+    if (!send) {
+        return -1;
+    }
+    for (i = 0; i < c->sendCount; i++) {
+        send[i] = *SEND_AT(c, i);
+    }
+    free(c->send);
+    c->send = send;
+    c->sendSize = size;
+    c->sendFirst = 0;
+    return 0;
+}
+
+/* Put the rest of the first unwritten Send in the kernel. MSG_WAITALL has
+   it retry short writes itself, so this is usually one request per Send. */
+static void
+_uring_send_next(struct uring_conn *c)
+{
+    struct uring_send   *s = SEND_AT(c, c->sendWritten);
+    struct io_uring_sqe *sqe;
+
+    while ((c->sendIdx < s->iovcnt) &&
+            (s->iov[c->sendIdx].iov_len == c->sendOffset)) {
+        c->sendIdx++;
+        c->sendOffset = 0;
+    }
+    /* Trim the iovec we stopped in while the request has it, rather than
+       copy the rest of the array */
+    if (c->sendIdx < s->iovcnt) {
+        c->sendSaved = s->iov[c->sendIdx];
+        s->iov[c->sendIdx].iov_base = (char *)c->sendSaved.iov_base +
+                c->sendOffset;
+        s->iov[c->sendIdx].iov_len = c->sendSaved.iov_len - c->sendOffset;
+    }
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = &s->iov[c->sendIdx];
+    c->msg.msg_iovlen = s->iovcnt - c->sendIdx;
+    sqe = _uring_sqe(c->l);
+    sqe->opcode = (c->zcThreshold && (s->len >= c->zcThreshold)) ?
+            IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = URING_DATA(c, URING_OP_SEND);
+    c->sendBusy = 1;
+    c->refs++;
+}
+
+/* Report the written Sends the kernel has let go of, in order */
+static void
+_uring_send_report(struct uring_conn *c)
+{
+    struct uring_send *s;
+
+    while ((c->sendWritten > 0) && !c->closing) {
+        s = SEND_AT(c, 0);
+        if (s->notifs > 0) {
+            break;
+        }
+        c->sendFirst = (c->sendFirst + 1) % c->sendSize;
+        c->sendCount--;
+        c->sendWritten--;
+        (c->sent)(s->taps_ctx);
+    }
+}
+
+static void
+_uring_send_done(struct uring_conn *c, struct io_uring_cqe *cqe)
+{
+    struct uring_send *s;
+    ssize_t            bytes;
+    size_t             left;
+    char              *reason;
+    int                zc, i;
+
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        /* The kernel is done with a zero-copy request's pages. They come
+           back in order, so this is the oldest request still holding any. */
+        if (c->zcStale > 0) {
+            c->zcStale--;
+        } else {
+            for (i = 0; i < c->sendCount; i++) {
+                s = SEND_AT(c, i);
+                if (s->notifs > 0) {
+                    s->notifs--;
+                    break;
+                }
+            }
+        }
+        _uring_send_report(c);
+        _uring_conn_put(c);
+        return;
+    }
+    /* Zero-copy, and the notification follows; that drops the reference */
+    zc = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    c->sendBusy = 0;
+    if (c->closing) {
+        if (!zc) _uring_conn_put(c);
+        return;
+    }
+    s = SEND_AT(c, c->sendWritten);
+    if (c->sendIdx < s->iovcnt) {
+        s->iov[c->sendIdx] = c->sendSaved;
+    }
+    if (zc) {
+        s->notifs++;
+    }
+    bytes = cqe->res;
+    if (bytes < 0) {
+        reason = strerror(-bytes);
+        printf("TCP sendmsg failed: %s\n", reason);
+        /* Written or not, none was reported yet; fail them all, in order.
+           Completions may call Send again; only fail the ones we have, and
+           hold the new ones until then. */
+        left = c->sendCount;
+        c->sendWritten = 0;
+        c->sendIdx = 0;
+        c->sendOffset = 0;
+        c->sendBusy = 1;
+        while ((left-- > 0) && !c->closing) {
+            s = SEND_AT(c, 0);
+            c->sendFirst = (c->sendFirst + 1) % c->sendSize;
+            c->sendCount--;
+            c->zcStale += s->notifs;
+            (c->sendError)(s->taps_ctx, reason);
+        }
+        c->sendBusy = 0;
+        if (!c->closing && (c->sendCount > 0)) {
+            _uring_send_next(c);
+        }
+        if (!zc) _uring_conn_put(c);
+        return;
+    }
+    while ((bytes > 0) && (c->sendIdx < s->iovcnt)) {
+        left = s->iov[c->sendIdx].iov_len - c->sendOffset;
+        if ((size_t)bytes < left) {
+            c->sendOffset += bytes;
+            break;
+        }
+        bytes -= left;
+        c->sendIdx++;
+        c->sendOffset = 0;
+    }
+    if (c->sendIdx == s->iovcnt) {
+        c->sendWritten++;
+        c->sendIdx = 0;
+        c->sendOffset = 0;
+        _uring_send_report(c);
+    }
+    /* Unless the callback sent the next one already */
+    if (!c->closing && !c->sendBusy && (c->sendCount > c->sendWritten)) {
+        _uring_send_next(c);
+    }
+    if (!zc) _uring_conn_put(c);
+}
+
+static void
+_uring_accept_done(struct listener_ctx *l, struct io_uring_cqe *cqe)
+{
+    struct uring_conn *c;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        l->accepting = 0;
+    }
+    if (cqe->res >= 0) {
+        if (l->stopped) {
+            close(cqe->res);
+        } else {
+            c = _uring_conn_new(l, cqe->res);
+            if (c) {
+                l->pending[l->numPending++] = c;
+                if (l->numPending == l->budget) {
+                    _uring_accepted(l);
+                }
+            }
+        }
+    } else if ((cqe->res != -ECANCELED) && (cqe->res != -EINTR) &&
+            (cqe->res != -ECONNABORTED)) {
+        /* EMFILE and the like; it is re-armed below */
+        printf("TCP accept failed: %s\n", strerror(-cqe->res));
+    }
+    if (!l->accepting && !l->stopped) {
+        _uring_accept_arm(l);
+    }
+}
+
+/* The oldest completion not yet handled, from the stash first */
+static int
+_uring_cqe_pop(struct listener_ctx *l, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *l->cqHead;
+
+    if (l->stashFirst < l->stashCount) {
+        *cqe = l->stash[l->stashFirst++];
+        if (l->stashFirst == l->stashCount) {
+            l->stashFirst = l->stashCount = 0;
+        }
+        return 1;
+    }
+    if (head == __atomic_load_n(l->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = l->cqes[head & l->cqMask];
+    /* Free the slot before callbacks can fill the queue */
+    __atomic_store_n(l->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Submit what is queued and handle what has completed, until both are
+   empty or it is someone else's turn. Completions made from callbacks are
+   submitted with the next round, in the same io_uring_enter(). */
+static void
+_uring_run(struct listener_ctx *l)
+{
+    struct io_uring_cqe  cqe;
+    unsigned int         count;
+    int                  rounds = TAPS_URING_RUN_BUDGET;
+    void                *ptr;
+
+    l->running = 1;
+    while (rounds-- > 0) {
+        if (__atomic_load_n(l->sqFlags, __ATOMIC_RELAXED) &
+                IORING_SQ_CQ_OVERFLOW) {
+            _uring_submit(l, IORING_ENTER_GETEVENTS);
+        } else if (l->sqTail != l->sqSubmitted) {
+            _uring_submit(l, 0);
+        }
+        /* Just what is here now; the rest waits for the next round */
+        count = l->stashCount - l->stashFirst + (__atomic_load_n(l->cqTail,
+                __ATOMIC_ACQUIRE) - *l->cqHead);
+        if (count == 0) {
+            break;
+        }
+        while ((count-- > 0) && _uring_cqe_pop(l, &cqe)) {
+            ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+            switch (cqe.user_data & URING_OP_MASK) {
+            case URING_OP_ACCEPT:
+                _uring_accept_done(ptr, &cqe);
+                break;
+            case URING_OP_RECV:
+                _uring_recv_done(ptr, &cqe);
+                break;
+            case URING_OP_SEND:
+                _uring_send_done(ptr, &cqe);
+                break;
+            default:
+                break;
+            }
+        }
+        _uring_accepted(l);
+    }
+    if (rounds < 0) {
+        /* Still busy; come back after the others have had a turn */
+        l->running = 0;
+        _uring_kick(l);
+    }
+    l->running = 0;
+    _uring_maybe_teardown(l);
+}
+
+static void
+_uring_completed(evutil_socket_t fd, short event, void *arg)
+{
+    struct listener_ctx *l = arg;
+    uint64_t             count;
+
+    /* Edge-triggered, every completion is a new edge, and the counter can
+       just climb */
+    if (!l->edge && (read(l->eventFd, &count, sizeof(count)) < 0)) {
+        return;
+    }
+    _uring_run(l);
+}
+
+static void
+_uring_flush(evutil_socket_t fd, short event, void *arg)
+{
+    struct listener_ctx *l = arg;
+
+    l->submitQueued = 0;
+    _uring_run(l);
+}
+
+/* Set up the rings, the provided buffers, and the eventfd */
+static int
+_uring_init(struct listener_ctx *l)
+{
+    struct io_uring_params  p;
+    struct io_uring_buf_reg reg;
+    size_t                  sqSize, cqSize;
+    unsigned int            i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = TAPS_URING_CQ_ENTRIES;
+    l->ringFd = _uring_setup(TAPS_URING_ENTRIES, &p);
+    if (l->ringFd < 0) {
+        printf("io_uring_setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+        printf("io_uring is too old\n");
+        return -1;
+    }
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    l->ringSize = (sqSize > cqSize) ? sqSize : cqSize;
+    l->ringMem = mmap(NULL, l->ringSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, l->ringFd, IORING_OFF_SQ_RING);
+    l->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    l->sqes = mmap(NULL, l->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, l->ringFd, IORING_OFF_SQES);
+    if ((l->ringMem == MAP_FAILED) || (l->sqes == MAP_FAILED)) {
+        return -1;
+    }
+    l->sqHead = (unsigned int *)((char *)l->ringMem + p.sq_off.head);
+    l->sqKernelTail = (unsigned int *)((char *)l->ringMem + p.sq_off.tail);
+    l->sqFlags = (unsigned int *)((char *)l->ringMem + p.sq_off.flags);
+    l->sqMask = *(unsigned int *)((char *)l->ringMem + p.sq_off.ring_mask);
+    l->sqEntries = p.sq_entries;
+    l->sqTail = l->sqSubmitted = *l->sqKernelTail;
+    /* Slot i of the queue is always entry i */
+    for (i = 0; i < p.sq_entries; i++) {
+        ((unsigned int *)((char *)l->ringMem + p.sq_off.array))[i] = i;
+    }
+    l->cqHead = (unsigned int *)((char *)l->ringMem + p.cq_off.head);
+    l->cqTail = (unsigned int *)((char *)l->ringMem + p.cq_off.tail);
+    l->cqMask = *(unsigned int *)((char *)l->ringMem + p.cq_off.ring_mask);
+    l->cqes = (struct io_uring_cqe *)((char *)l->ringMem + p.cq_off.cqes);
+
+    l->bufRing = mmap(NULL, TAPS_URING_BUFS * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    l->bufs = mmap(NULL, (size_t)TAPS_URING_BUFS * TAPS_URING_BUF_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((l->bufRing == MAP_FAILED) || (l->bufs == MAP_FAILED)) {
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)l->bufRing;
+    reg.ring_entries = TAPS_URING_BUFS;
+    reg.bgid = TAPS_URING_BGID;
+    if (_uring_register(l->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        printf("io_uring provided buffers failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < TAPS_URING_BUFS; i++) {
+        _uring_buf_put(l, i);
+    }
+
+    l->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    /* Not IORING_REGISTER_EVENTFD_ASYNC: that only signals completions from
+       the kernel's worker threads, and socket operations mostly complete
+       from poll wakeups instead */
+    if ((l->eventFd < 0) || (_uring_register(l->ringFd,
+            IORING_REGISTER_EVENTFD, &l->eventFd, 1) < 0)) {
+        return -1;
+    }
+    l->edge = (event_base_get_features(l->base) & EV_FEATURE_ET) != 0;
+    l->cqEvent = event_new(l->base, l->eventFd,
+            EV_READ | EV_PERSIST | ((l->edge) ? EV_ET : 0),
+            &_uring_completed, l);
+    l->submitEvent = event_new(l->base, -1, 0, &_uring_flush, l);
+    if (!l->cqEvent || !l->submitEvent || (event_add(l->cqEvent, NULL) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *
+_uring_listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, int reusePort,
+        ConnectionReceivedCb connectionReceived,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    struct listener_ctx *listener;
+    size_t               addr_size = (local->sa_family == AF_INET) ?
+            sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    int                  one = 1;
+
+    TAPS_TRACE();
+    listener = malloc(sizeof(struct listener_ctx));
+    if (!listener) return NULL;
+    memset(listener, 0, sizeof(struct listener_ctx));
+    listener->ringFd = listener->eventFd = listener->fd = -1;
+    listener->base = base;
+    listener->budget = (budget > 0) ? budget : 1;
+    listener->connectionReceived = connectionReceived;
+    listener->connectionsReceived = connectionsReceived;
+    listener->establishmentError = establishmentError;
+    listener->closed = closed;
+    listener->connectionError = connectionError;
+    listener->taps_ctx = taps_ctx;
+    listener->pending = calloc(listener->budget, sizeof(void *));
+    listener->pendingTaps = calloc(listener->budget, sizeof(void *));
+    if (!listener->pending || !listener->pendingTaps ||
+            (_uring_init(listener) < 0)) {
+        goto fail;
+    }
+    /* Blocking, since io_uring waits for the socket itself */
+    listener->fd = socket(local->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener->fd < 0) goto fail;
+    setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reusePort && (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT,
+            &one, sizeof(one)) < 0)) {
+        printf("TCP SO_REUSEPORT failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (bind(listener->fd, local, addr_size) < 0) {
+        printf("TCP bind failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (listen(listener->fd, TAPS_URING_DEFAULT_MAX_LISTEN) < 0) {
+        printf("TCP listen failed\n");
+        goto fail;
+    }
+    _uring_accept_arm(listener);
+    return listener;
+fail:
+    _uring_teardown(listener);
+    return NULL;
+}
+
+void *
+Listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        ConnectionReceivedCb connectionReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _uring_listen(taps_ctx, base, local,
+            TAPS_URING_DEFAULT_ACCEPT_BUDGET, 0, connectionReceived, NULL,
+            establishmentError, closed, connectionError);
+}
+
+void *
+ListenBatch(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _uring_listen(taps_ctx, base, local, budget, 0, NULL,
+            connectionsReceived, establishmentError, closed, connectionError);
+}
+
+void *
+ListenShard(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _uring_listen(taps_ctx, base, local, budget, 1, NULL,
+            connectionsReceived, establishmentError, closed, connectionError);
+}
+
+/* Stop accepting. Connections carry on, on the same ring, which goes when
+   the last of them does. */
+void
+Stop(void *proto_ctx, StoppedCb cb)
+{
+    struct listener_ctx *l = proto_ctx;
+    void                *taps_ctx = l->taps_ctx;
+
+    TAPS_TRACE();
+    l->stopped = 1;
+    if (l->accepting) {
+        _uring_cancel(l, URING_DATA(l, URING_OP_ACCEPT));
+    }
+    close(l->fd);
+    l->fd = -1;
+    _uring_maybe_teardown(l);
+    (*cb)(taps_ctx);
+}
+
+unsigned int
+MaxSendWindow(void)
+{
+    return TAPS_URING_MAX_SEND_WINDOW;
+}
+
+/* Reset the connection, rather than close it gracefully */
+void
+Abort(void *proto_ctx)
+{
+    struct uring_conn   *c = proto_ctx;
+    struct listener_ctx *l = c->l;
+    struct linger        linger = { 1, 0 };
+
+    TAPS_TRACE();
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    _uring_conn_close(c);
+    _uring_maybe_teardown(l);
+}
+
+int
+SetProperty(void *proto_ctx, char *name, void *value, size_t len)
+{
+    struct uring_conn *c = proto_ctx;
+
+    TAPS_TRACE();
+    if (strcmp(name, "zeroCopyThreshold") == 0) {
+        /* Zero-copy sends are reported when the kernel lets go of the
+           pages, which comes as a second completion */
+        if (len != sizeof(size_t)) {
+            errno = EINVAL;
+            return -1;
+        }
+        c->zcThreshold = *(size_t *)value;
+        return 0;
+    }
+    return tcpSetSocketProperty(c->fd, c->congestion, name, value, len);
+}
+
+/* Sends always complete later, through the ring */
+int
+Send(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError)
+{
+    struct uring_conn *c = proto_ctx;
+    struct uring_send *s;
+    int                i;
+
+    TAPS_TRACE();
+    if (!c->sent) {
+        c->sent = sent;
+        c->expired = expired;
+        c->sendError = sendError;
+    }
+    if ((c->sendCount == c->sendSize) && (_uring_send_grow(c) < 0)) {
+        printf("TCP send window full\n");
+        return -1;
+    }
+    s = SEND_AT(c, c->sendCount);
+    s->taps_ctx = taps_ctx;
+    s->iov = message;
+    s->iovcnt = iovcnt;
+    s->len = 0;
+    s->notifs = 0;
+    for (i = 0; i < iovcnt; i++) {
+        s->len += message[i].iov_len;
+    }
+    c->sendCount++;
+    if (!c->sendBusy) {
+        _uring_send_next(c);
+    }
+    return 0;
+}
+
+int
+Receive(void *proto_ctx, void *taps_ctx, struct iovec *iovec, int iovcnt,
+        ReceivedCb received, ReceivedPartialCb receivedPartial,
+        ReceiveErrorCb receiveError)
+{
+    struct uring_conn *c = proto_ctx;
+
+    TAPS_TRACE();
+    if (!c->received) {
+        c->received = received;
+        c->receivedPartial = receivedPartial;
+        c->receiveError = receiveError;
+    }
+    if (c->receivePosted) {
+        printf("Two TCP recv at once\n");
+        return -1;
+    }
+    c->receive_ctx = taps_ctx;
+    c->receive_buffer = iovec;
+    c->iovcnt = iovcnt;
+    c->receivePosted = 1;
+    /* The recv is always armed, so anything already here is buffered */
+    if (!c->receiveLoop) {
+        _uring_deliver(c);
+    }
+    return 0;
+}
@@ -0,0 +1,1306 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* udp.c */
+/* Wrap UDP sockets in a standardized taps interface. A listener has one
+   socket, and each peer that sends to it becomes a connection on that
+   socket. Every Send and Receive is one datagram. Datagrams are read with
+   recvmmsg(), many per wakeup, and sorted out to their connections; Sends
+   made during a loop iteration go out together with sendmmsg() at the end of
+   it, whichever connections they are for. Where the kernel allows, runs of
+   equal-sized Sends to one peer go down as a single UDP_SEGMENT (GSO) buffer,
+   and UDP_GRO buffers coming up are split back into their datagrams.
+   Peers are found in an open-addressing hash table. One that goes quiet is
+   closed after a while. If TAPS asks, one that gets busy is given a socket
+   of its own, connected to it, so that the kernel sorts out its datagrams. */
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
+#include <errno.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "../taps.h"
+#include "../taps_protocol.h"
+#include "../proto/proto_memory.h"
+
+/* New peers reported per batch, if TAPS doesn't say */
+#define TAPS_UDP_DEFAULT_ACCEPT_BUDGET 64
+/* Datagrams moved by one recvmmsg() or sendmmsg() */
+#define TAPS_UDP_BATCH 32
+/* recvmmsg() calls per wakeup before giving the loop a turn */
+#define TAPS_UDP_RECEIVE_ROUNDS 4
+/* Largest UDP payload, so nothing is truncated on the way in */
+#define TAPS_UDP_MAX_DATAGRAM 65535
+/* Datagrams kept for a connection that hasn't posted a Receive; after that
+   they are dropped, as the network might have */
+#define TAPS_UDP_CONN_HELD 64
+/* Sends accepted per connection before the first one completes */
+#define TAPS_UDP_MAX_SEND_WINDOW 64
+/* Send queue entries to start with; it grows as needed */
+#define TAPS_UDP_INITIAL_SENDS 16
+/* Most datagrams in one GSO buffer (UDP_MAX_SEGMENTS in the kernel), and the
+   most payload, for IPv4, that buffer can have */
+#define TAPS_UDP_GSO_SEGMENTS 64
+#define TAPS_UDP_GSO_BYTES 65507
+/* iovec entries for GSO buffers in one sendmmsg() */
+#define TAPS_UDP_SEND_IOV 1024
+/* Peer table slots to start with; a power of 2, never more than half full */
+#define TAPS_UDP_INITIAL_SLOTS 64
+/* Seconds between sweeps for idle peers */
+#define TAPS_UDP_SWEEP_INTERVAL 1
+/* Seconds without a datagram either way before a peer's connection closes,
+   unless TAPS sets another timeout */
+#define TAPS_UDP_IDLE_TIMEOUT 120
+/* Connections closed per sweep, so that a crowd going quiet at once doesn't
+   stall the loop */
+#define TAPS_UDP_EVICT_BUDGET 65536
+
+/* A datagram that arrived before there was a Receive for it */
+struct udp_held {
+    struct udp_held    *next;
+    size_t              len;
+    char                data[];
+};
+
+struct listener_ctx;
+
+/* Connection context: one peer of a listener */
+struct udp_conn {
+    struct listener_ctx *l;
+    /* TAPS is done with it when closing is set. refs counts TAPS's hold,
+       queued Sends, and callbacks on the stack. */
+    int                  closing;
+    int                  refs;
+    /* Datagrams waiting for a Receive, oldest first; the first has been
+       delivered up to heldOffset */
+    struct udp_held     *heldFirst, *heldLast;
+    int                  held;
+    size_t               heldOffset;
+    int                  receivePosted; /* receive_ctx is waiting for data */
+    int                  receiveLoop;   /* _udp_deliver is on the stack */
+    void                *receive_ctx;
+    struct iovec        *receive_buffer;
+    int                  iovcnt;
+    /* Opaque pointers for TAPS */
+    void                *taps_ctx;
+    SentCb               sent;
+    ExpiredCb            expired;
+    SendErrorCb          sendError;
+    ReceivedCb           received;
+    ReceivedPartialCb    receivedPartial;
+    ReceiveErrorCb       receiveError;
+    /* Datagrams this sweep interval, which is epoch */
+    unsigned int         recent;
+    unsigned int         epoch;
+    uint64_t             lastActive; /* ms, monotonic */
+    /* The listener's, most recently active first */
+    struct udp_conn     *prev, *next;
+    uint32_t             hash;
+    /* A busy peer's own socket, connected to it */
+    struct event        *readEvent;
+    /* Rarely used from here on */
+    socklen_t            peerLen;
+    struct sockaddr_storage peer;
+};
+
+/* A peer table entry. The hash is kept so that probes rarely have to look
+   at the connection. */
+struct udp_slot {
+    uint32_t            hash;
+    struct udp_conn    *c;     /* NULL if empty */
+};
+
+/* A Send, which TAPS owns until it completes. It holds a reference on its
+   connection. */
+struct udp_send {
+    struct udp_conn    *c;
+    void               *taps_ctx;
+    struct iovec       *iov;
+    int                 iovcnt;
+};
+
+struct listener_ctx {
+    evutil_socket_t       fd;
+    struct event_base    *base;
+    struct event         *readEvent;
+    struct event         *writeEvent;  /* Only while the socket is full */
+    struct event         *flushEvent;  /* Sends at the end of the iteration */
+    struct event         *sweepEvent;
+    int                   flushQueued;
+    int                   flushing;    /* _udp_flush is on the stack */
+    int                   writeBlocked;
+    int                   running;     /* Callbacks on the stack */
+    int                   stopped;
+    /* Sends not yet made, oldest first: entries sendFirst to sendCount */
+    struct udp_send      *send;
+    int                   sendFirst, sendCount, sendSize;
+    /* Each sendmmsg() entry is sendSegs Sends from sendIdx on; more than one
+       makes a GSO buffer, whose iovec is gathered into sendIov */
+    struct mmsghdr        sendMsgs[TAPS_UDP_BATCH];
+    int                   sendIdx[TAPS_UDP_BATCH];
+    int                   sendSegs[TAPS_UDP_BATCH];
+    struct iovec          sendIov[TAPS_UDP_SEND_IOV];
+    union {
+        char              buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr    align;
+    }                     sendCtl[TAPS_UDP_BATCH];
+    /* Largest segment the kernel has taken; 0 without GSO */
+    size_t                gsoMax;
+    /* Where recvmmsg() puts each datagram, and the UDP_GRO segment size if
+       the kernel coalesced several */
+    struct mmsghdr        rcvMsgs[TAPS_UDP_BATCH];
+    struct iovec          rcvIov[TAPS_UDP_BATCH];
+    struct sockaddr_storage rcvAddr[TAPS_UDP_BATCH];
+    union {
+        char              buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr    align;
+    }                     rcvCtl[TAPS_UDP_BATCH];
+    char                 *rcvBufs;
+    /* Peers, by hash with linear probing. The seed is random, so that
+       peers can't pick addresses that collide. */
+    struct udp_slot      *slots;
+    uint32_t              slotMask;
+    unsigned int          numConns;
+    uint64_t              seed;
+    /* Every connection, most recently active first */
+    struct udp_conn      *conns, *connsLast;
+    uint64_t              now; /* ms, monotonic */
+    uint64_t              idleTimeout; /* ms */
+    /* Datagrams from a peer within one sweep interval that earn it a
+       connected socket; 0 never does */
+    unsigned int          busyDatagrams;
+    unsigned int          epoch;
+    socklen_t             localLen;
+    struct sockaddr_storage local;
+    ConnectionReceivedCb  connectionReceived;
+    ConnectionsReceivedCb connectionsReceived; /* NULL unless ListenBatch */
+    EstablishmentErrorCb  establishmentError;
+    ClosedCb              closed;
+    ConnectionErrorCb     connectionError;
+    void                 *taps_ctx;
+    int                   budget;
+    /* New peers waiting to be reported, budget entries each */
+    void                **pending;
+    void                **pendingTaps;
+    int                   numPending;
+};
+
+/* ms a peer may be quiet, for listeners created afterwards; 0 for the
+   default */
+static unsigned int  peerIdleTimeout = 0;
+/* The same, for busyDatagrams */
+static unsigned int  busyPeerDatagrams = 0;
+
+void
+SetPeerIdleTimeout(unsigned int ms)
+{
+    TAPS_TRACE();
+    peerIdleTimeout = ms;
+}
+
+void
+SetBusyPeerDatagrams(unsigned int datagrams)
+{
+    TAPS_TRACE();
+    busyPeerDatagrams = datagrams;
+}
+
+/* The time, in ms, from a clock that doesn't jump when the wall clock is
+   set. Coarse is fine for a sweep once a second. */
+static uint64_t
+_udp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+_udp_conn_put(struct udp_conn *c)
+{
+    if (--c->refs > 0) {
+        return;
+    }
+    protoConnFree(c);
+}
+
+static uint64_t
+_udp_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t
+_udp_peer_hash(struct listener_ctx *l, struct sockaddr *peer)
+{
+    struct sockaddr_in  *sin = (struct sockaddr_in *)peer;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)peer;
+    uint64_t             h, w[2];
+
+    if (peer->sa_family == AF_INET) {
+        h = _udp_mix(l->seed ^ ((uint64_t)sin->sin_addr.s_addr << 16) ^
+                sin->sin_port);
+    } else {
+        memcpy(w, &sin6->sin6_addr, sizeof(w));
+        h = _udp_mix(l->seed ^ w[0]);
+        h = _udp_mix(h ^ w[1]);
+        h = _udp_mix(h ^ sin6->sin6_port);
+    }
+    return (uint32_t)h;
+}
+
+static int
+_udp_peer_equal(struct sockaddr_storage *a, struct sockaddr *b)
+{
+    struct sockaddr_in  *a4 = (struct sockaddr_in *)a;
+    struct sockaddr_in  *b4 = (struct sockaddr_in *)b;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)a;
+    struct sockaddr_in6 *b6 = (struct sockaddr_in6 *)b;
+
+    if (a->ss_family != b->sa_family) {
+        return 0;
+    }
+    if (a->ss_family == AF_INET) {
+        return (a4->sin_port == b4->sin_port) &&
+                (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+    }
+    return (a6->sin6_port == b6->sin6_port) &&
+            (memcmp(&a6->sin6_addr, &b6->sin6_addr,
+            sizeof(a6->sin6_addr)) == 0);
+}
+
+/* Double the peer table */
+static int
+_udp_slots_grow(struct listener_ctx *l)
+{
+    struct udp_slot *slots, *old = l->slots;
+    uint32_t         mask = 2 * l->slotMask + 1, i, j;
+
+    slots = calloc((size_t)mask + 1, sizeof(struct udp_slot));
+    if (!slots) {
+        return -1;
+    }
+    for (i = 0; i <= l->slotMask; i++) {
+        if (!old[i].c) {
+            continue;
+        }
+        for (j = old[i].hash & mask; slots[j].c; j = (j + 1) & mask);
+        slots[j] = old[i];
+    }
+    free(old);
+    l->slots = slots;
+    l->slotMask = mask;
+    return 0;
+}
+
+/* Take c out of the peer table. Entries after it move back into the gap if
+   that is no further from where they belong, so lookups never need
+   tombstones. */
+static void
+_udp_slots_remove(struct listener_ctx *l, struct udp_conn *c)
+{
+    uint32_t mask = l->slotMask, i, j, home;
+
+    for (i = c->hash & mask; l->slots[i].c != c; i = (i + 1) & mask) {
+        if (!l->slots[i].c) {
+            return;
+        }
+    }
+    for (j = (i + 1) & mask; l->slots[j].c; j = (j + 1) & mask) {
+        home = l->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            l->slots[i] = l->slots[j];
+            i = j;
+        }
+    }
+    l->slots[i].c = NULL;
+    l->numConns--;
+}
+
+static void
+_udp_lru_unlink(struct listener_ctx *l, struct udp_conn *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        l->connsLast = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+/* The peer was heard from, or sent to */
+static void
+_udp_touch(struct listener_ctx *l, struct udp_conn *c)
+{
+    c->lastActive = l->now;
+    if (c == l->conns) {
+        return;
+    }
+    _udp_lru_unlink(l, c);
+    c->next = l->conns;
+    l->conns->prev = c;
+    l->conns = c;
+}
+
+/* TAPS is done with the connection: forget the peer, and drop what it was
+   holding. Queued Sends are skipped when their turn comes. */
+static void
+_udp_conn_close(struct udp_conn *c)
+{
+    struct listener_ctx *l = c->l;
+    struct udp_held     *h;
+
+    c->closing = 1;
+    c->receivePosted = 0;
+    while ((h = c->heldFirst)) {
+        c->heldFirst = h->next;
+        free(h);
+    }
+    c->heldLast = NULL;
+    c->held = 0;
+    if (c->readEvent) {
+        close(event_get_fd(c->readEvent));
+        event_free(c->readEvent);
+        c->readEvent = NULL;
+    }
+    _udp_slots_remove(l, c);
+    _udp_lru_unlink(l, c);
+    _udp_conn_put(c);
+}
+
+static void
+_udp_teardown(struct listener_ctx *l)
+{
+    int i;
+
+    if (l->readEvent) event_free(l->readEvent);
+    if (l->writeEvent) event_free(l->writeEvent);
+    if (l->flushEvent) event_free(l->flushEvent);
+    if (l->sweepEvent) event_free(l->sweepEvent);
+    if (l->fd >= 0) close(l->fd);
+    for (i = l->sendFirst; i < l->sendCount; i++) {
+        _udp_conn_put(l->send[i].c);
+    }
+    free(l->send);
+    free(l->rcvBufs);
+    free(l->slots);
+    free(l->pending);
+    free(l->pendingTaps);
+    free(l);
+}
+
+/* After Stop, the listener goes once nothing of it is on the stack */
+static void
+_udp_maybe_teardown(struct listener_ctx *l)
+{
+    if (l->stopped && !l->running) {
+        _udp_teardown(l);
+    }
+}
+
+static struct udp_conn *
+_udp_conn_find(struct listener_ctx *l, struct sockaddr *peer, uint32_t hash)
+{
+    struct udp_slot *slot;
+    uint32_t         i;
+
+    for (i = hash & l->slotMask; (slot = &l->slots[i])->c;
+            i = (i + 1) & l->slotMask) {
+        if ((slot->hash == hash) && _udp_peer_equal(&slot->c->peer, peer)) {
+            return slot->c;
+        }
+    }
+    return NULL;
+}
+
+static struct udp_conn *
+_udp_conn_new(struct listener_ctx *l, struct sockaddr *peer,
+        socklen_t peerLen, uint32_t hash)
+{
+    size_t           size = sizeof(struct udp_conn);
+    struct udp_conn *c;
+    uint32_t         i;
+
+    /* Keep the table at most half full, or at least one slot empty if it
+       can't grow */
+    if ((2 * (l->numConns + 1) > l->slotMask + 1) &&
+            (_udp_slots_grow(l) < 0) && (l->numConns + 1 > l->slotMask)) {
+        return NULL;
+    }
+    c = protoConnAlloc(size);
+    if (!c) {
+        return NULL;
+    }
+    memset(c, 0, size);
+    c->l = l;
+    c->refs = 1;
+    c->hash = hash;
+    c->epoch = l->epoch;
+    c->lastActive = l->now;
+    c->peerLen = (peerLen > sizeof(c->peer)) ? sizeof(c->peer) : peerLen;
+    memcpy(&c->peer, peer, c->peerLen);
+    for (i = hash & l->slotMask; l->slots[i].c; i = (i + 1) & l->slotMask);
+    l->slots[i].hash = hash;
+    l->slots[i].c = c;
+    l->numConns++;
+    c->next = l->conns;
+    if (l->conns) {
+        l->conns->prev = c;
+    } else {
+        l->connsLast = c;
+    }
+    l->conns = c;
+    return c;
+}
+
+/* A Receive posted without a buffer gets one from TAPS now; see
+   protoReceiveBuffer(). The datagram is always here before it is copied
+   out, so nothing goes back. */
+static int
+_udp_receive_buffer(struct udp_conn *c)
+{
+    return protoReceiveBuffer(&c->receive_buffer, &c->iovcnt,
+            &c->receivePosted, c->receive_ctx, c->receiveError);
+}
+
+/* Copy as much of a datagram as fits into the posted Receive */
+static size_t
+_udp_copy_out(struct udp_conn *c, char *data, size_t len)
+{
+    size_t copied = 0, n;
+    int    i;
+
+    for (i = 0; (i < c->iovcnt) && (copied < len); i++) {
+        n = c->receive_buffer[i].iov_len;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(c->receive_buffer[i].iov_base, data + copied, n);
+        copied += n;
+    }
+    return copied;
+}
+
+/* Hand held datagrams to the posted Receive, and keep going while the
+   callback posts another. Receives posted from the callback only mark
+   themselves, so this loops rather than recursing. A datagram bigger than
+   the Receive goes out in pieces, the last of them as the end of the
+   message. */
+static void
+_udp_deliver(struct udp_conn *c)
+{
+    struct listener_ctx *l = c->l;
+    struct udp_held     *h;
+    size_t               bytes;
+    int                  end;
+
+    c->refs++;
+    l->running++;
+    c->receiveLoop = 1;
+    while (c->receivePosted && c->heldFirst) {
+        if (_udp_receive_buffer(c) < 0) {
+            continue;
+        }
+        h = c->heldFirst;
+        bytes = _udp_copy_out(c, h->data + c->heldOffset,
+                h->len - c->heldOffset);
+        c->heldOffset += bytes;
+        end = (c->heldOffset == h->len);
+        if (end) {
+            c->heldFirst = h->next;
+            if (!c->heldFirst) {
+                c->heldLast = NULL;
+            }
+            c->held--;
+            c->heldOffset = 0;
+            free(h);
+        }
+        c->receivePosted = 0;
+        if (end) {
+            (c->received)(c->receive_ctx, c->receive_buffer, bytes);
+        } else {
+            (c->receivedPartial)(c->receive_ctx, c->receive_buffer, bytes);
+        }
+    }
+    c->receiveLoop = 0;
+    _udp_conn_put(c);
+    l->running--;
+    _udp_maybe_teardown(l);
+}
+
+/* Keep a datagram until there is a Receive for it */
+static void
+_udp_hold(struct udp_conn *c, char *data, size_t len)
+{
+    struct udp_held *h;
+
+    if (c->held == TAPS_UDP_CONN_HELD) {
+        return;
+    }
+    h = malloc(sizeof(struct udp_held) + len);
+    if (!h) {
+        return;
+    }
+    h->next = NULL;
+    h->len = len;
+    memcpy(h->data, data, len);
+    if (c->heldLast) {
+        c->heldLast->next = h;
+    } else {
+        c->heldFirst = h;
+    }
+    c->heldLast = h;
+    c->held++;
+}
+
+/* A datagram for c. If its Receive is waiting and nothing is ahead of it,
+   it is copied straight in. If TAPS has no buffer for it, it is held, and
+   _udp_deliver reports the error. */
+static void
+_udp_datagram(struct udp_conn *c, char *data, size_t len)
+{
+    size_t room = 0;
+    int    i;
+
+    if (c->receivePosted && !c->heldFirst && !c->receiveLoop &&
+            (c->receive_buffer || (c->receive_buffer =
+            protoReceiveLend(c->receive_ctx, &c->iovcnt)))) {
+        for (i = 0; i < c->iovcnt; i++) {
+            room += c->receive_buffer[i].iov_len;
+        }
+        if (len <= room) {
+            _udp_copy_out(c, data, len);
+            c->refs++;
+            c->receiveLoop = 1;
+            c->receivePosted = 0;
+            (c->received)(c->receive_ctx, c->receive_buffer, len);
+            c->receiveLoop = 0;
+            _udp_conn_put(c);
+            return;
+        }
+    }
+    _udp_hold(c, data, len);
+    if (c->receivePosted && !c->receiveLoop) {
+        _udp_deliver(c);
+    }
+}
+
+/* Report the new peers found so far. TAPS sees each one before any of its
+   datagrams. */
+static void
+_udp_accepted(struct listener_ctx *l)
+{
+    struct udp_conn *c;
+    int              i, count = l->numPending;
+
+    if (count == 0) {
+        return;
+    }
+    l->numPending = 0;
+    /* The app may stop the listener from its callback */
+    for (i = 0; i < count; i++) {
+        ((struct udp_conn *)l->pending[i])->refs++;
+    }
+    if (l->connectionsReceived) {
+        (l->connectionsReceived)(l->taps_ctx, l->pending, l->pendingTaps,
+                count);
+    } else {
+        for (i = 0; i < count; i++) {
+            l->pendingTaps[i] = (l->connectionReceived)(l->taps_ctx,
+                    l->pending[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        c = l->pending[i];
+        c->taps_ctx = l->pendingTaps[i];
+        if (!c->taps_ctx && !c->closing) {
+            _udp_conn_close(c);
+        }
+        _udp_conn_put(c);
+    }
+}
+
+/* Hand a received buffer to c. If GRO joined several datagrams, each but
+   the last is seg bytes. */
+static void
+_udp_datagrams(struct udp_conn *c, char *data, size_t len, size_t seg)
+{
+    size_t off, n;
+
+    if ((seg == 0) || (seg >= len)) {
+        _udp_datagram(c, data, len);
+        return;
+    }
+    /* The app may close the connection from any of them */
+    c->refs++;
+    for (off = 0; (off < len) && !c->closing; off += n) {
+        n = (len - off < seg) ? len - off : seg;
+        _udp_datagram(c, data + off, n);
+    }
+    _udp_conn_put(c);
+}
+
+static void _udp_conn_read(evutil_socket_t fd, short event, void *arg);
+
+/* Give a busy peer a socket bound to the listener's address and connected to
+   the peer, which the kernel prefers for its datagrams. Anything already
+   queued on the listener's socket still finds the connection in the table,
+   and Sends stay in the listener's batches. */
+static void
+_udp_promote(struct listener_ctx *l, struct udp_conn *c)
+{
+    int one = 1, fd;
+
+    fd = socket(c->peer.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+    if (fd < 0) {
+        return;
+    }
+    if ((setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+            (bind(fd, (struct sockaddr *)&l->local, l->localLen) < 0) ||
+            (connect(fd, (struct sockaddr *)&c->peer, c->peerLen) < 0)) {
+        printf("UDP connected socket failed: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+#ifdef UDP_GRO
+    setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+#endif
+    c->readEvent = event_new(l->base, fd, EV_READ | EV_PERSIST,
+            &_udp_conn_read, c);
+    if (!c->readEvent || (event_add(c->readEvent, NULL) < 0)) {
+        if (c->readEvent) event_free(c->readEvent);
+        c->readEvent = NULL;
+        close(fd);
+    }
+}
+
+/* Activity for a peer: count it toward a connected socket */
+static void
+_udp_heard(struct listener_ctx *l, struct udp_conn *c)
+{
+    _udp_touch(l, c);
+    if (c->epoch != l->epoch) {
+        c->epoch = l->epoch;
+        c->recent = 0;
+    }
+    if ((l->busyDatagrams > 0) && (++c->recent == l->busyDatagrams) &&
+            !c->readEvent) {
+        _udp_promote(l, c);
+    }
+}
+
+/* Sort a datagram out to its peer's connection, making one for a new peer */
+static void
+_udp_dispatch(struct listener_ctx *l, struct sockaddr *peer,
+        socklen_t peerLen, char *data, size_t len, size_t seg)
+{
+    uint32_t         hash = _udp_peer_hash(l, peer);
+    struct udp_conn *c = _udp_conn_find(l, peer, hash);
+
+    if (!c) {
+        if (l->stopped) {
+            return;
+        }
+        if (l->numPending == l->budget) {
+            _udp_accepted(l);
+        }
+        c = _udp_conn_new(l, peer, peerLen, hash);
+        if (!c) {
+            return;
+        }
+        l->pending[l->numPending++] = c;
+    }
+    _udp_heard(l, c);
+    _udp_datagrams(c, data, len, seg);
+}
+
+/* The UDP_GRO segment size of a received buffer, or 0 */
+static size_t
+_udp_gro_size(struct msghdr *h)
+{
+    struct cmsghdr *cm;
+    int             seg;
+
+#ifdef UDP_GRO
+    for (cm = CMSG_FIRSTHDR(h); cm; cm = CMSG_NXTHDR(h, cm)) {
+        if ((cm->cmsg_level == IPPROTO_UDP) && (cm->cmsg_type == UDP_GRO)) {
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            return (seg > 0) ? seg : 0;
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Read what is waiting on fd, a batch of datagrams per system call, up to a
+   budget of calls. c is the peer fd is connected to, or NULL for the
+   listener's socket. */
+static void
+_udp_drain(struct listener_ctx *l, int fd, struct udp_conn *c)
+{
+    struct mmsghdr *m;
+    int             rounds, n, i;
+
+    l->running++;
+    if (c) {
+        c->refs++;
+    }
+    l->now = _udp_now();
+    for (rounds = 0; (rounds < TAPS_UDP_RECEIVE_ROUNDS) && !l->stopped &&
+            !(c && c->closing); rounds++) {
+        for (i = 0; i < TAPS_UDP_BATCH; i++) {
+            l->rcvMsgs[i].msg_hdr.msg_namelen = sizeof(l->rcvAddr[i]);
+            l->rcvMsgs[i].msg_hdr.msg_controllen = sizeof(l->rcvCtl[i]);
+        }
+        n = recvmmsg(fd, l->rcvMsgs, TAPS_UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                printf("UDP recvmmsg failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        for (i = 0; (i < n) && !l->stopped; i++) {
+            m = &l->rcvMsgs[i];
+            if (!c) {
+                _udp_dispatch(l, (struct sockaddr *)&l->rcvAddr[i],
+                        m->msg_hdr.msg_namelen, l->rcvIov[i].iov_base,
+                        m->msg_len, _udp_gro_size(&m->msg_hdr));
+            } else if (!c->closing) {
+                _udp_heard(l, c);
+                _udp_datagrams(c, l->rcvIov[i].iov_base, m->msg_len,
+                        _udp_gro_size(&m->msg_hdr));
+            }
+        }
+        if (!l->stopped) {
+            _udp_accepted(l);
+        }
+        if (n < TAPS_UDP_BATCH) {
+            break;
+        }
+    }
+    if (c) {
+        _udp_conn_put(c);
+    }
+    l->running--;
+    _udp_maybe_teardown(l);
+}
+
+static void
+_udp_read(evutil_socket_t fd, short event, void *arg)
+{
+    TAPS_TRACE();
+    _udp_drain(arg, fd, NULL);
+}
+
+static void
+_udp_conn_read(evutil_socket_t fd, short event, void *arg)
+{
+    struct udp_conn *c = arg;
+
+    TAPS_TRACE();
+    _udp_drain(c->l, fd, c);
+}
+
+/* Close the connections of peers that have gone quiet, oldest first, and
+   start a new interval for counting busy ones */
+static void
+_udp_sweep(evutil_socket_t fd, short event, void *arg)
+{
+    struct listener_ctx *l = arg;
+    struct udp_conn     *c;
+    void                *taps_ctx;
+    int                  evicted = 0;
+
+    TAPS_TRACE();
+    l->now = _udp_now();
+    l->epoch++;
+    l->running++;
+    while ((c = l->connsLast) && !l->stopped &&
+            (l->now - c->lastActive >= l->idleTimeout) &&
+            (evicted++ < TAPS_UDP_EVICT_BUDGET)) {
+        taps_ctx = c->taps_ctx;
+        _udp_conn_close(c);
+        if (taps_ctx) {
+            (l->closed)(taps_ctx);
+        }
+    }
+    l->running--;
+    _udp_maybe_teardown(l);
+}
+
+static size_t
+_udp_send_len(struct udp_send *s)
+{
+    size_t len = 0;
+    int    i;
+
+    for (i = 0; i < s->iovcnt; i++) {
+        len += s->iov[i].iov_len;
+    }
+    return len;
+}
+
+/* Fill in sendmmsg() entry n with the Sends from i on: just Send i, or with
+   GSO, the run of Sends after it to the same peer that are the same size,
+   the last of which may be shorter. Returns how many it took. */
+static int
+_udp_send_entry(struct listener_ctx *l, int n, int i, int *iovUsed)
+{
+    struct udp_send *s = &l->send[i];
+    struct msghdr   *h = &l->sendMsgs[n].msg_hdr;
+    struct cmsghdr  *cm;
+    size_t           seg = _udp_send_len(s), total = seg, len;
+    uint16_t         gso;
+    int              segs = 1, iovcnt = s->iovcnt, j;
+
+    memset(h, 0, sizeof(*h));
+    h->msg_name = &s->c->peer;
+    h->msg_namelen = s->c->peerLen;
+    h->msg_iov = s->iov;
+    h->msg_iovlen = s->iovcnt;
+    if ((seg == 0) || (seg > l->gsoMax)) {
+        return 1;
+    }
+#ifdef UDP_SEGMENT
+    while ((segs < TAPS_UDP_GSO_SEGMENTS) && (i + segs < l->sendCount) &&
+            (l->send[i + segs].c == s->c)) {
+        len = _udp_send_len(&l->send[i + segs]);
+        if ((len == 0) || (len > seg) || (total + len > TAPS_UDP_GSO_BYTES) ||
+                (*iovUsed + iovcnt + l->send[i + segs].iovcnt >
+                TAPS_UDP_SEND_IOV)) {
+            break;
+        }
+        iovcnt += l->send[i + segs].iovcnt;
+        total += len;
+        segs++;
+        if (len < seg) {
+            break;
+        }
+    }
+    if (segs == 1) {
+        return 1;
+    }
+    h->msg_iov = &l->sendIov[*iovUsed];
+    h->msg_iovlen = iovcnt;
+    for (j = 0; j < segs; j++) {
+        memcpy(&l->sendIov[*iovUsed], l->send[i + j].iov,
+                l->send[i + j].iovcnt * sizeof(struct iovec));
+        *iovUsed += l->send[i + j].iovcnt;
+    }
+    gso = seg;
+    h->msg_control = l->sendCtl[n].buf;
+    h->msg_controllen = sizeof(l->sendCtl[n].buf);
+    cm = CMSG_FIRSTHDR(h);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(gso));
+    memcpy(CMSG_DATA(cm), &gso, sizeof(gso));
+#endif
+    return segs;
+}
+
+/* Make the queued Sends, a batch per sendmmsg(), and report each in turn.
+   Sends queued from the callbacks go in the same pass. */
+static void
+_udp_flush(struct listener_ctx *l)
+{
+    struct udp_send  s;
+    int              n, sent, err = 0, iovUsed, i, j;
+
+    l->running++;
+    l->flushing = 1;
+    while ((l->sendFirst < l->sendCount) && !l->writeBlocked) {
+        n = iovUsed = 0;
+        for (i = l->sendFirst; (i < l->sendCount) && (n < TAPS_UDP_BATCH);
+                i += l->sendSegs[n++]) {
+            while ((i < l->sendCount) && l->send[i].c->closing) {
+                i++;
+            }
+            if (i == l->sendCount) {
+                break;
+            }
+            l->sendIdx[n] = i;
+            l->sendSegs[n] = _udp_send_entry(l, n, i, &iovUsed);
+        }
+        if (n == 0) {
+            /* Only Sends for closed connections */
+            while (l->sendFirst < i) {
+                _udp_conn_put(l->send[l->sendFirst++].c);
+            }
+            continue;
+        }
+        sent = sendmmsg(l->fd, l->sendMsgs, n, 0);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == ENOBUFS)) {
+                /* Pick up from here when there's room */
+                l->writeBlocked = 1;
+                event_add(l->writeEvent, NULL);
+                break;
+            }
+            if ((l->sendSegs[0] > 1) && ((errno == EINVAL) ||
+                    (errno == EIO))) {
+                /* Segments bigger than the route's MTU are EINVAL; EIO is a
+                   device that can't checksum them. Try again, smaller or
+                   without GSO. */
+                l->gsoMax = (errno == EINVAL) ?
+                        _udp_send_len(&l->send[l->sendIdx[0]]) - 1 : 0;
+                continue;
+            }
+            /* The first one failed; report it, and carry on with the rest */
+            err = errno;
+            n = 0;
+            sent = 1;
+        }
+        for (i = 0; i < sent; i++) {
+            /* Skip over any closed connection's Sends on the way */
+            while (l->sendFirst < l->sendIdx[i]) {
+                _udp_conn_put(l->send[l->sendFirst++].c);
+            }
+            for (j = 0; j < l->sendSegs[i]; j++) {
+                /* Copied, as the callback may queue another and move the
+                   array */
+                s = l->send[l->sendFirst++];
+                if (!s.c->closing && (n > 0)) {
+                    (s.c->sent)(s.taps_ctx);
+                } else if (!s.c->closing) {
+                    (s.c->sendError)(s.taps_ctx, strerror(err));
+                }
+                _udp_conn_put(s.c);
+            }
+        }
+    }
+    if (l->sendFirst == l->sendCount) {
+        l->sendFirst = l->sendCount = 0;
+    }
+    l->flushing = 0;
+    l->running--;
+    _udp_maybe_teardown(l);
+}
+
+static void
+_udp_flush_event(evutil_socket_t fd, short event, void *arg)
+{
+    struct listener_ctx *l = arg;
+
+    l->flushQueued = 0;
+    _udp_flush(l);
+}
+
+static void
+_udp_writable(evutil_socket_t fd, short event, void *arg)
+{
+    struct listener_ctx *l = arg;
+
+    TAPS_TRACE();
+    l->writeBlocked = 0;
+    _udp_flush(l);
+}
+
+/* Make room for another Send: reuse what has been sent, or grow */
+static int
+_udp_send_grow(struct listener_ctx *l)
+{
+    struct udp_send *send;
+    int              size;
+
+    if ((l->sendFirst > 0) && !l->flushing) {
+        memmove(l->send, l->send + l->sendFirst,
+                (l->sendCount - l->sendFirst) * sizeof(struct udp_send));
+        l->sendCount -= l->sendFirst;
+        l->sendFirst = 0;
+        return 0;
+    }
+    size = (l->sendSize) ? 2 * l->sendSize : TAPS_UDP_INITIAL_SENDS;
+    send = realloc(l->send, size * sizeof(struct udp_send));
+    if (!send) {
+        return -1;
+    }
+    l->send = send;
+    l->sendSize = size;
+    return 0;
+}
+
+static void *
+_udp_listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, int reusePort,
+        ConnectionReceivedCb connectionReceived,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    struct listener_ctx *listener;
+    size_t               addr_size = (local->sa_family == AF_INET) ?
+            sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    struct timeval       sweep = { TAPS_UDP_SWEEP_INTERVAL, 0 };
+    socklen_t            len = sizeof(int);
+    int                  one = 1, gso, i;
+
+    TAPS_TRACE();
+    listener = malloc(sizeof(struct listener_ctx));
+    if (!listener) return NULL;
+    memset(listener, 0, sizeof(struct listener_ctx));
+    listener->fd = -1;
+    listener->base = base;
+    listener->budget = (budget > 0) ? budget : 1;
+    listener->connectionReceived = connectionReceived;
+    listener->connectionsReceived = connectionsReceived;
+    listener->establishmentError = establishmentError;
+    listener->closed = closed;
+    listener->connectionError = connectionError;
+    listener->taps_ctx = taps_ctx;
+    listener->idleTimeout = (peerIdleTimeout > 0) ? peerIdleTimeout :
+            TAPS_UDP_IDLE_TIMEOUT * 1000;
+    listener->busyDatagrams = busyPeerDatagrams;
+    listener->now = _udp_now();
+    listener->localLen = addr_size;
+    memcpy(&listener->local, local, addr_size);
+    evutil_secure_rng_get_bytes(&listener->seed, sizeof(listener->seed));
+    listener->slotMask = TAPS_UDP_INITIAL_SLOTS - 1;
+    listener->slots = calloc(TAPS_UDP_INITIAL_SLOTS, sizeof(struct udp_slot));
+    listener->pending = calloc(listener->budget, sizeof(void *));
+    listener->pendingTaps = calloc(listener->budget, sizeof(void *));
+    listener->rcvBufs = malloc((size_t)TAPS_UDP_BATCH *
+            TAPS_UDP_MAX_DATAGRAM);
+    if (!listener->slots || !listener->pending || !listener->pendingTaps ||
+            !listener->rcvBufs) {
+        goto fail;
+    }
+    for (i = 0; i < TAPS_UDP_BATCH; i++) {
+        listener->rcvIov[i].iov_base = listener->rcvBufs +
+                (size_t)i * TAPS_UDP_MAX_DATAGRAM;
+        listener->rcvIov[i].iov_len = TAPS_UDP_MAX_DATAGRAM;
+        listener->rcvMsgs[i].msg_hdr.msg_name = &listener->rcvAddr[i];
+        listener->rcvMsgs[i].msg_hdr.msg_iov = &listener->rcvIov[i];
+        listener->rcvMsgs[i].msg_hdr.msg_iovlen = 1;
+        listener->rcvMsgs[i].msg_hdr.msg_control = listener->rcvCtl[i].buf;
+    }
+    listener->fd = socket(local->sa_family,
+            SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener->fd < 0) goto fail;
+    /* Shards share the address, and so do busy peers' connected sockets.
+       Linux only lets sockets of the same user join, unlike SO_REUSEADDR,
+       which would let any local process take the listener's datagrams.
+       Otherwise the address is the listener's alone, and a socket already
+       there fails the bind with EADDRINUSE. */
+    if ((reusePort || (listener->busyDatagrams > 0)) &&
+            (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, &one,
+            sizeof(one)) < 0)) {
+        printf("UDP SO_REUSEPORT failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (bind(listener->fd, local, addr_size) < 0) {
+        printf("UDP bind failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    /* Offloads are only an optimization; kernels before 4.18 and 5.0 don't
+       have them */
+#ifdef UDP_SEGMENT
+    if (getsockopt(listener->fd, IPPROTO_UDP, UDP_SEGMENT, &gso, &len) == 0) {
+        listener->gsoMax = TAPS_UDP_GSO_BYTES;
+    }
+#endif
+#ifdef UDP_GRO
+    setsockopt(listener->fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+#endif
+    listener->readEvent = event_new(base, listener->fd, EV_READ | EV_PERSIST,
+            &_udp_read, listener);
+    listener->writeEvent = event_new(base, listener->fd, EV_WRITE,
+            &_udp_writable, listener);
+    listener->flushEvent = event_new(base, -1, 0, &_udp_flush_event,
+            listener);
+    listener->sweepEvent = event_new(base, -1, EV_PERSIST, &_udp_sweep,
+            listener);
+    if (!listener->readEvent || !listener->writeEvent ||
+            !listener->flushEvent || !listener->sweepEvent ||
+            (event_add(listener->readEvent, NULL) < 0) ||
+            (event_add(listener->sweepEvent, &sweep) < 0)) {
+        goto fail;
+    }
+    return listener;
+fail:
+    _udp_teardown(listener);
+    return NULL;
+}
+
+void *
+Listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        ConnectionReceivedCb connectionReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _udp_listen(taps_ctx, base, local, TAPS_UDP_DEFAULT_ACCEPT_BUDGET,
+            0, connectionReceived, NULL, establishmentError, closed,
+            connectionError);
+}
+
+void *
+ListenBatch(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _udp_listen(taps_ctx, base, local, budget, 0, NULL,
+            connectionsReceived, establishmentError, closed, connectionError);
+}
+
+void *
+ListenShard(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        unsigned int budget, ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError)
+{
+    return _udp_listen(taps_ctx, base, local, budget, 1, NULL,
+            connectionsReceived, establishmentError, closed, connectionError);
+}
+
+/* The connections share the listener's socket, so they close with it */
+void
+Stop(void *proto_ctx, StoppedCb cb)
+{
+    struct listener_ctx *l = proto_ctx;
+    struct udp_conn     *c;
+    void                *taps_ctx;
+
+    TAPS_TRACE();
+    l->stopped = 1;
+    l->running++;
+    event_del(l->readEvent);
+    event_del(l->sweepEvent);
+    while ((c = l->conns)) {
+        taps_ctx = c->taps_ctx;
+        _udp_conn_close(c);
+        if (taps_ctx) {
+            (l->closed)(taps_ctx);
+        }
+    }
+    (*cb)(l->taps_ctx);
+    l->running--;
+    _udp_maybe_teardown(l);
+}
+
+unsigned int
+MaxSendWindow(void)
+{
+    return TAPS_UDP_MAX_SEND_WINDOW;
+}
+
+/* Every Send is a datagram of its own */
+int
+MessageBoundaries(void)
+{
+    return 1;
+}
+
+void
+Abort(void *proto_ctx)
+{
+    TAPS_TRACE();
+    _udp_conn_close(proto_ctx);
+}
+
+/* Queue the datagram for the end of this loop iteration, when everything
+   queued by then goes out together */
+int
+Send(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError)
+{
+    struct udp_conn     *c = proto_ctx;
+    struct listener_ctx *l = c->l;
+    struct udp_send     *s;
+
+    TAPS_TRACE();
+    if (!c->sent) {
+        c->sent = sent;
+        c->expired = expired;
+        c->sendError = sendError;
+    }
+    if ((l->sendCount == l->sendSize) && (_udp_send_grow(l) < 0)) {
+        printf("UDP send queue full\n");
+        return -1;
+    }
+    s = &l->send[l->sendCount++];
+    s->c = c;
+    s->taps_ctx = taps_ctx;
+    s->iov = message;
+    s->iovcnt = iovcnt;
+    c->refs++;
+    _udp_touch(l, c);
+    /* A flush on the stack, or one waiting for the socket, picks it up */
+    if (!l->flushing && !l->writeBlocked && !l->flushQueued) {
+        l->flushQueued = 1;
+        event_active(l->flushEvent, EV_TIMEOUT, 0);
+    }
+    return 0;
+}
+
+int
+Receive(void *proto_ctx, void *taps_ctx, struct iovec *iovec, int iovcnt,
+        ReceivedCb received, ReceivedPartialCb receivedPartial,
+        ReceiveErrorCb receiveError)
+{
+    struct udp_conn *c = proto_ctx;
+
+    TAPS_TRACE();
+    if (!c->received) {
+        c->received = received;
+        c->receivedPartial = receivedPartial;
+        c->receiveError = receiveError;
+    }
+    if (c->receivePosted) {
+        printf("Two UDP recv at once\n");
+        return -1;
+    }
+    c->receive_ctx = taps_ctx;
+    c->receive_buffer = iovec;
+    c->iovcnt = iovcnt;
+    c->receivePosted = 1;
+    /* Datagrams may be here already. TAPS does timeouts. */
+    if (!c->receiveLoop) {
+        _udp_deliver(c);
+    }
+    return 0;
+}
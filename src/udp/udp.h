@@ -0,0 +1,49 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+#include "../taps_protocol.h"
+
+/* Wrappers for UDP sockets. Each peer of a listener is a connection. */
+
+void *Listen(void *taps_ctx, struct event_base *base, struct sockaddr *local,
+        ConnectionReceivedCb newConnCb, EstablishmentErrorCb establishmentError,
+        ClosedCb closed, ConnectionErrorCb connectionError);
+void *ListenBatch(void *taps_ctx, struct event_base *base,
+        struct sockaddr *local, unsigned int budget,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError, ClosedCb closed,
+        ConnectionErrorCb connectionError);
+void *ListenShard(void *taps_ctx, struct event_base *base,
+        struct sockaddr *local, unsigned int budget,
+        ConnectionsReceivedCb connectionsReceived,
+        EstablishmentErrorCb establishmentError, ClosedCb closed,
+        ConnectionErrorCb connectionError);
+void Stop(void *proto_ctx, StoppedCb cb);
+unsigned int MaxSendWindow(void);
+int MessageBoundaries(void);
+void SetConnectionMemory(ConnAllocCb alloc, ConnReleaseCb release);
+void SetReceiveBuffers(RecvAllocCb alloc, RecvReleaseCb release);
+void SetPeerIdleTimeout(unsigned int ms);
+void SetBusyPeerDatagrams(unsigned int datagrams);
+void Abort(void *proto_ctx);
+int Send(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError);
+int Receive(void *proto_ctx, void *taps_ctx, struct iovec *message, int iovcnt,
+        ReceivedCb received, ReceivedPartialCb receivedPartial,
+        ReceiveErrorCb receiveError);
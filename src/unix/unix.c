@@ -0,0 +1,178 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* unix.c */
+/* AF_UNIX sockets, for peers on the same host, on the plumbing in
+   tcp/tcp_stream.c. Built as libtaps_unix.so, with stream sockets, and with
+   TAPS_UNIX_SEQPACKET as libtaps_unix_seqpacket.so, with seqpacket sockets,
+   where each Send and Receive is a record. Listeners take a socket path. */
+#define _GNU_SOURCE /* struct ucred */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../taps.h"
+#include "../tcp/tcp_stream.h"
+
+#ifdef TAPS_UNIX_SEQPACKET
+/* Read one record into the posted Receive. Its size is peeked first, and
+   one bigger than the Receive is read whole into c->rest, for the Receive to
+   take the start of. *end is set unless some of it is kept. The listener
+   has SO_PASSCRED, so every record, even an empty one, comes with
+   credentials; 0 without them is the end of the stream, with *end clear. */
+static ssize_t
+_unix_read(struct conn_ctx *c, int *end)
+{
+    char          control[CMSG_SPACE(sizeof(struct ucred))];
+    struct msghdr h;
+    ssize_t       len;
+    size_t        room = 0;
+    int           i;
+
+    *end = 0;
+    memset(&h, 0, sizeof(h));
+    h.msg_control = control;
+    h.msg_controllen = sizeof(control);
+    len = recvmsg(c->fd, &h, MSG_PEEK | MSG_TRUNC);
+    if ((len < 0) || ((len == 0) && (h.msg_controllen == 0))) {
+        return len;
+    }
+    *end = 1;
+    for (i = 0; i < c->iovcnt; i++) {
+        room += c->receive_buffer[i].iov_len;
+    }
+    if ((size_t)len <= room) {
+        return readv(c->fd, c->receive_buffer, c->iovcnt);
+    }
+    /* Without room for the rest, the connection fails rather than lose
+       part of the record */
+    c->rest = malloc(len);
+    if (!c->rest) {
+        errno = ENOMEM;
+        return -1;
+    }
+    len = recv(c->fd, c->rest, len, 0);
+    if (len < 0) {
+        free(c->rest);
+        c->rest = NULL;
+        return -1;
+    }
+    c->restLen = len;
+    c->restOffset = 0;
+    len = tcpStreamRestCopy(c);
+    *end = (c->rest == NULL);
+    return len;
+}
+#endif
+
+/* A socket file left behind by a listener that has gone is in the way of
+   bind(). Only remove it if nothing answers there. */
+static void
+_unix_unlink_stale(struct sockaddr_un *sun)
+{
+    struct stat st;
+    int         fd;
+
+    if ((sun->sun_path[0] == '\0') || (stat(sun->sun_path, &st) < 0) ||
+            !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    fd = socket(AF_UNIX, tcpStreamModule.sockType | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    if ((connect(fd, (struct sockaddr *)sun, sizeof(*sun)) < 0) &&
+            (errno == ECONNREFUSED)) {
+        unlink(sun->sun_path);
+    }
+    close(fd);
+}
+
+static int
+_unix_listen_setup(struct listener_ctx *l)
+{
+    struct sockaddr_un *sun = (struct sockaddr_un *)&l->local;
+#ifdef TAPS_UNIX_SEQPACKET
+    int                 one = 1;
+#endif
+
+    if (sun->sun_family != AF_UNIX) {
+        printf("UNIX listener needs a socket path\n");
+        return -1;
+    }
+    _unix_unlink_stale(sun);
+#ifdef TAPS_UNIX_SEQPACKET
+    /* Accepted sockets inherit it; see _unix_read */
+    if (setsockopt(l->fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) < 0) {
+        printf("UNIX SO_PASSCRED failed: %s\n", strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Only one socket can have a path, so there is no ListenShard(), and it is
+   removed with the listener */
+static void
+_unix_stop(struct listener_ctx *l)
+{
+    struct sockaddr_un *sun = (struct sockaddr_un *)&l->local;
+
+    if (sun->sun_path[0] != '\0') {
+        unlink(sun->sun_path);
+    }
+}
+
+#ifdef TAPS_UNIX_SEQPACKET
+const struct tcp_stream_module tcpStreamModule = {
+    .sockType = SOCK_SEQPACKET,
+    .read = &_unix_read,
+    .listen = &_unix_listen_setup,
+    .stop = &_unix_stop,
+};
+
+/* Every Send is a record of its own. There is no SendFile(), which would
+   split it into several. */
+int
+MessageBoundaries(void)
+{
+    return 1;
+}
+#else
+const struct tcp_stream_module tcpStreamModule = {
+    .sockType = SOCK_STREAM,
+    .read = NULL,
+    .listen = &_unix_listen_setup,
+    .stop = &_unix_stop,
+};
+
+int
+SendFile(void *proto_ctx, void *taps_ctx, int fd, off_t offset, size_t len,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError)
+{
+    TAPS_TRACE();
+    return tcpStreamSend(proto_ctx, taps_ctx, NULL, 0, fd, offset, len, sent,
+            expired, sendError);
+}
+#endif
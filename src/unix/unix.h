@@ -0,0 +1,31 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+#include "../taps_protocol.h"
+
+/* Wrappers for AF_UNIX sockets. tcp/tcp_stream.c supplies the entry points
+   shared with TCP: Listen, ListenBatch, Stop, Abort, Send, Receive and
+   MaxSendWindow; proto/proto_memory.c, SetConnectionMemory and
+   SetReceiveBuffers. */
+
+/* libtaps_unix.so */
+int SendFile(void *proto_ctx, void *taps_ctx, int fd, off_t offset,
+        size_t len, SentCb sent, ExpiredCb expired, SendErrorCb sendError);
+/* libtaps_unix_seqpacket.so */
+int MessageBoundaries(void);
@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <event2/thread.h>
 #include "t.h"
 
 int main(int argc, char *argv[])
@@ -27,6 +28,12 @@ int main(int argc, char *argv[])
     int arg, i;
     bool run;
 
+    /* For the sharded listener tests. libevent needs it before the first
+       event_base, and the earlier tests make some. */
+    if (evthread_use_pthreads() < 0) {
+        printf("evthread_use_pthreads failed\n");
+        return 1;
+    }
     printf("Assembling test manifest...\n");
     for (i = 0; i < NUM_TESTS; i++) {
         run = (argc == 1);
@@ -18,12 +18,28 @@ extern int yamlTest();
 extern int endpointTest();
 extern int transportPropertiesTest();
 extern int preconnectionTest();
+extern int queueTest();
+extern int connectionTest();
+extern int messageTest();
+extern int timerTest();
+extern int tcpTest();
+extern int tcpUringTest();
+extern int udpTest();
+extern int unixTest();
 
 static const struct _test_entry testList[] = {
     { "yaml", yamlTest },
     { "endpoint", endpointTest },
     { "transportProperties", transportPropertiesTest },
     { "preconnection", preconnectionTest},
+    { "queue", queueTest },
+    { "connection", connectionTest },
+    { "message", messageTest },
+    { "timer", timerTest },
+    { "tcp", tcpTest },
+    { "tcp_uring", tcpUringTest },
+    { "udp", udpTest },
+    { "unix", unixTest },
 };
 
 #endif /* _T_H */
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Unit tests for the connection send path, against a fake protocol */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "t.h"
+
+#define TEST_FN(name) if (name) { goto fail; }
+#define NUM_MSGS 8
+
+/* What the fake protocol has been asked to do */
+static struct {
+    int          sends;
+    void        *ctx;
+    void        *ctxs[NUM_MSGS * 32]; /* One per Send */
+    int          iovcnt;
+    size_t       bytes;
+    SentCb       sent;
+    SendErrorCb  sendError;
+    int          receives;
+    void        *rcvCtx;
+    struct iovec *rcvData;
+    int          rcvIovcnt;
+    ReceivedCb   received;
+    ReceivedPartialCb receivedPartial;
+    size_t       sendBufferLow;
+    int          done; /* Finish Sends on the spot */
+} proto;
+
+/* What the app has been told, in order */
+static int appSent[NUM_MSGS * 32], numSent;
+static int appError[NUM_MSGS * 2], numError;
+static size_t appReceived;
+static int appHigh, appLow;
+static int appExpired[NUM_MSGS], numExpired;
+static int appDepth, appMaxDepth, appResend;
+static TAPS_CTX *appConn, *appMsg;
+static tapsCallbacks *appCallbacks;
+
+static int
+_fake_send(void *proto_ctx, void *taps_ctx, struct iovec *data, int iovcnt,
+        SentCb sent, ExpiredCb expired, SendErrorCb sendError)
+{
+    int i;
+
+    proto.ctx = taps_ctx;
+    proto.ctxs[proto.sends++] = taps_ctx;
+    proto.iovcnt = iovcnt;
+    proto.bytes = 0;
+    for (i = 0; i < iovcnt; i++) {
+        proto.bytes += data[i].iov_len;
+    }
+    proto.sent = sent;
+    proto.sendError = sendError;
+    return proto.done;
+}
+
+static int
+_fake_set_property(void *proto_ctx, char *name, void *value, size_t len)
+{
+    if (strcmp(name, "sendBufferLow") != 0) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+    proto.sendBufferLow = *(size_t *)value;
+    return 0;
+}
+
+static void
+_fake_receive(void *proto_ctx, void *taps_ctx, struct iovec *data, int iovcnt,
+        ReceivedCb received, ReceivedPartialCb receivedPartial,
+        ReceiveErrorCb receiveError)
+{
+    proto.receives++;
+    proto.rcvCtx = taps_ctx;
+    proto.rcvData = data;
+    proto.rcvIovcnt = iovcnt;
+    proto.received = received;
+    proto.receivedPartial = receivedPartial;
+}
+
+static void
+_app_sent(void *conn, void *msg)
+{
+    appSent[numSent++] = (int)(intptr_t)msg;
+}
+
+/* Sends again from the callback, as a streaming app would */
+static void
+_app_sent_resend(void *conn, void *msg)
+{
+    _app_sent(conn, msg);
+    if (++appDepth > appMaxDepth) {
+        appMaxDepth = appDepth;
+    }
+    if (appResend > 0) {
+        appResend--;
+        tapsConnectionSend(appConn, appMsg, msg, appCallbacks);
+    }
+    appDepth--;
+}
+
+/* Queues one more, then frees the connection from inside the callback */
+static void
+_app_sent_free(void *conn, void *msg)
+{
+    _app_sent(conn, msg);
+    tapsConnectionSend(appConn, appMsg, (void *)99, appCallbacks);
+    tapsConnectionFree(appConn);
+}
+
+static void
+_app_expired(void *conn, void *msg)
+{
+    appExpired[numExpired++] = (int)(intptr_t)msg;
+}
+
+static void
+_app_send_error(void *conn, void *msg, char *reason)
+{
+    appError[numError++] = (int)(intptr_t)msg;
+}
+
+static void
+_app_send_buffer_high(void *conn)
+{
+    appHigh++;
+}
+
+static void
+_app_send_buffer_low(void *conn)
+{
+    appLow++;
+}
+
+static void
+_app_received(void *conn, void *msg, size_t len)
+{
+    appReceived = len;
+}
+
+static void
+_app_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+}
+
+static void
+_app_receive_error(void *conn, void *msg, char *reason)
+{
+}
+
+static void
+_app_closed(void *conn)
+{
+}
+
+static void
+_app_connection_error(void *conn, char *reason)
+{
+}
+
+int
+connectionTest()
+{
+    int                  result = 0;
+    struct proto_handles handles;
+    tapsCallbacks        callbacks;
+    TAPS_CTX            *c = NULL, *c2;
+    TAPS_CTX            *msg[NUM_MSGS];
+    char                 buf[NUM_MSGS];
+    char                 rcvBuf[16];
+    TAPS_CTX            *rcvMsg = NULL;
+    TAPS_CTX            *group;
+    int                  sends;
+    struct iovec        *iovec;
+    int                  i;
+
+    memset(&proto, 0, sizeof(proto));
+    memset(&handles, 0, sizeof(handles));
+    memset(&callbacks, 0, sizeof(callbacks));
+    memset(msg, 0, sizeof(msg));
+    numSent = numError = 0;
+    appReceived = 0;
+    appHigh = appLow = numExpired = 0;
+    handles.send = &_fake_send;
+    handles.receive = &_fake_receive;
+    handles.maxSendWindow = 4;
+    handles.setProperty = &_fake_set_property;
+    callbacks.sent = &_app_sent;
+    callbacks.sendError = &_app_send_error;
+    callbacks.expired = &_app_expired;
+    callbacks.sendBufferHigh = &_app_send_buffer_high;
+    callbacks.sendBufferLow = &_app_send_buffer_low;
+    callbacks.received = &_app_received;
+    callbacks.receivedPartial = &_app_received_partial;
+    callbacks.receiveError = &_app_receive_error;
+    callbacks.closed = &_app_closed;
+    callbacks.connectionError = &_app_connection_error;
+    for (i = 0; i < NUM_MSGS; i++) {
+        msg[i] = tapsMessageNew(buf, i + 1);
+        if (!msg[i]) goto fail;
+    }
+    c = tapsConnectionNew(&proto, &handles, NULL);
+    if (!c) goto fail;
+    tapsConnectionInitialize(c, NULL, &callbacks);
+    /* No listener, so no timer wheel */
+    if ((tapsConnectionSetIdleTimeout(c, 1000) != -1) ||
+            (errno != EOPNOTSUPP)) {
+        goto fail;
+    }
+
+    /* One message goes straight to the protocol */
+    TEST_FN(tapsConnectionSend(c, msg[0], (void *)0, &callbacks) < 0);
+    if ((proto.sends != 1) || (proto.iovcnt != 1)) goto fail;
+    /* Two more wait behind it, and are then coalesced into one Send */
+    TEST_FN(tapsConnectionSend(c, msg[1], (void *)1, &callbacks) < 0);
+    TEST_FN(tapsConnectionSend(c, msg[2], (void *)2, &callbacks) < 0);
+    if (proto.sends != 1) goto fail;
+    (proto.sent)(proto.ctx);
+    if ((numSent != 1) || (appSent[0] != 0)) goto fail;
+    if ((proto.sends != 2) || (proto.iovcnt != 2) || (proto.bytes != 5)) {
+        goto fail;
+    }
+    (proto.sent)(proto.ctx);
+    if ((numSent != 3) || (appSent[1] != 1) || (appSent[2] != 2)) goto fail;
+
+    /* A batch holds everything until the end */
+    tapsStartBatch(c);
+    for (i = 3; i < 7; i++) {
+        TEST_FN(tapsConnectionSend(c, msg[i], (void *)(intptr_t)i,
+                &callbacks) < 0);
+    }
+    if (proto.sends != 2) goto fail;
+    tapsEndBatch(c);
+    if ((proto.sends != 3) || (proto.iovcnt != 4) || (proto.bytes != 22)) {
+        goto fail;
+    }
+    /* An error on a coalesced send reaches every message in it */
+    (proto.sendError)(proto.ctx, "test");
+    if (numError != 4) goto fail;
+    for (i = 0; i < 4; i++) {
+        if (appError[i] != i + 3) goto fail;
+    }
+    /* The connection is idle again */
+    TEST_FN(tapsConnectionSend(c, msg[7], (void *)7, &callbacks) < 0);
+    if ((proto.sends != 4) || (proto.iovcnt != 1)) goto fail;
+    (proto.sent)(proto.ctx);
+    if ((numSent != 4) || (appSent[3] != 7)) goto fail;
+
+    /* With a window, separate sends go down without waiting */
+    if (tapsConnectionSetSendWindow(c, 8) != 4) goto fail;
+    for (i = 0; i < 3; i++) {
+        TEST_FN(tapsConnectionSend(c, msg[i], (void *)(intptr_t)i,
+                &callbacks) < 0);
+    }
+    if (proto.sends != 7) goto fail;
+    /* Can't resize the window with sends outstanding */
+    if (tapsConnectionSetSendWindow(c, 1) != -1) goto fail;
+    /* Completions match up with their sends, in order */
+    for (i = 0; i < 3; i++) {
+        (proto.sent)(proto.ctxs[4 + i]);
+        if ((numSent != 5 + i) || (appSent[4 + i] != i)) goto fail;
+    }
+
+    /* Watermarks: high at 10 bytes or 4 messages, low at 3 bytes or 1 */
+    if (tapsConnectionSetSendBuffer(c, 3, 2, 0, 0) != -1) goto fail;
+    TEST_FN(tapsConnectionSetSendBuffer(c, 3, 10, 1, 4) < 0);
+    if (proto.sendBufferLow != 3) goto fail;
+    tapsStartBatch(c);
+    for (i = 0; i < 3; i++) {
+        TEST_FN(tapsConnectionSend(c, msg[i], (void *)(intptr_t)i,
+                &callbacks) < 0);
+    }
+    if (appHigh != 0) goto fail;
+    /* 1 + 2 + 3 + 4 bytes */
+    TEST_FN(tapsConnectionSend(c, msg[3], (void *)3, &callbacks) < 0);
+    if (appHigh != 1) goto fail;
+    tapsEndBatch(c);
+    (proto.sent)(proto.ctxs[7]);
+    if ((appLow != 1) || (numSent != 11)) goto fail;
+    /* Only one event per crossing */
+    TEST_FN(tapsConnectionSetSendBuffer(c, 0, 0, 0, 1));
+    TEST_FN(tapsConnectionSend(c, msg[0], (void *)0, &callbacks) < 0);
+    TEST_FN(tapsConnectionSend(c, msg[1], (void *)1, &callbacks) < 0);
+    if (appHigh != 2) goto fail;
+    for (i = 8; i < proto.sends; i++) {
+        (proto.sent)(proto.ctxs[i]);
+    }
+    if ((appLow != 2) || (numSent != 13)) goto fail;
+
+    /* More urgent messages overtake queued ones, but not each other */
+    tapsStartBatch(c);
+    TEST_FN(tapsConnectionSend(c, msg[0], (void *)0, &callbacks) < 0);
+    tapsMessageSetPriority(msg[1], 10);
+    tapsMessageSetPriority(msg[2], 10);
+    TEST_FN(tapsConnectionSend(c, msg[1], (void *)1, &callbacks) < 0);
+    TEST_FN(tapsConnectionSend(c, msg[2], (void *)2, &callbacks) < 0);
+    tapsEndBatch(c);
+    (proto.sent)(proto.ctx);
+    if ((numSent != 16) || (appSent[13] != 1) || (appSent[14] != 2) ||
+            (appSent[15] != 0)) {
+        goto fail;
+    }
+
+    /* Messages that outlive msgLifetime in the queue never reach the
+       protocol */
+    tapsMessageSetLifetime(msg[3], 1);
+    tapsMessageSetLifetime(msg[5], 1000000);
+    tapsStartBatch(c);
+    for (i = 3; i < 6; i++) {
+        TEST_FN(tapsConnectionSend(c, msg[i], (void *)(intptr_t)i,
+                &callbacks) < 0);
+    }
+    usleep(20000);
+    tapsEndBatch(c);
+    if ((numExpired != 1) || (appExpired[0] != 3)) goto fail;
+    if ((proto.iovcnt != 2) || (proto.bytes != 11)) goto fail;
+    (proto.sent)(proto.ctx);
+    if ((numSent != 18) || (appSent[16] != 4) || (appSent[17] != 5)) {
+        goto fail;
+    }
+
+    /* 800 bits/s is 100 bytes/s, with a 2 byte burst. A send may take the
+       bucket into debt, and the next waits until it is paid off. */
+    if (tapsConnectionSetSendRate(c, 1600, 800) != -1) goto fail;
+    TEST_FN(tapsConnectionSetSendRate(c, 0, 800) < 0);
+    sends = proto.sends;
+    TEST_FN(tapsConnectionSend(c, msg[6], (void *)6, &callbacks) < 0);
+    TEST_FN(tapsConnectionSend(c, msg[7], (void *)7, &callbacks) < 0);
+    if (proto.sends != sends + 1) goto fail;
+    usleep(80000);
+    (proto.sent)(proto.ctx);
+    if (proto.sends != sends + 2) goto fail;
+    (proto.sent)(proto.ctx);
+
+    /* The same through a group, until the connection gets a minimum rate */
+    TEST_FN(tapsConnectionSetSendRate(c, 0, 0) < 0);
+    group = tapsRateGroupNew(800);
+    if (!group) goto fail;
+    TEST_FN(tapsConnectionSetRateGroup(c, group) < 0);
+    tapsRateGroupFree(group); /* Lasts while c is in it */
+    TEST_FN(tapsConnectionSend(c, msg[6], (void *)6, &callbacks) < 0);
+    TEST_FN(tapsConnectionSend(c, msg[7], (void *)7, &callbacks) < 0);
+    if (proto.sends != sends + 3) goto fail;
+    TEST_FN(tapsConnectionSetSendRate(c, 8000, 0) < 0);
+    if (proto.sends != sends + 4) goto fail;
+    (proto.sent)(proto.ctxs[sends + 2]);
+    (proto.sent)(proto.ctxs[sends + 3]);
+    if ((numSent != 22) || (appSent[21] != 7)) goto fail;
+    TEST_FN(tapsConnectionSetRateGroup(c, NULL) < 0);
+    TEST_FN(tapsConnectionSetSendRate(c, 0, 0) < 0);
+
+    /* A Send the protocol finishes on the spot is reported before
+       tapsConnectionSend returns. Sends from that callback are picked up
+       by a loop, not by recursing once per message. */
+    proto.done = 1;
+    sends = proto.sends;
+    TEST_FN(tapsConnectionSend(c, msg[0], (void *)0, &callbacks) < 0);
+    if ((proto.sends != sends + 1) || (numSent != 23)) goto fail;
+    callbacks.sent = &_app_sent_resend;
+    appConn = c;
+    appMsg = msg[1];
+    appCallbacks = &callbacks;
+    appResend = 100;
+    appDepth = appMaxDepth = 0;
+    TEST_FN(tapsConnectionSend(c, msg[1], (void *)1, &callbacks) < 0);
+    callbacks.sent = &_app_sent;
+    proto.done = 0;
+    if ((appResend != 0) || (appMaxDepth != 1)) goto fail;
+    if ((proto.sends != sends + 102) || (numSent != 124)) goto fail;
+
+    /* The app may free the connection from that callback. TAPS finishes
+       with it first, and the message queued from the callback fails
+       without reaching the protocol. */
+    c2 = tapsConnectionNew(&proto, &handles, NULL);
+    if (!c2) goto fail;
+    tapsConnectionInitialize(c2, NULL, &callbacks);
+    proto.done = 1;
+    callbacks.sent = &_app_sent_free;
+    appConn = c2;
+    appMsg = msg[2];
+    sends = proto.sends;
+    numError = 0;
+    TEST_FN(tapsConnectionSend(c2, msg[1], (void *)1, &callbacks) < 0);
+    callbacks.sent = &_app_sent;
+    proto.done = 0;
+    if ((proto.sends != sends + 1) || (numSent != 125) || (numError != 1) ||
+            (appError[0] != 99)) {
+        goto fail;
+    }
+
+    /* Reads short of minLength continue in place, where they left off */
+    rcvMsg = tapsMessageNew(rcvBuf, sizeof(rcvBuf));
+    if (!rcvMsg) goto fail;
+    TEST_FN(tapsConnectionReceive(c, NULL, rcvMsg, 8, sizeof(rcvBuf),
+            &callbacks) < 0);
+    if ((proto.receives != 1) || (proto.rcvData->iov_base != rcvBuf)) {
+        goto fail;
+    }
+    (proto.receivedPartial)(proto.rcvCtx, proto.rcvData, 3);
+    if ((proto.receives != 2) || (proto.rcvIovcnt != 1) ||
+            (proto.rcvData->iov_base != rcvBuf + 3) ||
+            (proto.rcvData->iov_len != sizeof(rcvBuf) - 3)) {
+        goto fail;
+    }
+    (proto.receivedPartial)(proto.rcvCtx, proto.rcvData, 2);
+    if ((proto.receives != 3) || (proto.rcvData->iov_base != rcvBuf + 5)) {
+        goto fail;
+    }
+    (proto.received)(proto.rcvCtx, proto.rcvData, 4);
+    if (appReceived != 9) goto fail;
+    /* The message iovec is whole again */
+    iovec = tapsMessageGetIovec(rcvMsg, NULL);
+    if ((iovec->iov_base != rcvBuf) || (iovec->iov_len != sizeof(rcvBuf))) {
+        goto fail;
+    }
+    result = 1;
+fail:
+    TEST_OUTPUT(result);
+    if (!result) {
+        printf("Error: %s\n", strerror(errno));
+    }
+    if (c) tapsConnectionFree(c);
+    if (rcvMsg) tapsMessageFree(rcvMsg);
+    for (i = 0; i < NUM_MSGS; i++) {
+        if (msg[i]) tapsMessageFree(msg[i]);
+    }
+    return result;
+}
@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/un.h>
 #include "t.h"
 
 #define TEST_FN(name) if (name) { goto fail; }
@@ -32,6 +33,7 @@ int endpointTest()
     TAPS_CTX *ep = tapsEndpointNew();
     unsigned char buf[INET6_ADDRSTRLEN];
     struct sockaddr_in sin;
+    struct sockaddr_un sun;
 
     if (ep == NULL) {
         return result;
@@ -43,6 +45,7 @@ int endpointTest()
     TEST_FN(!tapsEndpointWithIPv6Address(ep, "2001:0db8:85a3::8a2e:0370:7334"));
     TEST_FN(!tapsEndpointWithInterface(ep, "eth0"));
     TEST_FN(!tapsEndpointWithProtocol(ep, "UDP"));
+    TEST_FN(!tapsEndpointWithPath(ep, "/tmp/a.sock"));
     /* Skip alias */
     /* Skip Stun Server */
     /* Try to reload them all */
@@ -53,6 +56,7 @@ int endpointTest()
     TEST_FN(tapsEndpointWithIPv6Address(ep, "2001:0db8:85a3::8a2e:0370:7335"));
     TEST_FN(tapsEndpointWithInterface(ep, "eth1"));
     TEST_FN(tapsEndpointWithProtocol(ep, "TCP"));
+    TEST_FN(tapsEndpointWithPath(ep, "/tmp/b.sock"));
 
     /* Verify it's all there */
     sin.sin_family = AF_INET;
@@ -75,6 +79,12 @@ int endpointTest()
     if (strcmp(tapsEndpointGetProperty(ep, "interface", buf), "eth0") != 0) {
         goto fail;
     }
+    if (strcmp(tapsEndpointGetProperty(ep, "path", buf), "/tmp/a.sock") != 0) {
+        goto fail;
+    }
+    sun.sun_family = AF_UNIX;
+    if (tapsEndpointGetAddress(ep, (struct sockaddr *)&sun) < 0) goto fail;
+    if (strcmp(sun.sun_path, "/tmp/a.sock") != 0) goto fail;
     /* XXX Not able to access this right now */
     //if (endp->has_stun || (endp->stun_credentials != NULL)) goto fail;
     result = 1;
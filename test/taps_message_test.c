@@ -0,0 +1,145 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Unit tests for messages and the receive buffer pool */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "t.h"
+
+#define FILE_OFFSET 5000 /* Not on a page boundary */
+#define FILE_LEN    10000
+
+static pthread_barrier_t freed;
+static void             *remoteBuf;
+static int               remoteOk;
+
+/* Take a pooled message, let the main thread free it, and get the same
+   buffer back from this thread's pool */
+static void *
+_message_remote_thread(void *arg)
+{
+    TAPS_CTX **msg = arg;
+    size_t     len;
+
+    *msg = tapsMessageNewPooled(100);
+    remoteBuf = (*msg) ? tapsMessageGetFirstBuf(*msg, &len) : NULL;
+    pthread_barrier_wait(&freed); /* Main thread frees it */
+    pthread_barrier_wait(&freed);
+    remoteOk = remoteBuf && (tapsPoolInUse() == 0);
+    *msg = tapsMessageNewPooled(100);
+    if (!*msg || (tapsMessageGetFirstBuf(*msg, &len) != remoteBuf)) {
+        remoteOk = 0;
+    }
+    if (*msg) tapsMessageFree(*msg);
+    return NULL;
+}
+
+/* A buffer freed on another thread goes back to the pool it came from */
+static int
+_message_remote_free()
+{
+    pthread_t  thread;
+    TAPS_CTX  *msg = NULL;
+    size_t     inUse = tapsPoolInUse();
+
+    remoteOk = 0;
+    if (pthread_barrier_init(&freed, NULL, 2) != 0) {
+        return 0;
+    }
+    if (pthread_create(&thread, NULL, &_message_remote_thread, &msg) != 0) {
+        pthread_barrier_destroy(&freed);
+        return 0;
+    }
+    pthread_barrier_wait(&freed);
+    if (msg) tapsMessageFree(msg);
+    pthread_barrier_wait(&freed);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&freed);
+    /* None of it was charged to this thread */
+    return remoteOk && (tapsPoolInUse() == inUse);
+}
+
+int
+messageTest()
+{
+    int       result = 0;
+    TAPS_CTX *small = NULL, *big = NULL, *again = NULL, *file = NULL;
+    void     *buf, *smallBuf;
+    size_t    len;
+    off_t     offset;
+    char      path[] = "/tmp/taps_message_testXXXXXX";
+    char      data[FILE_OFFSET + FILE_LEN];
+    int       fd = -1, i;
+
+    /* Too big for any class */
+    if (tapsMessageNewPooled(1024 * 1024)) goto fail;
+    if (errno != EMSGSIZE) goto fail;
+
+    small = tapsMessageNewPooled(100);
+    big = tapsMessageNewPooled(40000);
+    if (!small || !big) goto fail;
+    smallBuf = tapsMessageGetFirstBuf(small, &len);
+    if (len != 100) goto fail;
+    buf = tapsMessageGetFirstBuf(big, &len);
+    if (len != 40000) goto fail;
+    /* Buffers are usable and don't overlap */
+    memset(smallBuf, 0xaa, 100);
+    memset(buf, 0x55, len);
+    if (((unsigned char *)smallBuf)[99] != 0xaa) goto fail;
+
+    /* Truncating doesn't lose track of the pool buffer, which is recycled */
+    tapsMessageTruncate(small, 10);
+    tapsMessageFree(small);
+    small = NULL;
+    again = tapsMessageNewPooled(200);
+    if (!again) goto fail;
+    if (tapsMessageGetFirstBuf(again, &len) != smallBuf) goto fail;
+    if (!_message_remote_free()) goto fail;
+
+    /* File-backed messages are only mapped when something wants the bytes */
+    if (tapsMessageGetFile(again, NULL, NULL) >= 0) goto fail;
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = i % 253;
+    }
+    fd = mkstemp(path);
+    if (fd < 0) goto fail;
+    unlink(path);
+    if (write(fd, data, sizeof(data)) != sizeof(data)) goto fail;
+    file = tapsMessageNewFile(fd, FILE_OFFSET, FILE_LEN);
+    if (!file) goto fail;
+    if (tapsMessageGetFile(file, &offset, &len) != fd) goto fail;
+    if ((offset != FILE_OFFSET) || (len != FILE_LEN)) goto fail;
+    tapsMessageTruncate(file, FILE_LEN - 1);
+    buf = tapsMessageGetFirstBuf(file, &len);
+    if (!buf || (len != FILE_LEN - 1)) goto fail;
+    if (memcmp(buf, data + FILE_OFFSET, len) != 0) goto fail;
+    result = 1;
+fail:
+    TEST_OUTPUT(result);
+    if (file) tapsMessageFree(file);
+    if (fd >= 0) close(fd);
+    if (small) tapsMessageFree(small);
+    if (big) tapsMessageFree(big);
+    if (again) tapsMessageFree(again);
+    return result;
+}
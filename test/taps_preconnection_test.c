@@ -61,11 +61,21 @@ int preconnectionTest()
     if (pc->local[0] != local) goto fail;
     if (pc->numLocal != 1) goto fail;
     if (pc->numRemote != 0) goto fail;
-    if (pc->numProtocols != 1) goto fail;
+    /* kernel.yaml first, then tcp_uring.yaml, then unix.yaml */
+    if (pc->numProtocols != 4) goto fail;
     if (strcmp(pc->protocol[0].name, "_kernel_TCP") != 0) goto fail;
     if (strcmp(pc->protocol[0].protocol, "TCP") != 0) goto fail;
     if (strcmp(pc->protocol[0].libpath,
                 "/usr/lib/x86_64-linux-gnu/libtaps_tcp.so") != 0) goto fail;
+    if (strcmp(pc->protocol[1].name, "_kernel_TCP_uring") != 0) goto fail;
+    if (strcmp(pc->protocol[1].libpath,
+                "/usr/lib/x86_64-linux-gnu/libtaps_tcp_uring.so") != 0) {
+        goto fail;
+    }
+    if (pc->protocol[0].byPath || pc->protocol[1].byPath) goto fail;
+    if (strcmp(pc->protocol[2].name, "_kernel_UNIX") != 0) goto fail;
+    if (strcmp(pc->protocol[3].name, "_kernel_UNIX_seqpacket") != 0) goto fail;
+    if (!pc->protocol[2].byPath || !pc->protocol[3].byPath) goto fail;
     if (pc->transport != tp) goto fail;
     if (pc->security != NULL) goto fail;
     result = 1;
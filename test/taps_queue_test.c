@@ -0,0 +1,157 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Unit tests for the ring queue and slab allocator */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "t.h"
+
+#define ITEM_SIZE   80 /* About the size of a send item */
+#define QUEUE_DEPTH 4
+#define ITERATIONS  1000000
+
+static double
+_elapsed_ns(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+            (double)(now.tv_nsec - start->tv_nsec);
+}
+
+/* Compare the steady-state cost of the slab and ring against malloc/free
+   with a linked list, at a typical per-connection queue depth. */
+static void
+_queue_benchmark(void)
+{
+    struct timespec start;
+    tapsSlab        slab;
+    tapsRing        ring;
+    void           *list[QUEUE_DEPTH];
+    void           *item;
+    int             i, j;
+
+    tapsSlabInit(&slab, ITEM_SIZE, 8);
+    RING_INIT(&ring);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            tapsRingPush(&ring, tapsSlabAlloc(&slab));
+        }
+        while ((item = tapsRingPop(&ring))) {
+            tapsSlabFree(&slab, item);
+        }
+    }
+    printf("slab+ring: %.1f ns/item\n",
+            _elapsed_ns(&start) / (ITERATIONS * QUEUE_DEPTH));
+    tapsRingFree(&ring);
+    tapsSlabDestroy(&slab);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            list[j] = malloc(ITEM_SIZE);
+            /* Touch it, like ADD_ITEM linking it in */
+            *(void **)list[j] = (j > 0) ? list[j - 1] : NULL;
+        }
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            free(list[j]);
+        }
+    }
+    printf("malloc+list: %.1f ns/item\n",
+            _elapsed_ns(&start) / (ITERATIONS * QUEUE_DEPTH));
+}
+
+int
+queueTest()
+{
+    int       result = 0;
+    tapsRing  ring;
+    tapsSlab  slab;
+    void     *items[100];
+    void     *chunks;
+    int       i;
+
+    RING_INIT(&ring);
+    tapsSlabInit(&slab, ITEM_SIZE, 8);
+    if (!RING_EMPTY(&ring) || tapsRingPop(&ring)) goto fail;
+    /* Wrap the ring around before it has to grow */
+    for (i = 0; i < 6; i++) {
+        if (tapsRingPush(&ring, (void *)(intptr_t)(i + 1)) < 0) goto fail;
+    }
+    for (i = 0; i < 6; i++) {
+        if (tapsRingPop(&ring) != (void *)(intptr_t)(i + 1)) goto fail;
+    }
+    /* Grow while wrapped, and check FIFO order is preserved */
+    for (i = 0; i < 100; i++) {
+        if (tapsRingPush(&ring, (void *)(intptr_t)(i + 1)) < 0) goto fail;
+        if (RING_LAST(&ring) != (void *)(intptr_t)(i + 1)) goto fail;
+    }
+    if (RING_COUNT(&ring) != 100) goto fail;
+    if (RING_AT(&ring, 42) != (void *)43) goto fail;
+    for (i = 0; i < 100; i++) {
+        if (tapsRingPop(&ring) != (void *)(intptr_t)(i + 1)) goto fail;
+    }
+    if (!RING_EMPTY(&ring)) goto fail;
+
+    /* Insert into the middle of a wrapped ring: 1 2 4 5 -> 1 2 3 4 5 */
+    for (i = 0; i < 26; i++) { /* first is now 126 of 128 */
+        tapsRingPush(&ring, NULL);
+        tapsRingPop(&ring);
+    }
+    for (i = 1; i <= 5; i++) {
+        if ((i != 3) && (tapsRingPush(&ring, (void *)(intptr_t)i) < 0)) {
+            goto fail;
+        }
+    }
+    if (tapsRingInsert(&ring, 2, (void *)3) < 0) goto fail;
+    for (i = 1; i <= 5; i++) {
+        if (tapsRingPop(&ring) != (void *)(intptr_t)i) goto fail;
+    }
+
+    /* Slab items must be distinct and usable */
+    for (i = 0; i < 100; i++) {
+        items[i] = tapsSlabAlloc(&slab);
+        if (!items[i]) goto fail;
+        memset(items[i], i, ITEM_SIZE);
+    }
+    for (i = 0; i < 100; i++) {
+        if (((unsigned char *)items[i])[ITEM_SIZE - 1] != i) goto fail;
+    }
+    /* Recycling must not allocate new chunks */
+    chunks = slab.chunks;
+    for (i = 0; i < 100; i++) {
+        tapsSlabFree(&slab, items[i]);
+    }
+    for (i = 0; i < 100; i++) {
+        items[i] = tapsSlabAlloc(&slab);
+    }
+    if (slab.chunks != chunks) goto fail;
+
+    _queue_benchmark();
+    result = 1;
+fail:
+    TEST_OUTPUT(result);
+    tapsRingFree(&ring);
+    tapsSlabDestroy(&slab);
+    return result;
+}
@@ -0,0 +1,1129 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Tests of the installed TCP modules, over loopback */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include "t.h"
+
+#define TCP_TEST_PORT   5557
+#define NUM_MSGS        3
+#define MSG_SIZE        (2 * 1024 * 1024)
+#define READ_CHUNK      (32 * 1024)
+#define RCV_CHUNK       16
+#define NUM_IDLE        64
+#define IDLE_RCV_SIZE   1024
+#define MAX_IDLE_BYTES  1664 /* Heap, with TAPS and libevent; 1568 on glibc */
+#define NUM_PINGS       1000
+#define PING_SIZE       64
+#define RCV_TIMEOUT     20 /* ms */
+#define TCP_LIB         "/usr/lib/x86_64-linux-gnu/libtaps_tcp.so"
+#define TCP_URING_LIB   "/usr/lib/x86_64-linux-gnu/libtaps_tcp_uring.so"
+
+static struct event_base *base;
+static TAPS_CTX          *listener, *server;
+static tapsCallbacks      callbacks;
+static unsigned char     *bufs[NUM_MSGS];
+static int                fileFd = -1;
+static int                numSent, failed, stopped;
+static size_t             clientBytes, bytesAtSent[NUM_MSGS];
+static int                client = -1;
+static unsigned char      rcvData[RCV_CHUNK * 4];
+static size_t             rcvBytes;
+static int                numReceived;
+static int                idleMode, numIdle;
+
+static void
+_test_sent(void *conn, void *msg)
+{
+    bytesAtSent[numSent++] = clientBytes;
+    tapsMessageFree(msg);
+}
+
+static void
+_test_send_error(void *conn, void *msg, char *reason)
+{
+    failed = 1;
+    tapsMessageFree(msg);
+}
+
+static void
+_test_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+    size_t bufLen;
+    void  *buf = tapsMessageGetFirstBuf(msg, &bufLen);
+
+    numReceived++;
+    if (rcvBytes + len <= sizeof(rcvData)) {
+        memcpy(rcvData + rcvBytes, buf, len);
+    }
+    rcvBytes += len;
+    tapsMessageFree(msg);
+    if ((rcvBytes < sizeof(rcvData)) && (tapsConnectionReceive(server, NULL,
+            NULL, 0, RCV_CHUNK, &callbacks) < 0)) {
+        failed = 1;
+    }
+}
+
+static void
+_test_received(void *conn, void *msg, size_t len)
+{
+    _test_received_partial(conn, msg, len, 1);
+}
+
+static void
+_test_receive_error(void *conn, void *msg, char *reason)
+{
+    /* Idle connections still have their Receive posted when they close */
+    if (!idleMode) failed = 1;
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_test_establishment_error(void *l, char *reason)
+{
+    failed = 1;
+}
+
+static void
+_test_closed(void *conn)
+{
+    if (conn != server) {
+        tapsConnectionFree(conn);
+        numIdle--;
+        return;
+    }
+    tapsConnectionFree(server);
+    server = NULL;
+    tapsListenerStop(listener, &callbacks);
+}
+
+static void
+_test_connection_error(void *conn, char *reason)
+{
+    failed = 1;
+    _test_closed(conn);
+}
+
+static void
+_test_stopped(void *l)
+{
+    stopped = 1;
+    event_base_loopbreak(base);
+}
+
+static void *
+_test_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    TAPS_CTX *msg;
+    int       i;
+
+    *cb = &callbacks;
+    if (idleMode) {
+        /* Waiting for a request, as a server would */
+        numIdle++;
+        if (tapsConnectionReceive(conn, NULL, NULL, 0, IDLE_RCV_SIZE,
+                &callbacks) < 0) {
+            failed = 1;
+        }
+        return conn;
+    }
+    server = conn;
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &callbacks) < 0) {
+        failed = 1;
+    }
+    tapsConnectionSetSendWindow(conn, NUM_MSGS);
+    for (i = 0; i < NUM_MSGS; i++) {
+        /* The middle one goes out with sendfile() */
+        msg = (i == 1) ? tapsMessageNewFile(fileFd, 0, MSG_SIZE) :
+                tapsMessageNew(bufs[i], MSG_SIZE);
+        if (!msg || (tapsConnectionSend(conn, msg, msg, &callbacks) < 0)) {
+            failed = 1;
+        }
+    }
+    return conn;
+}
+
+/* The peer takes a little at a time, so the server's writes come up short */
+static void
+_test_slow_read(evutil_socket_t fd, short event, void *arg)
+{
+    unsigned char buf[READ_CHUNK];
+    ssize_t       bytes, i;
+
+    bytes = read(client, buf, sizeof(buf));
+    if (bytes <= 0) {
+        return;
+    }
+    for (i = 0; i < bytes; i++) {
+        if (buf[i] != (unsigned char)((clientBytes + i) % 251)) {
+            failed = 1;
+        }
+    }
+    /* Switch to zero-copy partway through. Over loopback the kernel copies
+       anyway and says so, but the writes until then have to wait for their
+       notifications before they can be reported. */
+    if ((clientBytes < MSG_SIZE) && (clientBytes + bytes >= MSG_SIZE) &&
+            (tapsConnectionSetZeroCopy(server, MSG_SIZE) < 0)) {
+        failed = 1;
+    }
+    clientBytes += bytes;
+    if (clientBytes == NUM_MSGS * MSG_SIZE) {
+        close(client);
+        client = -1;
+        event_del(arg);
+    }
+}
+
+/* The server's end of the client connection, found by its peer address */
+static int
+_test_server_fd(void)
+{
+    struct sockaddr_in local, peer;
+    socklen_t          len = sizeof(local);
+    int                fd;
+
+    if (getsockname(client, (struct sockaddr *)&local, &len) < 0) {
+        return -1;
+    }
+    for (fd = 0; fd < 1024; fd++) {
+        len = sizeof(peer);
+        if ((fd != client) &&
+                (getpeername(fd, (struct sockaddr *)&peer, &len) == 0) &&
+                (peer.sin_family == AF_INET) &&
+                (peer.sin_port == local.sin_port)) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int
+_test_sockopt(int fd, int level, int name)
+{
+    int       value;
+    socklen_t len = sizeof(value);
+
+    return (getsockopt(fd, level, name, &value, &len) < 0) ? -1 : value;
+}
+
+/* Memory held per accepted connection that is waiting for a request. The
+   Receive is posted without a buffer, and none comes from the pool until
+   there is data. */
+static int
+_test_idle_benchmark(void)
+{
+    struct sockaddr_in sin;
+    struct mallinfo2   before, after;
+    size_t             pooled = tapsPoolInUse(), perConn;
+    int                fds[NUM_IDLE];
+    int                i, result = 0;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < NUM_IDLE; i++) {
+        fds[i] = -1;
+    }
+    idleMode = 1;
+    before = mallinfo2();
+    for (i = 0; i < NUM_IDLE; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if ((fds[i] < 0) ||
+                (connect(fds[i], (struct sockaddr *)&sin, sizeof(sin)) < 0)) {
+            goto fail;
+        }
+    }
+    while ((numIdle < NUM_IDLE) && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    after = mallinfo2();
+    if (tapsPoolInUse() != pooled) {
+        printf("Idle connections hold %zu pool buffers\n",
+                tapsPoolInUse() - pooled);
+        goto fail;
+    }
+    /* A malloc that isn't glibc's, such as ASan's, reports nothing */
+    if (after.uordblks <= before.uordblks) {
+        printf("idle TCP connection: heap use not measurable, skipped\n");
+    } else {
+        perConn = (after.uordblks - before.uordblks) / NUM_IDLE;
+        printf("idle TCP connection: %zu bytes\n", perConn);
+        if (perConn > MAX_IDLE_BYTES) goto fail;
+    }
+    result = 1;
+fail:
+    for (i = 0; i < NUM_IDLE; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    while ((numIdle > 0) && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    idleMode = 0;
+    return result;
+}
+
+static void
+_test_timeout(evutil_socket_t fd, short event, void *arg)
+{
+    printf("TCP test timed out with %lu bytes read\n", clientBytes);
+    failed = 1;
+    event_base_loopbreak(base);
+}
+
+/* Run the tests against the module at libpath, or through a preconnection
+   if it is NULL */
+static int
+_tcp_test(char *libpath)
+{
+    int                 result = 0;
+    TAPS_CTX           *ep = NULL, *tp = NULL, *pc = NULL;
+    struct event       *reader = NULL, *timeout = NULL;
+    struct timeval      tick = { 0, 1000 }, limit = { 10, 0 };
+    struct sockaddr_in  sin;
+    char                path[] = "/tmp/taps_tcp_testXXXXXX";
+    int                 rcvbuf = 4096, fd, i, j;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.connectionReceived = &_test_connection_received;
+    callbacks.establishmentError = &_test_establishment_error;
+    callbacks.stopped = &_test_stopped;
+    callbacks.sent = &_test_sent;
+    callbacks.sendError = &_test_send_error;
+    callbacks.received = &_test_received;
+    callbacks.receivedPartial = &_test_received_partial;
+    callbacks.receiveError = &_test_receive_error;
+    callbacks.closed = &_test_closed;
+    callbacks.connectionError = &_test_connection_error;
+    listener = server = NULL;
+    numSent = failed = stopped = 0;
+    clientBytes = rcvBytes = 0;
+    numReceived = numIdle = idleMode = 0;
+    for (i = 0; i < sizeof(rcvData); i++) {
+        rcvData[i] = i;
+    }
+    for (i = 0; i < NUM_MSGS; i++) {
+        bufs[i] = malloc(MSG_SIZE);
+        if (!bufs[i]) goto fail;
+        for (j = 0; j < MSG_SIZE; j++) {
+            bufs[i][j] = ((size_t)i * MSG_SIZE + j) % 251;
+        }
+    }
+    fileFd = mkstemp(path);
+    if (fileFd < 0) goto fail;
+    unlink(path);
+    if (write(fileFd, bufs[1], MSG_SIZE) != MSG_SIZE) goto fail;
+    base = event_base_new();
+    ep = tapsEndpointNew();
+    tp = tapsTransportPropertiesNew(TAPS_LISTENER);
+    if (!base || !ep || !tp) goto fail;
+    if (!tapsEndpointWithPort(ep, TCP_TEST_PORT)) goto fail;
+    if (!tapsEndpointWithIPv4Address(ep, "127.0.0.1")) goto fail;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (libpath) {
+        listener = tapsListenerNew(NULL, libpath, (struct sockaddr *)&sin,
+                &base, 1, &callbacks);
+    } else {
+        pc = tapsPreconnectionNew(&ep, 1, NULL, 0, tp, NULL);
+        if (!pc) goto fail;
+        listener = tapsPreconnectionListen(pc, NULL, base, &callbacks);
+    }
+    if (!listener) goto fail;
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (client < 0) goto fail;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (connect(client, (struct sockaddr *)&sin, sizeof(sin)) < 0) goto fail;
+    timeout = evtimer_new(base, &_test_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+
+    /* Pipelined requests are already waiting when the connection is
+       accepted, so they are all read without going back to the loop */
+    if (write(client, rcvData, sizeof(rcvData)) != sizeof(rcvData)) goto fail;
+    memset(rcvData, 0, sizeof(rcvData));
+    while (!server && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    if ((numReceived != sizeof(rcvData) / RCV_CHUNK) ||
+            (rcvBytes != sizeof(rcvData))) {
+        goto fail;
+    }
+    for (i = 0; i < sizeof(rcvData); i++) {
+        if (rcvData[i] != i) goto fail;
+    }
+
+    /* Connection properties become socket options */
+    if (tapsConnectionSetKeepAlive(server, 30) < 0) goto fail;
+    if (tapsConnectionSetUserTimeout(server, 20000) < 0) goto fail;
+    if (tapsConnectionSetCapacityProfile(server, TAPS_INTERACTIVE_CAP) < 0) {
+        goto fail;
+    }
+    fd = _test_server_fd();
+    if (fd < 0) goto fail;
+    if ((_test_sockopt(fd, SOL_SOCKET, SO_KEEPALIVE) != 1) ||
+            (_test_sockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE) != 30) ||
+            (_test_sockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL) != 30) ||
+            (_test_sockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT) != 20000) ||
+            (_test_sockopt(fd, IPPROTO_TCP, TCP_NODELAY) != 1) ||
+            (_test_sockopt(fd, IPPROTO_IP, IP_TOS) != 0x80) ||
+            (_test_sockopt(fd, SOL_SOCKET, SO_PRIORITY) != 6)) {
+        goto fail;
+    }
+    if (tapsConnectionSetKeepAlive(server, 0) < 0) goto fail;
+    if (_test_sockopt(fd, SOL_SOCKET, SO_KEEPALIVE) != 0) goto fail;
+
+    if (!_test_idle_benchmark()) goto fail;
+
+    fcntl(client, F_SETFL, O_NONBLOCK);
+    reader = event_new(base, -1, EV_PERSIST, &_test_slow_read,
+            event_self_cbarg());
+    if (!reader) goto fail;
+    event_add(reader, &tick);
+    event_base_dispatch(base);
+
+    if (failed || !stopped || (numSent != NUM_MSGS)) goto fail;
+    if (clientBytes != NUM_MSGS * MSG_SIZE) goto fail;
+    /* More than the socket buffers hold, so the last one can't have been
+       reported before the peer started reading */
+    for (i = 1; i < NUM_MSGS; i++) {
+        if (bytesAtSent[i] < bytesAtSent[i - 1]) goto fail;
+    }
+    if (bytesAtSent[NUM_MSGS - 1] == 0) goto fail;
+    result = 1;
+fail:
+    if (client >= 0) close(client);
+    if (server) tapsConnectionFree(server);
+    if (listener && stopped) tapsListenerFree(listener);
+    if (reader) event_free(reader);
+    if (timeout) event_free(timeout);
+    if (pc) tapsPreconnectionFree(pc);
+    if (ep) tapsEndpointFree(ep);
+    if (tp) tapsTransportPropertiesFree(tp);
+    if (base) event_base_free(base);
+    if (fileFd >= 0) close(fileFd);
+    fileFd = -1;
+    for (i = 0; i < NUM_MSGS; i++) {
+        free(bufs[i]);
+    }
+    return result;
+}
+
+/* The echo server for the syscall benchmark */
+static TAPS_CTX      *pingServer;
+static tapsCallbacks  pingCallbacks;
+static int            numPongs;
+static unsigned char  pong[PING_SIZE];
+static char           pingOut[1 << 20];
+
+static void
+_ping_sent(void *conn, void *msg)
+{
+    numPongs++;
+    tapsMessageFree(msg);
+}
+
+static void
+_ping_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+    TAPS_CTX *reply = tapsMessageNew(pong, len);
+
+    tapsMessageFree(msg);
+    if (!reply ||
+            (tapsConnectionSend(pingServer, reply, reply, &pingCallbacks) < 0) ||
+            (tapsConnectionReceive(pingServer, NULL, NULL, 0, PING_SIZE,
+            &pingCallbacks) < 0)) {
+        failed = 1;
+    }
+}
+
+static void
+_ping_received(void *conn, void *msg, size_t len)
+{
+    _ping_received_partial(conn, msg, len, 1);
+}
+
+static void
+_ping_error(void *conn, void *msg, char *reason)
+{
+    failed = 1;
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_ping_connection_error(void *conn, char *reason)
+{
+    failed = 1;
+}
+
+static void
+_ping_closed(void *conn)
+{
+}
+
+static void *
+_ping_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    *cb = &pingCallbacks;
+    pingServer = conn;
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, PING_SIZE,
+            &pingCallbacks) < 0) {
+        failed = 1;
+    }
+    return conn;
+}
+
+/* Ping-pong through the module at libpath, with getppid() either side of
+   the part to count. Runs in a child being traced. */
+static int
+_ping_child(char *libpath)
+{
+    struct sockaddr_in sin;
+    unsigned char      ping[PING_SIZE];
+    ssize_t            bytes;
+    size_t             got;
+    int                fd, i;
+
+    /* Keep the module's output out of the count, and out of the way */
+    if (!freopen("/dev/null", "w", stdout)) {
+        return 1;
+    }
+    setvbuf(stdout, pingOut, _IOFBF, sizeof(pingOut));
+    memset(&pingCallbacks, 0, sizeof(pingCallbacks));
+    pingCallbacks.connectionReceived = &_ping_connection_received;
+    pingCallbacks.sent = &_ping_sent;
+    pingCallbacks.sendError = &_ping_error;
+    pingCallbacks.received = &_ping_received;
+    pingCallbacks.receivedPartial = &_ping_received_partial;
+    pingCallbacks.receiveError = &_ping_error;
+    pingCallbacks.closed = &_ping_closed;
+    pingCallbacks.connectionError = &_ping_connection_error;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT + 1);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    base = event_base_new();
+    if (!base || !tapsListenerNew(NULL, libpath, (struct sockaddr *)&sin,
+            &base, 1, &pingCallbacks)) {
+        return 1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ((fd < 0) || (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)) {
+        return 1;
+    }
+    while (!pingServer && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    memset(ping, 1, sizeof(ping));
+    getppid();
+    for (i = 0; (i < NUM_PINGS) && !failed; i++) {
+        if (write(fd, ping, sizeof(ping)) != sizeof(ping)) {
+            return 1;
+        }
+        while ((numPongs == i) && !failed) {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+        for (got = 0; got < sizeof(ping); got += bytes) {
+            bytes = read(fd, ping, sizeof(ping) - got);
+            if (bytes <= 0) {
+                return 1;
+            }
+        }
+    }
+    getppid();
+    return failed;
+}
+
+/* System calls per round trip through the module, counted with ptrace, or
+   -1 if that isn't possible here */
+static double
+_tcp_syscall_bench(char *libpath)
+{
+    struct __ptrace_syscall_info info;
+    long                         count = 0;
+    int                          status, sig = 0, markers = 0;
+    pid_t                        pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            _exit(2);
+        }
+        raise(SIGSTOP);
+        _exit(_ping_child(libpath));
+    }
+    if ((waitpid(pid, &status, 0) < 0) || !WIFSTOPPED(status) ||
+            (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+            PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) < 0)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    for (;;) {
+        if ((ptrace(PTRACE_SYSCALL, pid, NULL, sig) < 0) ||
+                (waitpid(pid, &status, 0) < 0)) {
+            return -1;
+        }
+        sig = 0;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            sig = WSTOPSIG(status);
+            continue;
+        }
+        if ((ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0) &&
+                (info.op == PTRACE_SYSCALL_INFO_ENTRY)) {
+            if (info.entry.nr == SYS_getppid) {
+                markers++;
+            } else if (markers == 1) {
+                count++;
+            }
+        }
+    }
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0) || (markers != 2)) {
+        return -1;
+    }
+    return (double)count / NUM_PINGS;
+}
+
+/* A receive timeout, where the app frees the connection from receiveError.
+   The receive queued behind it fails too, and nothing is reported after the
+   free but that. */
+static TAPS_CTX      *timeoutServer;
+static tapsCallbacks  timeoutCallbacks;
+static int            timedOut, died, connErrors;
+
+static void
+_timeout_receive_error(void *conn, void *msg, char *reason)
+{
+    if (msg) tapsMessageFree(msg);
+    if (strcmp(reason, "Receive timed out") == 0) {
+        timedOut++;
+    } else if (strcmp(reason, "Connection died") == 0) {
+        died++;
+    }
+    if (timeoutServer) {
+        tapsConnectionFree(timeoutServer);
+        timeoutServer = NULL;
+        tapsListenerStop(listener, &timeoutCallbacks);
+    }
+}
+
+static void
+_timeout_connection_error(void *conn, char *reason)
+{
+    connErrors++;
+}
+
+static void *
+_timeout_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    *cb = &timeoutCallbacks;
+    timeoutServer = conn;
+    if ((tapsConnectionSetReceiveTimeout(conn, RCV_TIMEOUT) < 0) ||
+            (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &timeoutCallbacks) < 0) ||
+            (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &timeoutCallbacks) < 0)) {
+        failed = 1;
+    }
+    return conn;
+}
+
+static int
+_tcp_timeout_test(char *libpath)
+{
+    struct sockaddr_in sin;
+    struct event      *timeout = NULL;
+    struct timeval     limit = { 10, 0 };
+    int                fd = -1, result = 0;
+
+    memset(&timeoutCallbacks, 0, sizeof(timeoutCallbacks));
+    timeoutCallbacks.connectionReceived = &_timeout_connection_received;
+    timeoutCallbacks.establishmentError = &_test_establishment_error;
+    timeoutCallbacks.stopped = &_test_stopped;
+    timeoutCallbacks.received = &_test_received;
+    timeoutCallbacks.receivedPartial = &_test_received_partial;
+    timeoutCallbacks.receiveError = &_timeout_receive_error;
+    timeoutCallbacks.closed = &_test_closed;
+    timeoutCallbacks.connectionError = &_timeout_connection_error;
+    timeoutServer = NULL;
+    failed = stopped = timedOut = died = connErrors = 0;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT + 3);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    base = event_base_new();
+    if (!base) goto fail;
+    listener = tapsListenerNew(NULL, libpath, (struct sockaddr *)&sin, &base,
+            1, &timeoutCallbacks);
+    if (!listener) goto fail;
+    timeout = evtimer_new(base, &_test_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ((fd < 0) || (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)) {
+        goto fail;
+    }
+    /* The client never writes */
+    event_base_dispatch(base);
+    if (failed || !stopped || (timedOut != 1) || (died != 1) ||
+            (connErrors != 0)) {
+        goto fail;
+    }
+    result = 1;
+fail:
+    if (fd >= 0) close(fd);
+    if (listener && stopped) tapsListenerFree(listener);
+    listener = NULL;
+    if (timeout) event_free(timeout);
+    if (base) event_base_free(base);
+    base = NULL;
+    return result;
+}
+
+/* A zero-copy Send that is written but not yet released by the kernel, and
+   a big one behind it that isn't all written, when writing fails. Both must
+   fail, in order; the second must not be reported sent. */
+#define ZC_SIZE         (4 * 1024)
+static TAPS_CTX      *resetServer;
+static tapsCallbacks  resetCallbacks;
+static int            resetFd, resetSent, numResetErrors;
+static int            resetErrors[2]; /* 1 where it was the big one */
+static unsigned char *resetBufs[2];
+
+static void
+_reset_sent(void *conn, void *msg)
+{
+    resetSent++;
+    tapsMessageFree(msg);
+}
+
+static void
+_reset_send_error(void *conn, void *msg, char *reason)
+{
+    size_t len;
+
+    if (numResetErrors < 2) {
+        resetErrors[numResetErrors] =
+                (tapsMessageGetFirstBuf(msg, &len) == resetBufs[1]);
+    }
+    numResetErrors++;
+    tapsMessageFree(msg);
+}
+
+static void
+_reset_receive_error(void *conn, void *msg, char *reason)
+{
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_reset_closed(void *conn)
+{
+    tapsConnectionFree(conn);
+    resetServer = NULL;
+    tapsListenerStop(listener, &resetCallbacks);
+}
+
+static void
+_reset_connection_error(void *conn, char *reason)
+{
+    _reset_closed(conn);
+}
+
+static void *
+_reset_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    TAPS_CTX *msg;
+    int       sndbuf = 64 * 1024;
+
+    *cb = &resetCallbacks;
+    resetServer = conn;
+    /* Room for all of the first Send, but not the second */
+    resetFd = _test_server_fd();
+    if ((resetFd < 0) || (setsockopt(resetFd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+            sizeof(sndbuf)) < 0) ||
+            (tapsConnectionSetZeroCopy(conn, ZC_SIZE) < 0) ||
+            (tapsConnectionSetSendWindow(conn, 2) < 0) ||
+            (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &resetCallbacks) < 0)) {
+        failed = 1;
+        return conn;
+    }
+    msg = tapsMessageNew(resetBufs[0], ZC_SIZE);
+    if (!msg || (tapsConnectionSend(conn, msg, msg, &resetCallbacks) < 0)) {
+        failed = 1;
+    }
+    return conn;
+}
+
+static int
+_tcp_reset_test(char *libpath)
+{
+    struct sockaddr_in sin;
+    struct linger      linger = { 1, 0 };
+    struct event      *timeout = NULL;
+    struct timeval     limit = { 10, 0 };
+    TAPS_CTX          *msg;
+    int                rcvbuf = 1, result = 0, i;
+
+    memset(&resetCallbacks, 0, sizeof(resetCallbacks));
+    resetCallbacks.connectionReceived = &_reset_connection_received;
+    resetCallbacks.establishmentError = &_test_establishment_error;
+    resetCallbacks.stopped = &_test_stopped;
+    resetCallbacks.sent = &_reset_sent;
+    resetCallbacks.sendError = &_reset_send_error;
+    resetCallbacks.received = &_test_received;
+    resetCallbacks.receivedPartial = &_test_received_partial;
+    resetCallbacks.receiveError = &_reset_receive_error;
+    resetCallbacks.closed = &_reset_closed;
+    resetCallbacks.connectionError = &_reset_connection_error;
+    resetServer = NULL;
+    resetFd = -1;
+    failed = stopped = resetSent = numResetErrors = 0;
+    for (i = 0; i < 2; i++) {
+        resetBufs[i] = calloc(1, MSG_SIZE);
+        if (!resetBufs[i]) goto fail;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT + 4);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    base = event_base_new();
+    if (!base) goto fail;
+    listener = tapsListenerNew(NULL, libpath, (struct sockaddr *)&sin, &base,
+            1, &resetCallbacks);
+    if (!listener) goto fail;
+    timeout = evtimer_new(base, &_test_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+    /* The client never reads, and keeps its window tiny, so the pages of
+       the zero-copy Send stay pinned in the server's socket */
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if ((client < 0) || (setsockopt(client, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+            sizeof(rcvbuf)) < 0) ||
+            (connect(client, (struct sockaddr *)&sin, sizeof(sin)) < 0)) {
+        goto fail;
+    }
+    while (!resetServer && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    if (failed) goto fail;
+    /* After the first is written, rather than coalesced with it */
+    msg = tapsMessageNew(resetBufs[1], MSG_SIZE);
+    if (!msg || (tapsConnectionSend(resetServer, msg, msg,
+            &resetCallbacks) < 0)) {
+        goto fail;
+    }
+    /* The next write fails; then the client resets the connection, which
+       the Receive finds */
+    shutdown(resetFd, SHUT_WR);
+    while ((numResetErrors + resetSent < 2) && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    setsockopt(client, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(client);
+    client = -1;
+    if (!stopped) {
+        event_base_dispatch(base);
+    }
+    if (failed || !stopped || (resetSent != 0) || (numResetErrors != 2) ||
+            resetErrors[0] || !resetErrors[1]) {
+        printf("Reset: %d sent, %d failed\n", resetSent, numResetErrors);
+        goto fail;
+    }
+    result = 1;
+fail:
+    if (client >= 0) close(client);
+    client = -1;
+    if (listener && stopped) tapsListenerFree(listener);
+    listener = NULL;
+    if (timeout) event_free(timeout);
+    if (base) event_base_free(base);
+    base = NULL;
+    for (i = 0; i < 2; i++) {
+        free(resetBufs[i]);
+        resetBufs[i] = NULL;
+    }
+    return result;
+}
+
+/* A listener sharded across two event_bases, each on a thread of its own.
+   Stopping it from the main thread must wait for the connections on both,
+   and report stopped once. */
+#define NUM_SHARDS      2
+#define NUM_SHARD_CONNS 32
+#define SHARD_WAIT_MS   10000
+static tapsCallbacks  shardCallbacks;
+static pthread_t      shardThreads[NUM_SHARDS];
+static int            shardConns[NUM_SHARDS]; /* Atomic, by thread */
+static int            shardLive, shardStopped, shardFailed; /* Atomic */
+
+static void
+_shard_receive_error(void *conn, void *msg, char *reason)
+{
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_shard_received(void *conn, void *msg, size_t len)
+{
+    /* The clients never write */
+    __atomic_store_n(&shardFailed, 1, __ATOMIC_RELAXED);
+    tapsMessageFree(msg);
+}
+
+static void
+_shard_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+    _shard_received(conn, msg, len);
+}
+
+static void
+_shard_closed(void *conn)
+{
+    /* The last free may report stopped */
+    __atomic_sub_fetch(&shardLive, 1, __ATOMIC_ACQ_REL);
+    tapsConnectionFree(conn);
+}
+
+static void
+_shard_connection_error(void *conn, char *reason)
+{
+    _shard_closed(conn);
+}
+
+static void
+_shard_stopped(void *l)
+{
+    if (__atomic_load_n(&shardLive, __ATOMIC_ACQUIRE) != 0) {
+        __atomic_store_n(&shardFailed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shardStopped, 1, __ATOMIC_ACQ_REL);
+}
+
+static void
+_shard_establishment_error(void *l, char *reason)
+{
+    __atomic_store_n(&shardFailed, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+_shard_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    pthread_t self = pthread_self();
+    int       i;
+
+    *cb = &shardCallbacks;
+    for (i = 0; (i < NUM_SHARDS) && !pthread_equal(self, shardThreads[i]);
+            i++);
+    if (i == NUM_SHARDS) {
+        __atomic_store_n(&shardFailed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&shardConns[i], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shardLive, 1, __ATOMIC_ACQ_REL);
+    /* So that the client closing is noticed */
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &shardCallbacks) < 0) {
+        __atomic_store_n(&shardFailed, 1, __ATOMIC_RELAXED);
+    }
+    return conn;
+}
+
+static void *
+_shard_thread(void *arg)
+{
+    event_base_loop(arg, EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
+}
+
+/* Wait, up to a limit, for *value to reach want */
+static int
+_shard_wait(int *value, int want)
+{
+    int ms;
+
+    for (ms = 0; ms < SHARD_WAIT_MS; ms++) {
+        if (__atomic_load_n(value, __ATOMIC_ACQUIRE) == want) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static int
+_tcp_shard_test()
+{
+    struct event_base *bases[NUM_SHARDS] = { NULL };
+    TAPS_CTX          *ep = NULL, *tp = NULL, *pc = NULL, *l = NULL;
+    struct sockaddr_in sin;
+    int                fds[NUM_SHARD_CONNS], running = 0, result = 0, i;
+
+    memset(&shardCallbacks, 0, sizeof(shardCallbacks));
+    shardCallbacks.connectionReceived = &_shard_connection_received;
+    shardCallbacks.establishmentError = &_shard_establishment_error;
+    shardCallbacks.stopped = &_shard_stopped;
+    shardCallbacks.received = &_shard_received;
+    shardCallbacks.receivedPartial = &_shard_received_partial;
+    shardCallbacks.receiveError = &_shard_receive_error;
+    shardCallbacks.closed = &_shard_closed;
+    shardCallbacks.connectionError = &_shard_connection_error;
+    shardLive = shardStopped = shardFailed = 0;
+    memset(shardConns, 0, sizeof(shardConns));
+    for (i = 0; i < NUM_SHARD_CONNS; i++) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < NUM_SHARDS; i++) {
+        bases[i] = event_base_new();
+        if (!bases[i]) goto fail;
+    }
+    ep = tapsEndpointNew();
+    tp = tapsTransportPropertiesNew(TAPS_LISTENER);
+    if (!ep || !tp) goto fail;
+    if (!tapsEndpointWithPort(ep, TCP_TEST_PORT + 5)) goto fail;
+    if (!tapsEndpointWithIPv4Address(ep, "127.0.0.1")) goto fail;
+    pc = tapsPreconnectionNew(&ep, 1, NULL, 0, tp, NULL);
+    if (!pc) goto fail;
+    /* The threads aren't running yet, so nothing is accepted before
+       shardThreads is filled in */
+    l = tapsPreconnectionListenSharded(pc, NULL, bases, NUM_SHARDS,
+            &shardCallbacks);
+    if (!l) goto fail;
+    for (running = 0; running < NUM_SHARDS; running++) {
+        if (pthread_create(&shardThreads[running], NULL, &_shard_thread,
+                bases[running]) != 0) {
+            goto fail;
+        }
+    }
+
+    /* The kernel spreads the clients across both shards */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TCP_TEST_PORT + 5);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < NUM_SHARD_CONNS; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if ((fds[i] < 0) ||
+                (connect(fds[i], (struct sockaddr *)&sin, sizeof(sin)) < 0)) {
+            goto fail;
+        }
+    }
+    if (_shard_wait(&shardLive, NUM_SHARD_CONNS) < 0) goto fail;
+    for (i = 0; i < NUM_SHARDS; i++) {
+        if (__atomic_load_n(&shardConns[i], __ATOMIC_RELAXED) == 0) goto fail;
+    }
+
+    /* Stopped waits for the connections, on every shard */
+    if (tapsListenerStop(l, &shardCallbacks) < 0) goto fail;
+    usleep(100 * 1000);
+    if (__atomic_load_n(&shardStopped, __ATOMIC_ACQUIRE) != 0) goto fail;
+    for (i = 0; i < NUM_SHARD_CONNS; i++) {
+        close(fds[i]);
+        fds[i] = -1;
+    }
+    if (_shard_wait(&shardStopped, 1) < 0) goto fail;
+    usleep(100 * 1000);
+    if ((__atomic_load_n(&shardStopped, __ATOMIC_ACQUIRE) != 1) ||
+            __atomic_load_n(&shardFailed, __ATOMIC_ACQUIRE)) {
+        goto fail;
+    }
+    result = 1;
+fail:
+    if (!result) {
+        printf("Sharded: %d and %d accepted, %d open, %d stopped, %d\n",
+                shardConns[0], shardConns[1], shardLive, shardStopped, shardFailed);
+    }
+    for (i = 0; i < NUM_SHARD_CONNS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    for (i = 0; i < running; i++) {
+        event_base_loopbreak(bases[i]);
+        pthread_join(shardThreads[i], NULL);
+    }
+    if (l && (shardStopped == 1)) tapsListenerFree(l);
+    if (pc) tapsPreconnectionFree(pc);
+    if (ep) tapsEndpointFree(ep);
+    if (tp) tapsTransportPropertiesFree(tp);
+    for (i = 0; i < NUM_SHARDS; i++) {
+        if (bases[i]) event_base_free(bases[i]);
+    }
+    return result;
+}
+
+int
+tcpTest()
+{
+    int result = _tcp_test(NULL) && _tcp_timeout_test(TCP_LIB) &&
+            _tcp_reset_test(TCP_LIB) && _tcp_shard_test();
+
+    TEST_OUTPUT(result);
+    return result;
+}
+
+int
+tcpUringTest()
+{
+    double tcp, uring;
+    int    result = _tcp_test(TCP_URING_LIB) &&
+            _tcp_timeout_test(TCP_URING_LIB) && _tcp_reset_test(TCP_URING_LIB);
+
+    if (result) {
+        /* Includes the client's write() and read() */
+        tcp = _tcp_syscall_bench(TCP_LIB);
+        uring = _tcp_syscall_bench(TCP_URING_LIB);
+        if ((tcp < 0) || (uring < 0)) {
+            printf("syscall count unavailable\n");
+        } else {
+            printf("syscalls per round trip: tcp %.2f, tcp_uring %.2f\n",
+                    tcp, uring);
+            result = (uring < tcp);
+        }
+    }
+    TEST_OUTPUT(result);
+    return result;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Unit tests for the timer wheel */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <event2/event.h>
+#include "t.h"
+
+#define NUM_TIMERS  5
+#define ITERATIONS  1000000
+
+struct test_timer {
+    tapsTimer   timer;
+    int         id;
+    uint64_t    ms;
+};
+
+static tapsTimerWheel    *wheel;
+static struct test_timer  timers[NUM_TIMERS];
+static int                fired[NUM_TIMERS], numFired;
+static uint64_t           start;
+static int                early;
+
+static void
+_timer_fired(void *arg)
+{
+    struct test_timer *t = arg;
+
+    fired[numFired++] = t->id;
+    if (tapsNow() - start + TAPS_TIMER_TICK_MS < t->ms) {
+        early = 1;
+    }
+    /* Timers can be armed from a callback */
+    if (t->id == 0) {
+        tapsTimerArm(wheel, &timers[4].timer, timers[4].ms);
+        timers[4].ms += tapsNow() - start;
+    }
+}
+
+/* Get the wheel for a base from another thread, which must find the same
+   one, and put it there */
+static void *
+_timer_other_thread(void *arg)
+{
+    struct event_base *base = arg;
+    tapsTimerWheel    *w = tapsTimerWheelGet(base);
+
+    if (w) tapsTimerWheelPut(w);
+    return w;
+}
+
+/* A wheel got on one thread can be freed on another */
+static void *
+_timer_put_thread(void *arg)
+{
+    tapsTimerWheelPut(arg);
+    return NULL;
+}
+
+/* Steady-state cost of arming and cancelling, as a connection does when it
+   resets a timeout on every operation */
+static void
+_timer_benchmark(void)
+{
+    struct timespec begin, end;
+    int             i;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < ITERATIONS; i++) {
+        tapsTimerArm(wheel, &timers[i % NUM_TIMERS].timer, 1000 + i % 5000);
+    }
+    for (i = 0; i < NUM_TIMERS; i++) {
+        tapsTimerCancel(&timers[i].timer);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("timer arm: %.1f ns/op\n", ((double)(end.tv_sec - begin.tv_sec) *
+            1e9 + (double)(end.tv_nsec - begin.tv_nsec)) / ITERATIONS);
+}
+
+int
+timerTest()
+{
+    int                result = 0;
+    struct event_base *base = event_base_new(), *other = NULL;
+    tapsTimerWheel    *w;
+    pthread_t          thread;
+    void              *found;
+    uint64_t           delays[NUM_TIMERS] = { 10, 30, 600, 20, 5 };
+    int                expected[] = { 0, 4, 1, 2 };
+    int                i;
+
+    wheel = (base) ? tapsTimerWheelGet(base) : NULL;
+    if (!wheel) goto fail;
+    /* One wheel per base */
+    if (tapsTimerWheelGet(base) != wheel) goto fail;
+    tapsTimerWheelPut(wheel);
+    /* Even from another thread */
+    if ((pthread_create(&thread, NULL, &_timer_other_thread, base) != 0) ||
+            (pthread_join(thread, &found) != 0) || (found != wheel)) {
+        goto fail;
+    }
+    other = event_base_new();
+    w = (other) ? tapsTimerWheelGet(other) : NULL;
+    if (!w || (w == wheel)) goto fail;
+    if ((pthread_create(&thread, NULL, &_timer_put_thread, w) != 0) ||
+            (pthread_join(thread, NULL) != 0)) {
+        goto fail;
+    }
+    numFired = early = 0;
+    for (i = 0; i < NUM_TIMERS; i++) {
+        tapsTimerInit(&timers[i].timer, &_timer_fired, &timers[i]);
+        timers[i].id = i;
+        timers[i].ms = delays[i];
+    }
+    start = tapsNow();
+    /* 600ms is beyond the bottom level, so that one has to cascade down */
+    for (i = 0; i < 4; i++) {
+        if (tapsTimerArm(wheel, &timers[i].timer, delays[i]) < 0) goto fail;
+    }
+    tapsTimerCancel(&timers[3].timer);
+    if (TIMER_ARMED(&timers[3].timer)) goto fail;
+    /* Returns when the wheel stops ticking */
+    event_base_dispatch(base);
+    if ((numFired != 4) || early) goto fail;
+    for (i = 0; i < 4; i++) {
+        if (fired[i] != expected[i]) goto fail;
+    }
+    _timer_benchmark();
+    result = 1;
+fail:
+    TEST_OUTPUT(result);
+    if (wheel) tapsTimerWheelPut(wheel);
+    if (base) event_base_free(base);
+    if (other) event_base_free(other);
+    return result;
+}
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Tests of the installed UDP module, over loopback */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include "t.h"
+
+#define UDP_TEST_PORT   5559
+#define NUM_DGRAMS      48
+#define RCV_MAX         1024
+#define BIG_SIZE        3000
+#define NUM_SEGS        40
+#define SEG_SIZE        1000
+#define BURST           64
+#define PING_SIZE       64
+#define BUSY_DATAGRAMS  1024     /* Before a peer gets its own socket */
+#define NUM_PEERS       256      /* Enough to grow the peer table a few times */
+#define PEER_IDLE       300      /* ms */
+#define PEER_TICK       50000    /* us between datagrams from active peers */
+#define UDP_LIB         "/usr/lib/x86_64-linux-gnu/libtaps_udp.so"
+
+static struct event_base *base;
+static TAPS_CTX          *listener;
+static tapsCallbacks      callbacks;
+static int                failed, stopping, stopped;
+static int                numConns, numReceived, numSent;
+static int                numNew, numEvicted;
+static TAPS_CTX          *peerConn[NUM_PEERS]; /* By peer, while open */
+
+static void
+_udp_sent(void *conn, void *msg)
+{
+    size_t len;
+
+    numSent++;
+    free(tapsMessageGetFirstBuf(msg, &len));
+    tapsMessageFree(msg);
+}
+
+static void
+_udp_send_error(void *conn, void *msg, char *reason)
+{
+    size_t len;
+
+    failed = 1;
+    free(tapsMessageGetFirstBuf(msg, &len));
+    tapsMessageFree(msg);
+}
+
+/* Echo each delivery back as a datagram of its own */
+static void
+_udp_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+    size_t    bufLen;
+    void     *buf = tapsMessageGetFirstBuf(msg, &bufLen);
+    void     *copy = malloc(len);
+    TAPS_CTX *reply = NULL;
+
+    numReceived++;
+    if (copy) {
+        memcpy(copy, buf, len);
+        reply = tapsMessageNew(copy, len);
+    }
+    tapsMessageFree(msg);
+    if (!reply || (tapsConnectionSend(conn, reply, reply, &callbacks) < 0) ||
+            (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_MAX,
+            &callbacks) < 0)) {
+        free(copy);
+        failed = 1;
+    }
+}
+
+static void
+_udp_received(void *conn, void *msg, size_t len)
+{
+    _udp_received_partial(conn, msg, len, 1);
+}
+
+static void
+_udp_receive_error(void *conn, void *msg, char *reason)
+{
+    /* Freeing the connection fails the Receive it still has posted */
+    if (!stopping) failed = 1;
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_udp_establishment_error(void *l, char *reason)
+{
+    failed = 1;
+}
+
+static void
+_udp_closed(void *conn)
+{
+    tapsConnectionFree(conn);
+    numConns--;
+}
+
+static void
+_udp_connection_error(void *conn, char *reason)
+{
+    failed = 1;
+}
+
+static void
+_udp_stopped(void *l)
+{
+    stopped = 1;
+    event_base_loopbreak(base);
+}
+
+static void *
+_udp_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    *cb = &callbacks;
+    numConns++;
+    tapsConnectionSetSendWindow(conn, NUM_DGRAMS);
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_MAX, &callbacks) < 0) {
+        failed = 1;
+    }
+    return conn;
+}
+
+/* Each datagram names its peer, which must always map to the same
+   connection */
+static void
+_udp_peer_received_partial(void *conn, void *msg, size_t len,
+        int endOfMessage)
+{
+    size_t   bufLen;
+    uint8_t *buf = tapsMessageGetFirstBuf(msg, &bufLen);
+    int      i = (len == 2) ? (buf[0] << 8) | buf[1] : NUM_PEERS;
+
+    tapsMessageFree(msg);
+    numReceived++;
+    if (i >= NUM_PEERS) {
+        failed = 1;
+    } else if (!peerConn[i]) {
+        peerConn[i] = conn;
+    } else if (peerConn[i] != conn) {
+        printf("UDP peer %d moved to another connection\n", i);
+        failed = 1;
+    }
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_MAX, &callbacks) < 0) {
+        failed = 1;
+    }
+}
+
+static void
+_udp_peer_received(void *conn, void *msg, size_t len)
+{
+    _udp_peer_received_partial(conn, msg, len, 1);
+}
+
+/* Closing a connection fails the Receive it still has posted */
+static void
+_udp_peer_receive_error(void *conn, void *msg, char *reason)
+{
+    int i;
+
+    for (i = 0; i < NUM_PEERS; i++) {
+        if (peerConn[i] == conn) {
+            failed = 1;
+        }
+    }
+    if (msg) tapsMessageFree(msg);
+}
+
+/* Only the quiet peers, the odd ones, may be evicted */
+static void
+_udp_peer_closed(void *conn)
+{
+    int i;
+
+    for (i = 0; i < NUM_PEERS; i++) {
+        if (peerConn[i] == conn) {
+            peerConn[i] = NULL;
+            if (!stopping && (i % 2 == 0)) {
+                printf("UDP active peer %d was evicted\n", i);
+                failed = 1;
+            }
+            break;
+        }
+    }
+    if (!stopping) {
+        numEvicted++;
+    }
+    _udp_closed(conn);
+}
+
+static void *
+_udp_peer_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    numNew++;
+    return _udp_connection_received(l, conn, cb);
+}
+
+static void
+_udp_timeout(evutil_socket_t fd, short event, void *arg)
+{
+    printf("UDP test timed out with %d datagrams sent\n", numSent);
+    failed = 1;
+    event_base_loopbreak(base);
+}
+
+static int
+_udp_client(struct sockaddr_in *sin)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+    if ((fd >= 0) &&
+            (connect(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* The next echo, if it has arrived, or -1. seg is the UDP_GRO segment size,
+   if the kernel joined several. */
+static ssize_t
+_udp_echo(int fd, unsigned char *buf, size_t len, int *seg)
+{
+    union {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    }               ctl;
+    struct iovec    iov = { buf, len };
+    struct msghdr   h;
+    struct cmsghdr *cm;
+    ssize_t         bytes;
+
+    memset(&h, 0, sizeof(h));
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+    h.msg_control = ctl.buf;
+    h.msg_controllen = sizeof(ctl.buf);
+    *seg = 0;
+    while ((bytes = recvmsg(fd, &h, 0)) < 0) {
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        if (failed) {
+            return -1;
+        }
+        event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    }
+    for (cm = CMSG_FIRSTHDR(&h); cm; cm = CMSG_NXTHDR(&h, cm)) {
+        if ((cm->cmsg_level == IPPROTO_UDP) && (cm->cmsg_type == UDP_GRO)) {
+            memcpy(seg, CMSG_DATA(cm), sizeof(*seg));
+        }
+    }
+    return bytes;
+}
+
+/* Equal datagrams in one system call, which the kernel segments */
+static int
+_udp_send_gso(int fd, unsigned char *buf, size_t len, uint16_t seg)
+{
+    union {
+        char           buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    }               ctl;
+    struct iovec    iov = { buf, len };
+    struct msghdr   h;
+    struct cmsghdr *cm;
+
+    memset(&h, 0, sizeof(h));
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+    h.msg_control = ctl.buf;
+    h.msg_controllen = sizeof(ctl.buf);
+    cm = CMSG_FIRSTHDR(&h);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(seg));
+    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    return (sendmsg(fd, &h, 0) == len) ? 0 : -1;
+}
+
+/* The server's socket connected to the client, found by its peer address */
+static int
+_udp_connected_fd(int client)
+{
+    struct sockaddr_in local, peer;
+    socklen_t          len = sizeof(local);
+    int                fd, type;
+
+    if (getsockname(client, (struct sockaddr *)&local, &len) < 0) {
+        return -1;
+    }
+    for (fd = 0; fd < 1024; fd++) {
+        len = sizeof(peer);
+        if ((fd != client) &&
+                (getpeername(fd, (struct sockaddr *)&peer, &len) == 0) &&
+                (peer.sin_family == AF_INET) &&
+                (peer.sin_port == local.sin_port)) {
+            len = sizeof(type);
+            if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0) &&
+                    (type == SOCK_DGRAM)) {
+                return fd;
+            }
+        }
+    }
+    return -1;
+}
+
+static int
+_udp_echo_test()
+{
+    int                 result = 0;
+    struct event       *timeout = NULL;
+    struct timeval      limit = { 10, 0 };
+    struct sockaddr_in  sin;
+    unsigned char       buf[NUM_SEGS * SEG_SIZE], echo[NUM_SEGS * SEG_SIZE];
+    ssize_t             bytes;
+    size_t              off, len;
+    int                 a = -1, b = -1, one = 1, seg, gso = 0, i, j;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.connectionReceived = &_udp_connection_received;
+    callbacks.establishmentError = &_udp_establishment_error;
+    callbacks.stopped = &_udp_stopped;
+    callbacks.sent = &_udp_sent;
+    callbacks.sendError = &_udp_send_error;
+    callbacks.received = &_udp_received;
+    callbacks.receivedPartial = &_udp_received_partial;
+    callbacks.receiveError = &_udp_receive_error;
+    callbacks.closed = &_udp_closed;
+    callbacks.connectionError = &_udp_connection_error;
+    listener = NULL;
+    failed = stopping = stopped = numConns = numReceived = numSent = 0;
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i % 251;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(UDP_TEST_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    base = event_base_new();
+    if (!base) goto fail;
+    tapsListenerSetBusyPeerDatagrams(BUSY_DATAGRAMS);
+    listener = tapsListenerNew(NULL, UDP_LIB, (struct sockaddr *)&sin, &base,
+            1, &callbacks);
+    tapsListenerSetBusyPeerDatagrams(0);
+    if (!listener) goto fail;
+    timeout = evtimer_new(base, &_udp_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+
+    /* Each peer is a connection of its own */
+    a = _udp_client(&sin);
+    b = _udp_client(&sin);
+    if ((a < 0) || (b < 0)) goto fail;
+    for (i = 1; i <= NUM_DGRAMS; i++) {
+        if (send(a, buf + i, i, 0) != i) goto fail;
+    }
+    if (send(b, buf, BIG_SIZE, 0) != BIG_SIZE) goto fail;
+
+    /* Everything already queued arrives in one wakeup, more than one
+       recvmmsg() worth */
+    event_base_loop(base, EVLOOP_ONCE);
+    if (failed || (numConns != 2) ||
+            (numReceived != NUM_DGRAMS + (BIG_SIZE + RCV_MAX - 1) / RCV_MAX)) {
+        goto fail;
+    }
+
+    /* The echoes keep their boundaries and their order */
+    for (i = 1; i <= NUM_DGRAMS; i++) {
+        bytes = _udp_echo(a, echo, sizeof(echo), &seg);
+        if ((bytes != i) || (memcmp(echo, buf + i, i) != 0)) goto fail;
+    }
+    /* Too big for the Receive, so it came up in pieces */
+    for (off = 0; off < BIG_SIZE; off += len) {
+        len = (BIG_SIZE - off < RCV_MAX) ? BIG_SIZE - off : RCV_MAX;
+        bytes = _udp_echo(b, echo, sizeof(echo), &seg);
+        if ((bytes != len) || (memcmp(echo, buf + off, len) != 0)) goto fail;
+    }
+    if (numSent != numReceived) goto fail;
+
+    /* A GSO burst reaches the server as one GRO buffer, which the module
+       splits up again. The echoes are equal-sized Sends to one peer, so they
+       go back as GSO too, which a GRO socket can see. */
+    numReceived = numSent = 0;
+    if (setsockopt(a, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0) goto fail;
+    if (_udp_send_gso(a, buf, sizeof(buf), SEG_SIZE) < 0) goto fail;
+    for (off = 0; off < sizeof(buf); off += bytes) {
+        bytes = _udp_echo(a, echo + off, sizeof(echo) - off, &seg);
+        if ((bytes <= 0) || (bytes % SEG_SIZE != 0)) goto fail;
+        if (seg == SEG_SIZE) {
+            gso = 1;
+        }
+    }
+    if (!gso || (memcmp(echo, buf, sizeof(buf)) != 0)) goto fail;
+    if ((numReceived != NUM_SEGS) || (numSent != NUM_SEGS)) goto fail;
+
+    /* A busy peer gets a connected socket of its own, and stays the same
+       connection */
+    for (i = 0; (i < 4 * BUSY_DATAGRAMS / BURST) && !failed &&
+            (_udp_connected_fd(b) < 0); i++) {
+        numReceived = 0;
+        for (j = 0; j < BURST; j++) {
+            if (send(b, buf, PING_SIZE, 0) != PING_SIZE) goto fail;
+        }
+        while ((numReceived < BURST) && !failed) {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+        while (recv(b, echo, sizeof(echo), 0) > 0);
+    }
+    if (_udp_connected_fd(b) < 0) goto fail;
+    if (send(b, buf + 1, PING_SIZE, 0) != PING_SIZE) goto fail;
+    bytes = _udp_echo(b, echo, sizeof(echo), &seg);
+    if ((bytes != PING_SIZE) || (memcmp(echo, buf + 1, PING_SIZE) != 0) ||
+            (numConns != 2)) {
+        goto fail;
+    }
+
+    /* Stopping the listener closes the connections on its socket */
+    stopping = 1;
+    tapsListenerStop(listener, &callbacks);
+    if (!stopped) {
+        event_base_dispatch(base);
+    }
+    if (failed || !stopped || (numConns != 0)) goto fail;
+    result = 1;
+fail:
+    if (a >= 0) close(a);
+    if (b >= 0) close(b);
+    if (listener && stopped) tapsListenerFree(listener);
+    if (timeout) event_free(timeout);
+    if (base) event_base_free(base);
+    return result;
+}
+
+/* Send peer i's datagram from its socket */
+static int
+_udp_peer_send(int fd, int i)
+{
+    uint8_t buf[2] = { i >> 8, i & 0xff };
+
+    return (send(fd, buf, sizeof(buf), 0) == sizeof(buf)) ? 0 : -1;
+}
+
+/* Run the loop until the listener has taken every datagram sent */
+static void
+_udp_peers_wait(int sent)
+{
+    while ((numReceived < sent) && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+}
+
+/* Many peers, whose probe runs in the table run into each other. Half of them
+   go quiet and are evicted, which shifts entries back, and the rest must
+   still find their own connections. */
+static int
+_udp_peers_test()
+{
+    int                 result = 0;
+    struct event       *timeout = NULL;
+    TAPS_CTX           *other = NULL;
+    struct timeval      limit = { 10, 0 }, tick = { 0, PEER_TICK };
+    struct sockaddr_in  sin;
+    int                 fds[NUM_PEERS], sent = 0, fd = -1, one = 1, i, rounds;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.connectionReceived = &_udp_peer_connection_received;
+    callbacks.establishmentError = &_udp_establishment_error;
+    callbacks.stopped = &_udp_stopped;
+    callbacks.received = &_udp_peer_received;
+    callbacks.receivedPartial = &_udp_peer_received_partial;
+    callbacks.receiveError = &_udp_peer_receive_error;
+    callbacks.closed = &_udp_peer_closed;
+    callbacks.connectionError = &_udp_connection_error;
+    listener = NULL;
+    failed = stopping = stopped = numConns = numReceived = numSent = 0;
+    numNew = numEvicted = 0;
+    memset(peerConn, 0, sizeof(peerConn));
+    for (i = 0; i < NUM_PEERS; i++) {
+        fds[i] = -1;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(UDP_TEST_PORT + 1);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    base = event_base_new();
+    if (!base) goto fail;
+    tapsListenerSetPeerIdleTimeout(PEER_IDLE);
+    listener = tapsListenerNew(NULL, UDP_LIB, (struct sockaddr *)&sin, &base,
+            1, &callbacks);
+    tapsListenerSetPeerIdleTimeout(0);
+    if (!listener) goto fail;
+    timeout = evtimer_new(base, &_udp_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+
+    /* Without busy peers or shards, the address is the listener's alone:
+       neither another listener nor a socket with SO_REUSEPORT can bind it */
+    other = tapsListenerNew(NULL, UDP_LIB, (struct sockaddr *)&sin, &base, 1,
+            &callbacks);
+    if (other || (errno != EADDRINUSE)) goto fail;
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if ((fd < 0) ||
+            (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+            (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) ||
+            (errno != EADDRINUSE)) {
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+
+    /* Every peer is a connection of its own */
+    for (i = 0; i < NUM_PEERS; i++) {
+        fds[i] = _udp_client(&sin);
+        if ((fds[i] < 0) || (_udp_peer_send(fds[i], i) < 0)) goto fail;
+        sent++;
+    }
+    _udp_peers_wait(sent);
+    if (failed || (numConns != NUM_PEERS) || (numNew != NUM_PEERS)) goto fail;
+
+    /* The even peers keep talking until the odd ones are gone */
+    for (rounds = 0; (numEvicted < NUM_PEERS / 2) && !failed &&
+            (rounds < 4 * 1000000 / PEER_TICK); rounds++) {
+        for (i = 0; i < NUM_PEERS; i += 2) {
+            if (_udp_peer_send(fds[i], i) < 0) goto fail;
+            sent++;
+        }
+        event_base_loopexit(base, &tick);
+        event_base_dispatch(base);
+    }
+    _udp_peers_wait(sent);
+    if (failed || (numEvicted != NUM_PEERS / 2) ||
+            (numConns != NUM_PEERS / 2)) {
+        goto fail;
+    }
+    for (i = 0; i < NUM_PEERS; i++) {
+        if (!peerConn[i] != (i % 2)) goto fail;
+    }
+
+    /* The survivors are still found, and the others come back as new
+       connections */
+    for (i = 0; i < NUM_PEERS; i++) {
+        if (_udp_peer_send(fds[i], i) < 0) goto fail;
+        sent++;
+    }
+    _udp_peers_wait(sent);
+    if (failed || (numConns != NUM_PEERS) ||
+            (numNew != NUM_PEERS + NUM_PEERS / 2)) {
+        goto fail;
+    }
+
+    stopping = 1;
+    tapsListenerStop(listener, &callbacks);
+    if (!stopped) {
+        event_base_dispatch(base);
+    }
+    if (failed || !stopped || (numConns != 0)) goto fail;
+    result = 1;
+fail:
+    for (i = 0; i < NUM_PEERS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    if (fd >= 0) close(fd);
+    if (other) tapsListenerFree(other);
+    if (listener && stopped) tapsListenerFree(listener);
+    if (timeout) event_free(timeout);
+    if (base) event_base_free(base);
+    return result;
+}
+
+int
+udpTest()
+{
+    int result = _udp_echo_test() && _udp_peers_test();
+
+    TEST_OUTPUT(result);
+    return result;
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2021 F5 Networks, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors to this project must sign and submit the Contributor License
+ * Agreement available in this repository.
+ */
+
+/* Tests of the installed AF_UNIX modules */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include "t.h"
+
+#define UNIX_TEST_PATH  "/tmp/taps_unix_test.sock"
+#define UNIX_TEST_PORT  5561
+#define RCV_CHUNK       32
+#define SMALL_RECORD    10
+#define BIG_RECORD      100 /* More than one Receive */
+#define SEQPACKET_LIB   "/usr/lib/x86_64-linux-gnu/libtaps_unix_seqpacket.so"
+
+static struct event_base *base;
+static TAPS_CTX          *listener;
+static tapsCallbacks      callbacks;
+static int                failed, stopping, stopped;
+static int                records; /* Echo whole records, not each piece */
+static int                numPartial, numReceived, numSent;
+static unsigned char      acc[BIG_RECORD];
+static size_t             accLen;
+
+static void
+_unix_sent(void *conn, void *msg)
+{
+    size_t len;
+
+    numSent++;
+    free(tapsMessageGetFirstBuf(msg, &len));
+    tapsMessageFree(msg);
+}
+
+static void
+_unix_send_error(void *conn, void *msg, char *reason)
+{
+    size_t len;
+
+    failed = 1;
+    free(tapsMessageGetFirstBuf(msg, &len));
+    tapsMessageFree(msg);
+}
+
+/* Echo what has come in, once it is a whole record if there are records */
+static void
+_unix_echo(void *conn)
+{
+    TAPS_CTX *msg;
+    void     *copy;
+
+    if (accLen == 0) {
+        /* An empty record; there is nothing to send back */
+        return;
+    }
+    copy = malloc(accLen);
+    if (!copy) {
+        failed = 1;
+        return;
+    }
+    memcpy(copy, acc, accLen);
+    msg = tapsMessageNew(copy, accLen);
+    if (!msg || (tapsConnectionSend(conn, msg, msg, &callbacks) < 0)) {
+        failed = 1;
+    }
+    accLen = 0;
+}
+
+static void
+_unix_received_partial(void *conn, void *msg, size_t len, int endOfMessage)
+{
+    size_t bufLen;
+    void  *buf = tapsMessageGetFirstBuf(msg, &bufLen);
+
+    if (accLen + len > sizeof(acc)) {
+        failed = 1;
+        len = sizeof(acc) - accLen;
+    }
+    memcpy(acc + accLen, buf, len);
+    accLen += len;
+    tapsMessageFree(msg);
+    if (endOfMessage) {
+        numReceived++;
+    } else {
+        numPartial++;
+    }
+    if (endOfMessage || !records) {
+        _unix_echo(conn);
+    }
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &callbacks) < 0) {
+        failed = 1;
+    }
+}
+
+static void
+_unix_received(void *conn, void *msg, size_t len)
+{
+    _unix_received_partial(conn, msg, len, 1);
+}
+
+static void
+_unix_receive_error(void *conn, void *msg, char *reason)
+{
+    /* Freeing the connection fails the Receive it still has posted */
+    if (!stopping) failed = 1;
+    if (msg) tapsMessageFree(msg);
+}
+
+static void
+_unix_establishment_error(void *l, char *reason)
+{
+    failed = 1;
+}
+
+static void
+_unix_closed(void *conn)
+{
+    tapsConnectionFree(conn);
+    tapsListenerStop(listener, &callbacks);
+}
+
+static void
+_unix_connection_error(void *conn, char *reason)
+{
+    failed = 1;
+    _unix_closed(conn);
+}
+
+static void
+_unix_stopped(void *l)
+{
+    stopped = 1;
+    event_base_loopbreak(base);
+}
+
+static void *
+_unix_connection_received(void *l, TAPS_CTX *conn, void **cb)
+{
+    *cb = &callbacks;
+    if (tapsConnectionReceive(conn, NULL, NULL, 0, RCV_CHUNK,
+            &callbacks) < 0) {
+        failed = 1;
+    }
+    return conn;
+}
+
+static void
+_unix_timeout(evutil_socket_t fd, short event, void *arg)
+{
+    printf("UNIX test timed out\n");
+    failed = 1;
+    event_base_loopbreak(base);
+}
+
+/* Send len bytes from the client, and wait for the server to echo them */
+static int
+_unix_exchange(int client, unsigned char *buf, size_t len)
+{
+    unsigned char echo[BIG_RECORD + 1];
+    int           sent = numSent;
+
+    if (send(client, buf, len, 0) != len) {
+        return -1;
+    }
+    while ((numSent == sent) && !failed) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+    if (failed || (recv(client, echo, sizeof(echo), 0) != len) ||
+            (memcmp(echo, buf, len) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the client, and let the listener stop and remove its socket file */
+static int
+_unix_finish(int client)
+{
+    stopping = 1;
+    close(client);
+    if (!stopped) {
+        event_base_dispatch(base);
+    }
+    if (failed || !stopped) {
+        return -1;
+    }
+    if ((access(UNIX_TEST_PATH, F_OK) == 0) || (errno != ENOENT)) {
+        printf("UNIX listener left its socket file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Run one module: stream through a preconnection, or seqpacket directly */
+static int
+_unix_test(int seqpacket)
+{
+    int                 result = 0;
+    TAPS_CTX           *ep = NULL, *tp = NULL, *pc = NULL;
+    struct event       *timeout = NULL;
+    struct timeval      limit = { 10, 0 };
+    struct sockaddr_un  sun;
+    unsigned char       buf[BIG_RECORD];
+    int                 client = -1, stale = -1, i;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.connectionReceived = &_unix_connection_received;
+    callbacks.establishmentError = &_unix_establishment_error;
+    callbacks.stopped = &_unix_stopped;
+    callbacks.sent = &_unix_sent;
+    callbacks.sendError = &_unix_send_error;
+    callbacks.received = &_unix_received;
+    callbacks.receivedPartial = &_unix_received_partial;
+    callbacks.receiveError = &_unix_receive_error;
+    callbacks.closed = &_unix_closed;
+    callbacks.connectionError = &_unix_connection_error;
+    listener = NULL;
+    failed = stopping = stopped = numPartial = numReceived = numSent = 0;
+    records = seqpacket;
+    accLen = 0;
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, UNIX_TEST_PATH);
+
+    /* A socket file left by a listener that is gone doesn't get in the way */
+    unlink(UNIX_TEST_PATH);
+    stale = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((stale < 0) ||
+            (bind(stale, (struct sockaddr *)&sun, sizeof(sun)) < 0)) {
+        goto fail;
+    }
+    close(stale);
+
+    base = event_base_new();
+    if (!base) goto fail;
+    if (seqpacket) {
+        listener = tapsListenerNew(NULL, SEQPACKET_LIB,
+                (struct sockaddr *)&sun, &base, 1, &callbacks);
+    } else {
+        /* Loopback, with a socket path as well, is local */
+        ep = tapsEndpointNew();
+        tp = tapsTransportPropertiesNew(TAPS_LISTENER);
+        if (!ep || !tp) goto fail;
+        if (!tapsEndpointWithPort(ep, UNIX_TEST_PORT)) goto fail;
+        if (!tapsEndpointWithIPv4Address(ep, "127.0.0.1")) goto fail;
+        if (!tapsEndpointWithPath(ep, UNIX_TEST_PATH)) goto fail;
+        pc = tapsPreconnectionNew(&ep, 1, NULL, 0, tp, NULL);
+        if (!pc) goto fail;
+        listener = tapsPreconnectionListen(pc, NULL, base, &callbacks);
+    }
+    if (!listener) goto fail;
+    timeout = evtimer_new(base, &_unix_timeout, NULL);
+    if (!timeout) goto fail;
+    event_add(timeout, &limit);
+
+    client = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if ((client < 0) ||
+            (connect(client, (struct sockaddr *)&sun, sizeof(sun)) < 0)) {
+        goto fail;
+    }
+    if (_unix_exchange(client, buf, SMALL_RECORD) < 0) goto fail;
+    if (seqpacket) {
+        /* A record bigger than the Receive comes up in pieces, and only the
+           last one ends the message */
+        if (_unix_exchange(client, buf, BIG_RECORD) < 0) goto fail;
+        if ((numReceived != 2) ||
+                (numPartial != (BIG_RECORD - 1) / RCV_CHUNK)) {
+            goto fail;
+        }
+        /* An empty record is an empty message, not the end of the stream */
+        if (send(client, buf, 0, 0) != 0) goto fail;
+        while ((numReceived == 2) && !failed) {
+            event_base_loop(base, EVLOOP_ONCE);
+        }
+        if (_unix_exchange(client, buf, SMALL_RECORD) < 0) goto fail;
+        if (numReceived != 4) goto fail;
+    } else if (numReceived != 0) {
+        goto fail;
+    }
+    if (_unix_finish(client) < 0) {
+        client = -1;
+        goto fail;
+    }
+    client = -1;
+    result = 1;
+fail:
+    if (client >= 0) close(client);
+    if (listener && stopped) tapsListenerFree(listener);
+    if (pc) tapsPreconnectionFree(pc);
+    if (ep) tapsEndpointFree(ep);
+    if (tp) tapsTransportPropertiesFree(tp);
+    if (timeout) event_free(timeout);
+    if (base) event_base_free(base);
+    return result;
+}
+
+int unixTest()
+{
+    int result = _unix_test(0) && _unix_test(1);
+
+    TEST_OUTPUT(result);
+    return result;
+}